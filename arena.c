@@ -0,0 +1,196 @@
+//
+// A simple bump allocator, for the many small, short-lived allocations made while converting
+// a package. Nothing is freed individually, the whole arena is released in one go when the
+// conversion is done, so there's nothing to leak and very few calls into malloc.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logStuff.h"
+#include "arena.h"
+
+/* every allocation is rounded up to a multiple of this, so it is suitably aligned for anything */
+#define kArenaAlignment     (sizeof( max_align_t ))
+
+typedef struct sArenaChunk {
+    struct sArenaChunk * next;
+    size_t               size;      // bytes available in data[]
+    size_t               used;      // bytes handed out so far
+    max_align_t          data[];
+} tArenaChunk;
+
+struct sArena {
+    tArenaChunk *        chunks;    // the chunk being allocated from is always first
+    size_t               chunkSize;
+    void *               last;      // the most recent allocation, which arenaRealloc() can grow in place
+};
+
+/**
+ * @brief
+ * @param size
+ * @return size rounded up to kArenaAlignment
+ */
+static size_t alignSize( size_t size )
+{
+    return ( size + kArenaAlignment - 1 ) & ~( kArenaAlignment - 1 );
+}
+
+/**
+ * @brief add a chunk to the front of the arena's list
+ * @param arena
+ * @param size  the minimum number of bytes it must hold
+ * @return the new chunk, or NULL
+ */
+static tArenaChunk * addChunk( tArena * arena, size_t size )
+{
+    if ( size < arena->chunkSize )
+    {
+        size = arena->chunkSize;
+    }
+
+    tArenaChunk * chunk = malloc( sizeof( tArenaChunk ) + size );
+    if ( chunk == NULL )
+    {
+        logError( "unable to allocate an arena chunk of %lu bytes", size );
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    return chunk;
+}
+
+/**
+ * @brief
+ * @param chunkSize  allocations are carved out of chunks this big. Larger
+ *                   allocations get a chunk of their own.
+ * @return the new arena, or NULL
+ */
+tArena * newArena( size_t chunkSize )
+{
+    tArena * arena = calloc( 1, sizeof( tArena ) );
+    if ( arena != NULL )
+    {
+        arena->chunkSize = alignSize( chunkSize );
+        if ( addChunk( arena, arena->chunkSize ) == NULL )
+        {
+            free( arena );
+            arena = NULL;
+        }
+    }
+    return arena;
+}
+
+/**
+ * @brief release everything that was allocated from the arena, and the arena itself
+ * @param arena
+ */
+void freeArena( tArena * arena )
+{
+    if ( arena != NULL )
+    {
+        tArenaChunk * chunk = arena->chunks;
+        while ( chunk != NULL )
+        {
+            tArenaChunk * next = chunk->next;
+            free( chunk );
+            chunk = next;
+        }
+        free( arena );
+    }
+}
+
+/**
+ * @brief
+ * @param arena
+ * @param size
+ * @return uninitialized memory, valid until freeArena(), or NULL
+ */
+void * arenaAlloc( tArena * arena, size_t size )
+{
+    size = alignSize( size );
+
+    tArenaChunk * chunk = arena->chunks;
+    if ( chunk->size - chunk->used < size )
+    {
+        chunk = addChunk( arena, size );
+        if ( chunk == NULL )
+        {
+            return NULL;
+        }
+    }
+
+    void * result = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    arena->last = result;
+
+    return result;
+}
+
+/**
+ * @brief
+ * @param arena
+ * @param size
+ * @return zeroed memory, valid until freeArena(), or NULL
+ */
+void * arenaCalloc( tArena * arena, size_t size )
+{
+    void * result = arenaAlloc( arena, size );
+    if ( result != NULL )
+    {
+        memset( result, 0, size );
+    }
+    return result;
+}
+
+/**
+ * @brief resize an allocation. If it's the most recent one and there's room left in its
+ * chunk, it is resized in place, so a string that is repeatedly appended to doesn't copy.
+ * @param arena
+ * @param ptr      may be NULL
+ * @param oldSize  the number of bytes of ptr that must be preserved
+ * @param newSize
+ * @return the resized allocation, or NULL. ptr remains valid either way
+ */
+void * arenaRealloc( tArena * arena, void * ptr, size_t oldSize, size_t newSize )
+{
+    if ( ptr != NULL && ptr == arena->last )
+    {
+        tArenaChunk * chunk  = arena->chunks;
+        size_t        offset = (char *)ptr - (char *)chunk->data;
+        if ( chunk->size - offset >= alignSize( newSize ) )
+        {
+            chunk->used = offset + alignSize( newSize );
+            return ptr;
+        }
+    }
+
+    void * result = arenaAlloc( arena, newSize );
+    if ( result != NULL && ptr != NULL )
+    {
+        memcpy( result, ptr, ( oldSize < newSize ) ? oldSize : newSize );
+    }
+    return result;
+}
+
+/**
+ * @brief
+ * @param arena
+ * @param string
+ * @return a copy of string, valid until freeArena(), or NULL
+ */
+char * arenaStrdup( tArena * arena, const char * string )
+{
+    size_t size = strlen( string ) + 1;
+    char * result = arenaAlloc( arena, size );
+    if ( result != NULL )
+    {
+        memcpy( result, string, size );
+    }
+    return result;
+}
@@ -0,0 +1,15 @@
+#ifndef UCIFS_ARENA_H
+#define UCIFS_ARENA_H
+
+#include <stddef.h>
+
+typedef struct sArena tArena;
+
+tArena * newArena(     size_t chunkSize );
+void     freeArena(    tArena * arena );
+void *   arenaAlloc(   tArena * arena, size_t size );
+void *   arenaCalloc(  tArena * arena, size_t size );
+void *   arenaRealloc( tArena * arena, void * ptr, size_t oldSize, size_t newSize );
+char *   arenaStrdup(  tArena * arena, const char * string );
+
+#endif //UCIFS_ARENA_H
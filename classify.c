@@ -0,0 +1,504 @@
+//
+// Works out what kind of value a UCI option holds, so it can be given the right 'type' metadata.
+// A quick scan summarizes which classes of character the value contains, which rules out most
+// types without looking any further. Only the candidates that survive are parsed strictly.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "logStuff.h"
+#include "classify.h"
+
+const char * gValueTypeAsStr[kValueMaxType] =
+    {
+        [kValueString]   = "string",
+        [kValueInteger]  = "long",
+        [kValueBoolean]  = "boolean",
+        [kValueMAC]      = "macaddr",
+        [kValueIPv4]     = "ipv4addr",
+        [kValueNetmask]  = "netmask",
+        [kValueIPv4CIDR] = "ipv4cidr",
+        [kValueIPv6]     = "ipv6addr",
+        [kValueIPv6CIDR] = "ipv6cidr"
+    };
+
+/* character classes. Every character belongs to exactly one */
+enum {
+    kClassDigit    = 1 << 0,    // 0-9
+    kClassHexAlpha = 1 << 1,    // a-f, A-F
+    kClassPeriod   = 1 << 2,
+    kClassColon    = 1 << 3,
+    kClassSlash    = 1 << 4,
+    kClassMinus    = 1 << 5,
+    kClassOther    = 1 << 6
+};
+
+#define D kClassDigit
+#define H kClassHexAlpha
+
+/* indexed by (unsigned char). Anything not listed is zero, i.e. kClassOther */
+static const unsigned char kCharClass[256] =
+    {
+        ['0'] = D, ['1'] = D, ['2'] = D, ['3'] = D, ['4'] = D,
+        ['5'] = D, ['6'] = D, ['7'] = D, ['8'] = D, ['9'] = D,
+        ['a'] = H, ['b'] = H, ['c'] = H, ['d'] = H, ['e'] = H, ['f'] = H,
+        ['A'] = H, ['B'] = H, ['C'] = H, ['D'] = H, ['E'] = H, ['F'] = H,
+        ['.'] = kClassPeriod,
+        [':'] = kClassColon,
+        ['/'] = kClassSlash,
+        ['-'] = kClassMinus
+    };
+
+#undef D
+#undef H
+
+typedef struct {
+    unsigned int    classes;    // the union of the classes of every character
+    unsigned int    periods;
+    unsigned int    colons;
+    unsigned int    slashes;
+} tSummary;
+
+/**
+ * @brief the scalar scan, for whatever is left over after the vector loops
+ * @param summary
+ * @param p
+ * @param length
+ */
+static void summarizeTail( tSummary * summary, const unsigned char * p, size_t length )
+{
+    for ( size_t i = 0; i < length; ++i )
+    {
+        unsigned int class = kCharClass[ p[i] ];
+        summary->classes |= ( class != 0 ) ? class : kClassOther;
+        summary->periods += ( class == kClassPeriod );
+        summary->colons  += ( class == kClassColon );
+        summary->slashes += ( class == kClassSlash );
+    }
+}
+
+#if defined(__AVX2__)
+
+/**
+ * @brief fold the masks of one 32 byte block into the summary
+ */
+static void summarize32( tSummary * summary, __m256i v )
+{
+    const __m256i caseBit = _mm256_set1_epi8( 0x20 );
+
+    /* bytes >= 0x80 are negative when compared as signed, so fall into 'other' */
+    __m256i digit  = _mm256_and_si256( _mm256_cmpgt_epi8( v, _mm256_set1_epi8( '0' - 1 ) ),
+                                       _mm256_cmpgt_epi8( _mm256_set1_epi8( '9' + 1 ), v ) );
+    __m256i lower  = _mm256_or_si256( v, caseBit );
+    __m256i hex    = _mm256_and_si256( _mm256_cmpgt_epi8( lower, _mm256_set1_epi8( 'a' - 1 ) ),
+                                       _mm256_cmpgt_epi8( _mm256_set1_epi8( 'f' + 1 ), lower ) );
+    __m256i period = _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '.' ) );
+    __m256i colon  = _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ':' ) );
+    __m256i slash  = _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '/' ) );
+    __m256i minus  = _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '-' ) );
+
+    unsigned int digitBits  = _mm256_movemask_epi8( digit );
+    unsigned int hexBits    = _mm256_movemask_epi8( hex );
+    unsigned int periodBits = _mm256_movemask_epi8( period );
+    unsigned int colonBits  = _mm256_movemask_epi8( colon );
+    unsigned int slashBits  = _mm256_movemask_epi8( slash );
+    unsigned int minusBits  = _mm256_movemask_epi8( minus );
+    unsigned int knownBits  = digitBits | hexBits | periodBits | colonBits | slashBits | minusBits;
+
+    summary->classes |= ( digitBits  ? kClassDigit    : 0 )
+                      | ( hexBits    ? kClassHexAlpha : 0 )
+                      | ( periodBits ? kClassPeriod   : 0 )
+                      | ( colonBits  ? kClassColon    : 0 )
+                      | ( slashBits  ? kClassSlash    : 0 )
+                      | ( minusBits  ? kClassMinus    : 0 )
+                      | ( knownBits != 0xFFFFFFFFu ? kClassOther : 0 );
+    summary->periods += __builtin_popcount( periodBits );
+    summary->colons  += __builtin_popcount( colonBits );
+    summary->slashes += __builtin_popcount( slashBits );
+}
+
+#elif defined(__SSE2__)
+
+/**
+ * @brief fold the masks of one 16 byte block into the summary
+ */
+static void summarize16( tSummary * summary, __m128i v )
+{
+    const __m128i caseBit = _mm_set1_epi8( 0x20 );
+
+    /* bytes >= 0x80 are negative when compared as signed, so fall into 'other' */
+    __m128i digit  = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( '0' - 1 ) ),
+                                    _mm_cmplt_epi8( v, _mm_set1_epi8( '9' + 1 ) ) );
+    __m128i lower  = _mm_or_si128( v, caseBit );
+    __m128i hex    = _mm_and_si128( _mm_cmpgt_epi8( lower, _mm_set1_epi8( 'a' - 1 ) ),
+                                    _mm_cmplt_epi8( lower, _mm_set1_epi8( 'f' + 1 ) ) );
+    __m128i period = _mm_cmpeq_epi8( v, _mm_set1_epi8( '.' ) );
+    __m128i colon  = _mm_cmpeq_epi8( v, _mm_set1_epi8( ':' ) );
+    __m128i slash  = _mm_cmpeq_epi8( v, _mm_set1_epi8( '/' ) );
+    __m128i minus  = _mm_cmpeq_epi8( v, _mm_set1_epi8( '-' ) );
+
+    unsigned int digitBits  = _mm_movemask_epi8( digit );
+    unsigned int hexBits    = _mm_movemask_epi8( hex );
+    unsigned int periodBits = _mm_movemask_epi8( period );
+    unsigned int colonBits  = _mm_movemask_epi8( colon );
+    unsigned int slashBits  = _mm_movemask_epi8( slash );
+    unsigned int minusBits  = _mm_movemask_epi8( minus );
+    unsigned int knownBits  = digitBits | hexBits | periodBits | colonBits | slashBits | minusBits;
+
+    summary->classes |= ( digitBits  ? kClassDigit    : 0 )
+                      | ( hexBits    ? kClassHexAlpha : 0 )
+                      | ( periodBits ? kClassPeriod   : 0 )
+                      | ( colonBits  ? kClassColon    : 0 )
+                      | ( slashBits  ? kClassSlash    : 0 )
+                      | ( minusBits  ? kClassMinus    : 0 )
+                      | ( knownBits != 0xFFFFu ? kClassOther : 0 );
+    summary->periods += __builtin_popcount( periodBits );
+    summary->colons  += __builtin_popcount( colonBits );
+    summary->slashes += __builtin_popcount( slashBits );
+}
+
+#endif
+
+/**
+ * @brief find out which classes of character the value contains, and count the separators
+ * @param summary
+ * @param value
+ * @param length
+ */
+static void summarize( tSummary * summary, const char * value, size_t length )
+{
+    const unsigned char * p = (const unsigned char *)value;
+
+    memset( summary, 0, sizeof( tSummary ) );
+
+#if defined(__AVX2__)
+    for ( ; length >= 32; p += 32, length -= 32 )
+    {
+        summarize32( summary, _mm256_loadu_si256( (const __m256i *)p ) );
+    }
+#elif defined(__SSE2__)
+    for ( ; length >= 16; p += 16, length -= 16 )
+    {
+        summarize16( summary, _mm_loadu_si128( (const __m128i *)p ) );
+    }
+#endif
+
+    summarizeTail( summary, p, length );
+}
+
+/**
+ * @brief true if the summary has no classes other than those allowed
+ */
+static int onlyClasses( const tSummary * summary, unsigned int allowed )
+{
+    return ( summary->classes & ~allowed ) == 0;
+}
+
+/**
+ * @brief parse a canonical decimal number, i.e. one that printf("%lu") would reproduce exactly
+ * @param p       updated to point past the digits
+ * @param end
+ * @param limit   the largest acceptable value
+ * @param result
+ * @return true if there was a canonical number no larger than limit
+ */
+static int parseDecimal( const char ** p, const char * end, unsigned long limit, unsigned long * result )
+{
+    const char * s = *p;
+    unsigned long value = 0;
+
+    if ( s >= end || kCharClass[ (unsigned char)*s ] != kClassDigit )
+    {
+        return 0;
+    }
+    /* a leading zero is only allowed on zero itself */
+    if ( *s == '0' && s + 1 < end && kCharClass[ (unsigned char)s[1] ] == kClassDigit )
+    {
+        return 0;
+    }
+    for ( ; s < end && kCharClass[ (unsigned char)*s ] == kClassDigit; ++s )
+    {
+        unsigned int digit = *s - '0';
+        if ( value > ( limit - digit ) / 10 )
+        {
+            return 0;
+        }
+        value = value * 10 + digit;
+    }
+
+    *p = s;
+    *result = value;
+    return 1;
+}
+
+/**
+ * @brief
+ * @param value
+ * @param end
+ * @param integer
+ * @return true if the whole of value is a canonical integer that fits in a long
+ */
+static int parseInteger( const char * value, const char * end, long * integer )
+{
+    const char * p = value;
+    int negative = ( *p == '-' );
+    if ( negative ) ++p;
+
+    unsigned long magnitude;
+    unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    if ( !parseDecimal( &p, end, limit, &magnitude ) || p != end || ( negative && magnitude == 0 ) )
+    {
+        return 0;
+    }
+
+    *integer = negative ? (long)( 0 - magnitude ) : (long)magnitude;
+    return 1;
+}
+
+/**
+ * @brief
+ * @param value
+ * @param end
+ * @param address  set to the address, in host byte order
+ * @return true if the whole of value is a dotted quad
+ */
+static int parseIPv4( const char * value, const char * end, unsigned long * address )
+{
+    const char * p = value;
+    unsigned long result = 0;
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        unsigned long octet;
+        if ( i > 0 && ( p >= end || *p++ != '.' ) )
+        {
+            return 0;
+        }
+        if ( !parseDecimal( &p, end, 255, &octet ) )
+        {
+            return 0;
+        }
+        result = ( result << 8 ) | octet;
+    }
+
+    *address = result;
+    return ( p == end );
+}
+
+/**
+ * @brief a netmask is a run of ones followed by a run of zeros. To avoid mistaking the
+ * likes of 0.0.0.0 or 10.0.0.0 for one, the first octet has to be all ones.
+ * @param address
+ * @return
+ */
+static int isNetmask( unsigned long address )
+{
+    unsigned long inverted = ~address & 0xFFFFFFFFul;
+    return ( address & 0xFF000000ul ) == 0xFF000000ul && ( inverted & ( inverted + 1 ) ) == 0;
+}
+
+/**
+ * @brief
+ * @param value
+ * @param end
+ * @return true if the whole of value is an IPv6 address, as accepted by inet_pton()
+ */
+static int parseIPv6( const char * value, const char * end )
+{
+    const char * p = value;
+    int  groups   = 0;
+    int  gap      = 0;    // seen a '::'
+
+    if ( end - p >= 2 && p[0] == ':' && p[1] == ':' )
+    {
+        gap = 1;
+        p += 2;
+    }
+    else if ( p < end && *p == ':' )
+    {
+        return 0;   // a single leading colon
+    }
+
+    while ( p < end )
+    {
+        /* an embedded IPv4 address can only come last, and takes the place of two groups */
+        const char * group = p;
+        int digits = 0;
+        while ( p < end && ( kCharClass[ (unsigned char)*p ] & ( kClassDigit | kClassHexAlpha ) ) )
+        {
+            ++p;
+            ++digits;
+        }
+        if ( p < end && *p == '.' )
+        {
+            unsigned long ipv4;
+            if ( !parseIPv4( group, end, &ipv4 ) )
+            {
+                return 0;
+            }
+            groups += 2;
+            p = end;
+            break;
+        }
+        if ( digits == 0 || digits > 4 )
+        {
+            return 0;
+        }
+        ++groups;
+
+        if ( p == end )
+        {
+            break;
+        }
+        /* p must be at a ':' */
+        ++p;
+        if ( p < end && *p == ':' )
+        {
+            if ( gap )
+            {
+                return 0;   // only one '::' is allowed
+            }
+            gap = 1;
+            ++p;
+        }
+        else if ( p == end )
+        {
+            return 0;   // a single trailing colon
+        }
+    }
+
+    return gap ? ( groups <= 7 ) : ( groups == 8 );
+}
+
+/**
+ * @brief
+ * @param value
+ * @return true if value is exactly six pairs of hex digits separated by colons
+ */
+static int isMAC( const char * value, size_t length )
+{
+    if ( length != 17 )
+    {
+        return 0;
+    }
+    for ( int i = 0; i < 17; ++i )
+    {
+        unsigned int class = kCharClass[ (unsigned char)value[i] ];
+        if ( ( i % 3 ) == 2 ? ( class != kClassColon ) : !( class & ( kClassDigit | kClassHexAlpha ) ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief
+ * @param value
+ * @return true if value is one of the words UCI treats as a boolean
+ */
+static int isBoolean( const char * value )
+{
+    static const char * const kBooleans[] =
+        { "yes", "no", "on", "off", "true", "false", "enabled", "disabled", NULL };
+
+    for ( int i = 0; kBooleans[i] != NULL; ++i )
+    {
+        if ( strcmp( value, kBooleans[i] ) == 0 )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief work out the type of a value. Only values whose textual form will be reproduced
+ * exactly by elektra2uci() are classified as integers, so e.g. '0755' remains a string.
+ * @param value
+ * @param integer  set to the value when it's an integer
+ * @return
+ */
+eValueType classifyValue( const char * value, long * integer )
+{
+    size_t       length = strlen( value );
+    const char * end    = &value[length];
+
+    if ( length == 0 )
+    {
+        return kValueString;
+    }
+
+    tSummary summary;
+    summarize( &summary, value, length );
+
+    if ( onlyClasses( &summary, kClassDigit | kClassMinus ) )
+    {
+        return parseInteger( value, end, integer ) ? kValueInteger : kValueString;
+    }
+
+    if ( summary.periods == 3 && onlyClasses( &summary, kClassDigit | kClassPeriod ) )
+    {
+        unsigned long address;
+        if ( parseIPv4( value, end, &address ) )
+        {
+            return isNetmask( address ) ? kValueNetmask : kValueIPv4;
+        }
+        return kValueString;
+    }
+
+    if ( summary.slashes == 1 && onlyClasses( &summary, kClassDigit | kClassPeriod | kClassSlash ) )
+    {
+        /* either address/prefix or address/netmask */
+        const char * slash = memchr( value, '/', length );
+        const char * p = slash + 1;
+        unsigned long address, prefix;
+        if ( parseIPv4( value, slash, &address )
+          && ( ( parseDecimal( &p, end, 32, &prefix ) && p == end )
+            || ( parseIPv4( slash + 1, end, &address ) && isNetmask( address ) ) ) )
+        {
+            return kValueIPv4CIDR;
+        }
+        return kValueString;
+    }
+
+    if ( summary.colons >= 2 && onlyClasses( &summary, kClassDigit | kClassHexAlpha | kClassColon | kClassPeriod | kClassSlash ) )
+    {
+        if ( summary.colons == 5 && summary.slashes == 0 && isMAC( value, length ) )
+        {
+            return kValueMAC;
+        }
+        if ( summary.slashes == 0 )
+        {
+            return parseIPv6( value, end ) ? kValueIPv6 : kValueString;
+        }
+        if ( summary.slashes == 1 )
+        {
+            const char * slash = memchr( value, '/', length );
+            const char * p = slash + 1;
+            unsigned long prefix;
+            if ( parseIPv6( value, slash ) && parseDecimal( &p, end, 128, &prefix ) && p == end )
+            {
+                return kValueIPv6CIDR;
+            }
+        }
+        return kValueString;
+    }
+
+    if ( length <= 8 && isBoolean( value ) )
+    {
+        return kValueBoolean;
+    }
+
+    return kValueString;
+}
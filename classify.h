@@ -0,0 +1,21 @@
+#ifndef UCIFS_CLASSIFY_H
+#define UCIFS_CLASSIFY_H
+
+typedef enum {
+    kValueString = 0,   // anything that isn't strictly one of the following
+    kValueInteger,      // canonical decimal that fits in a long, i.e. no leading zeros or '+'
+    kValueBoolean,      // yes/no, on/off, true/false, enabled/disabled
+    kValueMAC,          // xx:xx:xx:xx:xx:xx
+    kValueIPv4,         // dotted quad, no leading zeros
+    kValueNetmask,      // dotted quad with contiguous leading ones, e.g. 255.255.255.0
+    kValueIPv4CIDR,     // IPv4 address followed by /prefix or /netmask
+    kValueIPv6,
+    kValueIPv6CIDR,     // IPv6 address followed by /prefix
+    kValueMaxType
+} eValueType;
+
+extern const char * gValueTypeAsStr[kValueMaxType];
+
+eValueType classifyValue( const char * value, long * integer );
+
+#endif //UCIFS_CLASSIFY_H
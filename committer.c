@@ -0,0 +1,296 @@
+//
+// Commits the files that have been written to in the background, so close() doesn't wait
+// for the backend. Files are gathered until the coalescing window closes (or an fsync asks
+// for them), so a burst of saves costs one kdbSet rather than one each.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "logStuff.h"
+#include "fileHandles.h"
+#include "committer.h"
+
+/* the most files that can be waiting for a commit. Once full, queueCommit() closes the
+ * window early and blocks until the worker takes the batch, so writers are held back
+ * rather than queueing without limit while the backend is slow */
+#define kMaxPendingCommits  64
+
+typedef struct sCommitter {
+    tMountPoint *       mountPoint;
+    unsigned int        windowMillis;
+    pthread_t           thread;
+    pthread_mutex_t     lock;           // protects everything below
+    pthread_cond_t      wake;           // signalled when a file is queued, a flush is wanted, or on stop
+    pthread_cond_t      progress;       // broadcast whenever a batch is taken, and when it's been committed
+    tFileHandle **      pending;        // each holds a reference, released once committed
+    size_t              count;
+    tFileHandle **      committing;     // the batch the worker is committing. The two arrays swap over
+    size_t              committingCount;
+    struct timespec     deadline;       // when the window opened by the first pending file closes
+    tBool               flushNow;
+    tBool               stop;
+} tCommitter;
+
+
+/**
+ * @brief
+ * @param ts
+ * @param millis
+ */
+static void addMillis( struct timespec * ts, unsigned int millis )
+{
+    ts->tv_sec  += millis / 1000;
+    ts->tv_nsec += (long)( millis % 1000 ) * 1000000L;
+    if ( ts->tv_nsec >= 1000000000L )
+    {
+        ts->tv_sec  += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * @brief
+ * @param a
+ * @param b
+ * @return true if a is before b
+ */
+static tBool isBefore( const struct timespec * a, const struct timespec * b )
+{
+    return a->tv_sec < b->tv_sec || ( a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec );
+}
+
+/**
+ * @brief wait for files to be queued, let the window run its course, then commit them as one batch
+ * @param arg
+ * @return
+ */
+static void * committerThread( void * arg )
+{
+    tCommitter * committer = arg;
+
+    pthread_mutex_lock( &committer->lock );
+    for (;;)
+    {
+        while ( committer->count == 0 && !committer->stop )
+        {
+            pthread_cond_wait( &committer->wake, &committer->lock );
+        }
+        if ( committer->count == 0 )
+        {
+            break;  // stopping, and nothing left to commit
+        }
+
+        /* the window isn't extended by later saves, so a steady stream of them can't starve the commit */
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        while ( !committer->flushNow && !committer->stop && isBefore( &now, &committer->deadline ) )
+        {
+            pthread_cond_timedwait( &committer->wake, &committer->lock, &committer->deadline );
+            clock_gettime( CLOCK_MONOTONIC, &now );
+        }
+
+        /* take the batch, so more files can be queued while it's being committed */
+        tFileHandle ** batch = committer->pending;
+        size_t         count = committer->count;
+        committer->pending         = committer->committing;
+        committer->count           = 0;
+        committer->committing      = batch;
+        committer->committingCount = count;
+        committer->flushNow        = no;
+        pthread_cond_broadcast( &committer->progress );
+        pthread_mutex_unlock( &committer->lock );
+
+        logDebug( "committing %lu file(s)", count );
+        commitFHs( committer->mountPoint, batch, count );
+        for ( size_t i = 0; i < count; ++i )
+        {
+            putFH( batch[i] );
+        }
+
+        pthread_mutex_lock( &committer->lock );
+        committer->committingCount = 0;
+        pthread_cond_broadcast( &committer->progress );
+    }
+    pthread_mutex_unlock( &committer->lock );
+
+    return NULL;
+}
+
+/**
+ * @brief start the thread that commits written files in batches
+ * @param mountPoint
+ * @param windowMillis  how long to wait after the first save for more to arrive
+ * @return the committer, or NULL on failure (the caller should then commit synchronously)
+ */
+tCommitter * startCommitter( tMountPoint * mountPoint, unsigned int windowMillis )
+{
+    tCommitter * committer = calloc( 1, sizeof( tCommitter ) );
+    if ( committer == NULL )
+    {
+        logError( "failed to allocate the committer" );
+        return NULL;
+    }
+
+    committer->mountPoint   = mountPoint;
+    committer->windowMillis = windowMillis;
+    committer->pending      = calloc( kMaxPendingCommits, sizeof( tFileHandle * ) );
+    committer->committing   = calloc( kMaxPendingCommits, sizeof( tFileHandle * ) );
+    if ( committer->pending == NULL || committer->committing == NULL )
+    {
+        logError( "failed to allocate the commit queue" );
+        free( committer->pending );
+        free( committer->committing );
+        free( committer );
+        return NULL;
+    }
+    pthread_mutex_init( &committer->lock, NULL );
+    pthread_cond_init( &committer->progress, NULL );
+
+    /* the deadline is measured on the monotonic clock, so setting the time doesn't upset it */
+    pthread_condattr_t attr;
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &committer->wake, &attr );
+    pthread_condattr_destroy( &attr );
+
+    errno = pthread_create( &committer->thread, NULL, committerThread, committer );
+    if ( errno != 0 )
+    {
+        logError( "unable to start the committer thread" );
+        pthread_cond_destroy( &committer->wake );
+        pthread_cond_destroy( &committer->progress );
+        pthread_mutex_destroy( &committer->lock );
+        free( committer->pending );
+        free( committer->committing );
+        free( committer );
+        return NULL;
+    }
+
+    logDebug( "commit window %u ms, up to %d files", windowMillis, kMaxPendingCommits );
+    return committer;
+}
+
+/**
+ * @brief commit anything still pending, then stop the thread
+ * @param committer
+ */
+void stopCommitter( tCommitter * committer )
+{
+    if ( committer == NULL )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &committer->lock );
+    committer->stop = yes;
+    pthread_cond_signal( &committer->wake );
+    pthread_cond_broadcast( &committer->progress );
+    pthread_mutex_unlock( &committer->lock );
+
+    pthread_join( committer->thread, NULL );
+
+    pthread_cond_destroy( &committer->wake );
+    pthread_cond_destroy( &committer->progress );
+    pthread_mutex_destroy( &committer->lock );
+    free( committer->pending );
+    free( committer->committing );
+    free( committer );
+}
+
+/**
+ * @brief
+ * @param list
+ * @param count
+ * @param fh
+ * @return true if fh is one of the count entries in list
+ */
+static tBool isListed( tFileHandle * const * list, size_t count, const tFileHandle * fh )
+{
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( list[i] == fh )
+        {
+            return yes;
+        }
+    }
+    return no;
+}
+
+/**
+ * @brief add fh to the next batch, unless it's already in it. If the queue is full, the
+ * window is closed early and the caller waits for the worker to take the batch.
+ * @param committer
+ * @param fh
+ * @return 0 on success, or -ESHUTDOWN if the committer is stopping
+ */
+int queueCommit( tCommitter * committer, tFileHandle * fh )
+{
+    int result = 0;
+
+    pthread_mutex_lock( &committer->lock );
+
+    if ( !isListed( committer->pending, committer->count, fh ) )
+    {
+        while ( committer->count == kMaxPendingCommits && !committer->stop )
+        {
+            logDebug( "commit queue full, waiting to queue \'%s\'", getFHpath( fh ) );
+            committer->flushNow = yes;
+            pthread_cond_signal( &committer->wake );
+            pthread_cond_wait( &committer->progress, &committer->lock );
+        }
+
+        if ( committer->stop )
+        {
+            result = -ESHUTDOWN;
+        }
+        else
+        {
+            if ( committer->count == 0 )
+            {
+                /* the first file of a batch opens the window */
+                clock_gettime( CLOCK_MONOTONIC, &committer->deadline );
+                addMillis( &committer->deadline, committer->windowMillis );
+                pthread_cond_signal( &committer->wake );
+            }
+            committer->pending[ committer->count++ ] = retainFH( fh );
+        }
+    }
+
+    pthread_mutex_unlock( &committer->lock );
+
+    return result;
+}
+
+/**
+ * @brief wait until any commit of fh that has been queued, or is under way, has reached the
+ * backend. The window is closed early if fh is still waiting in it.
+ * @param committer
+ * @param fh
+ */
+void waitForCommit( tCommitter * committer, tFileHandle * fh )
+{
+    pthread_mutex_lock( &committer->lock );
+
+    for (;;)
+    {
+        if ( isListed( committer->pending, committer->count, fh ) )
+        {
+            committer->flushNow = yes;
+            pthread_cond_signal( &committer->wake );
+        }
+        else if ( !isListed( committer->committing, committer->committingCount, fh ) )
+        {
+            break;
+        }
+        pthread_cond_wait( &committer->progress, &committer->lock );
+    }
+
+    pthread_mutex_unlock( &committer->lock );
+}
@@ -0,0 +1,13 @@
+#ifndef UCIFS_COMMITTER_H
+#define UCIFS_COMMITTER_H
+
+#include "fileHandles.h"
+
+typedef struct sCommitter tCommitter;
+
+tCommitter *    startCommitter( tMountPoint * mountPoint, unsigned int windowMillis );
+void            stopCommitter(  tCommitter * committer );
+int             queueCommit(    tCommitter * committer, tFileHandle * fh );
+void            waitForCommit(  tCommitter * committer, tFileHandle * fh );
+
+#endif //UCIFS_COMMITTER_H
@@ -5,46 +5,592 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#include <uci.h>
-
 #include "logStuff.h"
 #include "utils.h"
 #include "ucifs.h"
 #include "fileHandles.h"
 #include "uci2libelektra.h"
+#include "watcher.h"
+#include "committer.h"
+#include "stats.h"
+
+/* without a watcher to tell us when the backend changes, rebuild the root dir if it's older than this */
+#define kRootRefreshSecs        5
+
+/* the root file table starts with this many slots, and doubles whenever it becomes half full.
+ * Must be a power of two, so a hash can be reduced to a slot index with a simple mask */
+#define kInitialRootFileSlots   32
+
+/* the conversion of a typical package fits comfortably in one chunk of this size */
+#define kParseArenaChunkSize    (16 * 1024)
+
+/*
+ * Locking: fuse calls us from several threads at once, so
+ *  - mountPoint->lock guards the root file table, rootStat and the root bookkeeping,
+ *  - fh->renderLock lets only one thread at a time render a file,
+ *  - fh->lock guards the contents of a file, its snapshot pointer and its st,
+ *  - the elektra session serializes itself,
+ *  - mountPoint->inodes.lock guards the set of inode numbers in use. It's only ever taken last,
+ *    and nothing else is taken while it's held, as a handle gives its number back when it's freed.
+ * When more than one is needed, they are always taken in that order: root, then render, then fh,
+ * then elektra. A render doesn't hold fh->lock while it talks to elektra, it only takes it to
+ * publish the result, so nothing ever waits on fh->lock for longer than a copy.
+ * The generation numbers are only ever accessed atomically, so a file can be invalidated
+ * without taking its lock.
+ *
+ * A file handle is reference counted. The root file table holds one reference, and every
+ * findFH() caller, every open file and every kernel lookup holds another, so a handle removed
+ * from the table by populateRoot() isn't freed until the last user lets go of it with putFH().
+ */
+
+/* a version of the clean contents of a file, which never changes once it's published. A render
+ * publishes a new one, and every open pins the one that was current when it opened, so its reads
+ * neither wait for a render or a write, nor see the contents change part way through. It's freed
+ * once the last open or read lets go of it. */
+typedef struct sSnapshot {
+    int                  refCount;       // only accessed atomically
+    int                  fd;             // a memfd copy for fuse to splice from, or -1 until one is needed. Only accessed atomically
+    tBuffer              contents;
+} tSnapshot;
 
 typedef struct sFileHandle {
-    tFileHandle *        next;
+    pthread_rwlock_t     lock;
+    pthread_mutex_t      renderLock;     // held while rendering, so two threads don't both render the same generation
+    int                  refCount;       // only accessed atomically. see retainFH() and putFH()
     struct stat          st;
     const char *         path;
     tHash                pathHash;
-    char *               contents;
+    size_t               slot;           // index of this fh in mountPoint->rootFiles.slots
+    struct sMountPoint * mountPoint;     // gets st_ino back when the fh is freed
+    tSnapshot *          snapshot;       // the current clean contents, or NULL if not rendered yet
+    tBuffer              contents;       // a private copy of the snapshot, made by the first write. capacity grows geometrically
+    unsigned long        generation;         // bumped whenever the backend copy of this package may have changed
+    unsigned long        renderedGeneration; // the generation that 'snapshot' was rendered from
+    unsigned long        openedGeneration;   // the rendered generation the last open saw, so the kernel's cached copy can be reused
     int                  buildCount;     // for 'mark/sweep' GC. will be set from buildCounter during a populateRoot.
-    tBool                dirty;
+    tBool                dirty;          // written to since it was last rendered or parsed, so 'contents' is the current copy
 } tFileHandle;
 
 typedef struct sMountPoint {
+    pthread_rwlock_t     lock;
     time_t               lastUpdated;    // last time the root dir was populated
     int                  buildCounter;   // part of a 'mark/sweep' algo to maintain the root dir
-    struct sFileHandle * rootFiles;
+    unsigned long        generation;     // source of the per-file generation numbers
+    tWatcher *           watcher;        // reports changes to the backend, or NULL if we have to poll
+    tElektraSession *    elektra;        // shared by every render and commit on this mount
+    tCommitter *         committer;      // commits in the background, or NULL if it couldn't be started
+    struct {
+        tFileHandle **   slots;          // open-addressed hash table (linear probing), keyed by path
+        size_t           size;           // number of slots, always a power of two
+        size_t           count;          // number of occupied slots
+    } rootFiles;
+    struct {
+        pthread_mutex_t  lock;
+        ino_t *          slots;          // open-addressed hash set (linear probing), 0 marks an empty slot
+        size_t           size;           // number of slots, always a power of two
+        size_t           count;          // number of occupied slots
+    } inodes;                            // the st_ino of every fh not yet freed, whether it's in rootFiles or not
     struct stat          rootStat;
 } tMountPoint;
 
 
+/**
+ * @brief find the slot that either holds the file handle matching path, or the empty
+ * slot that terminates its probe sequence (i.e. where it would be inserted).
+ * A hash match alone isn't enough, hashString() can collide, so the paths are compared too.
+ * @param mountPoint
+ * @param path
+ * @param hash
+ * @return slot index
+ */
+static size_t probeRootFiles( tMountPoint * mountPoint, const char * path, tHash hash )
+{
+    size_t mask = mountPoint->rootFiles.size - 1;
+    size_t slot = hash & mask;
+
+    tFileHandle * fh;
+    while ( (fh = mountPoint->rootFiles.slots[slot]) != NULL )
+    {
+        if ( fh->pathHash == hash && strcmp( fh->path, path ) == 0 )
+        {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief the slot in the inode set that either holds ino, or the empty slot that
+ * terminates its probe sequence. The caller must hold the inodes lock.
+ * @param mountPoint
+ * @param ino
+ * @return slot index
+ */
+static size_t probeInodes( tMountPoint * mountPoint, ino_t ino )
+{
+    size_t mask = mountPoint->inodes.size - 1;
+    size_t slot = ( ino ^ ( ino >> 29 ) ) & mask;
+
+    while ( mountPoint->inodes.slots[slot] != 0 && mountPoint->inodes.slots[slot] != ino )
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief make sure the inode set has room for one more, doubling it once it's half full.
+ * The caller must hold the inodes lock.
+ * @param mountPoint
+ * @return 0 on success, or -ENOMEM
+ */
+static int reserveInode( tMountPoint * mountPoint )
+{
+    if ( ( mountPoint->inodes.count + 1 ) * 2 <= mountPoint->inodes.size )
+    {
+        return 0;
+    }
+
+    ino_t * oldSlots = mountPoint->inodes.slots;
+    size_t  oldSize  = mountPoint->inodes.size;
+    size_t  newSize  = ( oldSize == 0 ) ? kInitialRootFileSlots : oldSize * 2;
+
+    ino_t * newSlots = calloc( newSize, sizeof( ino_t ) );
+    if ( newSlots == NULL )
+    {
+        logError( "failed to allocate %lu inode slots", newSize );
+        return -ENOMEM;
+    }
+
+    mountPoint->inodes.slots = newSlots;
+    mountPoint->inodes.size  = newSize;
+    for ( size_t i = 0; i < oldSize; ++i )
+    {
+        if ( oldSlots[i] != 0 )
+        {
+            newSlots[ probeInodes( mountPoint, oldSlots[i] ) ] = oldSlots[i];
+        }
+    }
+    free( oldSlots );
+
+    return 0;
+}
+
+/**
+ * @brief pick the inode number for a new package, and mark it as in use. It's derived from the
+ * path, so a package keeps the same st_ino across remounts, and when it is removed and re-created.
+ * If another file handle still has it - including one that's been removed from the root, but that
+ * the kernel or an open file still holds - the next free number is used instead.
+ * The caller must hold the root lock.
+ * @param mountPoint
+ * @param pathHash
+ * @return the inode number, never less than kFirstPackageInode, or 0 if it couldn't be recorded
+ */
+static ino_t packageInode( tMountPoint * mountPoint, tHash pathHash )
+{
+    ino_t ino = (ino_t)pathHash;
+
+    pthread_mutex_lock( &mountPoint->inodes.lock );
+
+    if ( reserveInode( mountPoint ) != 0 )
+    {
+        ino = 0;
+    }
+    else
+    {
+        size_t slot;
+        for (;;)
+        {
+            if ( ino < kFirstPackageInode )
+            {
+                ino += kFirstPackageInode;
+            }
+            slot = probeInodes( mountPoint, ino );
+            if ( mountPoint->inodes.slots[slot] == 0 )
+            {
+                break;
+            }
+            logWarning( "inode %lu is already in use", (unsigned long)ino );
+            ++ino;
+        }
+        mountPoint->inodes.slots[slot] = ino;
+        ++mountPoint->inodes.count;
+    }
+
+    pthread_mutex_unlock( &mountPoint->inodes.lock );
+
+    return ino;
+}
+
+/**
+ * @brief give an inode number back once the file handle that had it is freed. The entries
+ * after it in the same run are shifted back, so the probe sequences stay unbroken.
+ * @param mountPoint
+ * @param ino
+ */
+static void freeInode( tMountPoint * mountPoint, ino_t ino )
+{
+    pthread_mutex_lock( &mountPoint->inodes.lock );
+
+    if ( mountPoint->inodes.slots != NULL )
+    {
+        size_t mask = mountPoint->inodes.size - 1;
+        size_t hole = probeInodes( mountPoint, ino );
+
+        if ( mountPoint->inodes.slots[hole] == ino )
+        {
+            mountPoint->inodes.slots[hole] = 0;
+            --mountPoint->inodes.count;
+
+            for ( size_t slot = (hole + 1) & mask; mountPoint->inodes.slots[slot] != 0; slot = (slot + 1) & mask )
+            {
+                ino_t  moving = mountPoint->inodes.slots[slot];
+                size_t home   = ( moving ^ ( moving >> 29 ) ) & mask;
+                /* it can fill the hole unless its home lies cyclically in (hole, slot] */
+                if ( ( (slot - home) & mask ) >= ( (slot - hole) & mask ) )
+                {
+                    mountPoint->inodes.slots[hole] = moving;
+                    mountPoint->inodes.slots[slot] = 0;
+                    hole = slot;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &mountPoint->inodes.lock );
+}
+
+/**
+ * @brief re-home every file handle into a table with newSize slots
+ * @param mountPoint
+ * @param newSize must be a power of two
+ * @return 0 on success, or -ENOMEM
+ */
+static int resizeRootFiles( tMountPoint * mountPoint, size_t newSize )
+{
+    tFileHandle ** oldSlots = mountPoint->rootFiles.slots;
+    size_t         oldSize  = mountPoint->rootFiles.size;
+
+    tFileHandle ** newSlots = calloc( newSize, sizeof( tFileHandle * ) );
+    if ( newSlots == NULL )
+    {
+        logError( "failed to allocate %lu root file slots", newSize );
+        return -ENOMEM;
+    }
+
+    mountPoint->rootFiles.slots = newSlots;
+    mountPoint->rootFiles.size  = newSize;
+
+    for ( size_t i = 0; i < oldSize; ++i )
+    {
+        tFileHandle * fh = oldSlots[i];
+        if ( fh != NULL )
+        {
+            /* the paths are already known to be unique, so the first empty slot will do */
+            size_t slot = fh->pathHash & (newSize - 1);
+            while ( newSlots[slot] != NULL )
+            {
+                slot = (slot + 1) & (newSize - 1);
+            }
+            newSlots[slot] = fh;
+            fh->slot = slot;
+        }
+    }
+    free( oldSlots );
+
+    return 0;
+}
+
+/**
+ * @brief add a file handle to the root file table, growing it if it would become more than half full
+ * @param mountPoint
+ * @param fh
+ * @return 0 on success, or -ENOMEM
+ */
+static int insertRootFile( tMountPoint * mountPoint, tFileHandle * fh )
+{
+    if ( (mountPoint->rootFiles.count + 1) * 2 > mountPoint->rootFiles.size )
+    {
+        int result = resizeRootFiles( mountPoint, mountPoint->rootFiles.size * 2 );
+        if ( result != 0 )
+        {
+            return result;
+        }
+    }
+
+    size_t slot = probeRootFiles( mountPoint, fh->path, fh->pathHash );
+    mountPoint->rootFiles.slots[slot] = fh;
+    mountPoint->rootFiles.count++;
+    fh->slot = slot;
+
+    return 0;
+}
+
+/**
+ * @brief unhook the file handle in the given slot from the root file table. Rather than
+ * leaving a tombstone, later members of the same probe cluster are shifted back to fill
+ * the hole, so lookups never have to skip over deleted entries.
+ * Note: a later entry may be moved into 'slot', so a caller scanning the table should
+ * examine the same slot again.
+ * @param mountPoint
+ * @param slot
+ */
+static void removeRootFile( tMountPoint * mountPoint, size_t slot )
+{
+    tFileHandle ** slots = mountPoint->rootFiles.slots;
+    size_t         mask  = mountPoint->rootFiles.size - 1;
+    size_t         hole  = slot;
+
+    /* a node the kernel still holds now refers to a file that has gone */
+    pthread_rwlock_wrlock( &slots[hole]->lock );
+    slots[hole]->st.st_nlink = 0;
+    pthread_rwlock_unlock( &slots[hole]->lock );
+
+    slots[hole] = NULL;
+    mountPoint->rootFiles.count--;
+
+    for ( size_t i = (hole + 1) & mask; slots[i] != NULL; i = (i + 1) & mask )
+    {
+        size_t home = slots[i]->pathHash & mask;
+        /* the entry can fill the hole only if its home slot isn't cyclically in (hole, i] */
+        if ( ((i - home) & mask) >= ((i - hole) & mask) )
+        {
+            slots[hole] = slots[i];
+            slots[hole]->slot = hole;
+            slots[i] = NULL;
+            hole = i;
+        }
+    }
+}
+
+/**
+ * @brief take over contents as a new snapshot
+ * @param contents  emptied, as the snapshot now owns its buffer
+ * @return the new snapshot, with one reference, or NULL on failure
+ */
+static tSnapshot * newSnapshot( tBuffer * contents )
+{
+    tSnapshot * snapshot = calloc( 1, sizeof( tSnapshot ) );
+    if ( snapshot == NULL )
+    {
+        logError( "unable to allocate a snapshot" );
+        return NULL;
+    }
+    snapshot->refCount = 1;
+    snapshot->fd       = -1;
+    snapshot->contents = *contents;
+
+    contents->data     = NULL;
+    contents->length   = 0;
+    contents->capacity = 0;
+
+    return snapshot;
+}
+
 /**
  * @brief
+ * @param snapshot
+ * @return snapshot
+ */
+tSnapshot * retainSnapshot( tSnapshot * snapshot )
+{
+    if ( snapshot != NULL )
+    {
+        __atomic_add_fetch( &snapshot->refCount, 1, __ATOMIC_RELAXED );
+    }
+    return snapshot;
+}
+
+/**
+ * @brief drop a reference to snapshot, freeing it if that was the last one
+ * @param snapshot
+ */
+void putSnapshot( tSnapshot * snapshot )
+{
+    if ( snapshot != NULL && __atomic_sub_fetch( &snapshot->refCount, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        if ( snapshot->fd >= 0 )
+        {
+            close( snapshot->fd );
+        }
+        free( snapshot->contents.data );
+        free( snapshot );
+    }
+}
+
+/**
+ * @brief copy contents into a new memfd
+ * @param path  only used to name the memfd, which makes it easier to spot in /proc/<pid>/fd
+ * @param contents
+ * @return the file descriptor, or -1 on failure
+ */
+static int newMemFile( const char * path, const tBuffer * contents )
+{
+    int fd = memfd_create( path, MFD_CLOEXEC );
+    if ( fd < 0 )
+    {
+        logError( "unable to create a memfd for %s", path );
+        return -1;
+    }
+
+    size_t written = 0;
+    while ( written < contents->length )
+    {
+        ssize_t count = pwrite( fd, &contents->data[written], contents->length - written, written );
+        if ( count < 0 && errno != EINTR )
+        {
+            logError( "unable to write %s to its memfd", path );
+            close( fd );
+            return -1;
+        }
+        if ( count > 0 ) written += count;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief get a file descriptor holding the contents of a snapshot, for fuse to splice from.
+ * It's made by the first read that asks for it, and remains valid as long as the snapshot does.
+ * No lock is needed, as the contents never change. If two threads race to make it, one of
+ * them throws its copy away.
+ * @param snapshot
+ * @param path    only used to name the memfd
+ * @param length  set to the length of the contents
+ * @return the file descriptor, or -1 if one couldn't be made
+ */
+int getSnapshotFd( tSnapshot * snapshot, const char * path, size_t * length )
+{
+    *length = snapshot->contents.length;
+
+    int fd = __atomic_load_n( &snapshot->fd, __ATOMIC_ACQUIRE );
+    if ( fd < 0 )
+    {
+        fd = newMemFile( path, &snapshot->contents );
+        int expected = -1;
+        if ( fd >= 0 && !__atomic_compare_exchange_n( &snapshot->fd, &expected, fd, 0,
+                                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+        {
+            close( fd );
+            fd = expected;
+        }
+    }
+    return fd;
+}
+
+/**
+ * @brief copy from a snapshot. No lock is needed, as the contents never change.
+ * @param snapshot
+ * @param buffer
+ * @param size
+ * @param offset
+ * @return the number of bytes copied, or -1 at the end of the file
+ */
+ssize_t readSnapshot( tSnapshot * snapshot, char * buffer, size_t size, off_t offset )
+{
+    ssize_t length = -1; // no more data to read - 'end of file'
+
+    if ( offset >= 0 && (size_t)offset < snapshot->contents.length )
+    {
+        length = snapshot->contents.length - offset;
+        if ( (size_t)length > size )
+        {
+            length = (ssize_t)size;
+        }
+        memcpy( buffer, &snapshot->contents.data[offset], length );
+    }
+    return length;
+}
+
+/**
+ * @brief replace the snapshot of fh with a newer one. The caller must hold fh->lock for writing.
+ * Opens that pinned the old one carry on reading it, it's freed when the last of them lets go.
+ * @param fh
+ * @param snapshot  fh takes over the reference
+ * @param generation the generation the snapshot was rendered from
+ */
+static void publishSnapshotFH( tFileHandle * fh, tSnapshot * snapshot, unsigned long generation )
+{
+    putSnapshot( fh->snapshot );
+    fh->snapshot = snapshot;
+    fh->renderedGeneration = generation;
+    fh->st.st_size = snapshot->contents.length;
+}
+
+/**
+ * @brief the first write since the file was rendered or parsed starts from a private copy of
+ * the snapshot, which readers of the snapshot never see. The caller must hold fh->lock for writing.
+ * @param fh
+ * @param keep  how much of the snapshot is needed, e.g. none when the file is about to be truncated
+ * @return 0 on success, or a negative errno
+ */
+static int beginWriteFH( tFileHandle * fh, size_t keep )
+{
+    int result = 0;
+
+    if ( !fh->dirty )
+    {
+        fh->contents.length = 0;
+        if ( fh->snapshot != NULL )
+        {
+            size_t length = fh->snapshot->contents.length;
+            result = appendToBuffer( &fh->contents, fh->snapshot->contents.data, ( keep < length ) ? keep : length );
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief note that the backend copy of a file may have changed, so the next
+ * refreshFH() will render it again rather than serving the cached contents
+ * @param mountPoint
+ * @param fh
+ */
+static void invalidateFH( tMountPoint * mountPoint, tFileHandle * fh )
+{
+    __atomic_store_n( &fh->generation,
+                      __atomic_add_fetch( &mountPoint->generation, 1, __ATOMIC_RELAXED ),
+                      __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief look up path in the root file table, without refreshing it first
+ * @param mountPoint
+ * @param path
+ * @return the matching file handle, or NULL if there isn't one
+ */
+static tFileHandle * lookupRootFile( tMountPoint * mountPoint, const char * path )
+{
+    if ( mountPoint->rootFiles.slots == NULL )
+    {
+        return NULL;
+    }
+    size_t slot = probeRootFiles( mountPoint, path, hashString( path ) );
+    return mountPoint->rootFiles.slots[slot];
+}
+
+
+/**
+ * @brief create a file handle and add it to the root file table, which owns the initial reference.
+ * The caller must hold the root lock for writing.
+ * @param mountPoint
  * @param path
  * @param mode
- * @return
+ * @return the new file handle, or NULL
  */
-tFileHandle * newFH( const char * path, int mode )
+static tFileHandle * allocFH( tMountPoint * mountPoint, const char * path, int mode )
 {
     tFileHandle * result = NULL;
 
@@ -55,6 +601,9 @@ tFileHandle * newFH( const char * path, int mode )
         result = calloc( 1, sizeof( tFileHandle ) );
         if ( result != NULL )
         {
+            pthread_rwlock_init( &result->lock, NULL );
+            pthread_mutex_init( &result->renderLock, NULL );
+            result->refCount = 1;
             result->path     = strdup( path );
             result->pathHash = hashString( result->path );
 
@@ -77,6 +626,8 @@ tFileHandle * newFH( const char * path, int mode )
             {
                 mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; // 0644
             }
+            result->mountPoint  = mountPoint;
+            result->st.st_ino   = packageInode( mountPoint, result->pathHash );
             result->st.st_mode  = mode;
             result->st.st_nlink = 1;
             result->st.st_size  = 1024;
@@ -86,18 +637,20 @@ tFileHandle * newFH( const char * path, int mode )
             result->st.st_mtime = now; // The last "m"odification of the file
             result->st.st_ctime = now; // The last "c"hange of the attributes of the file (it's new)
 
-            tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
-            if ( mountPoint != NULL )
-            {
-                result->st.st_uid = mountPoint->rootStat.st_uid;
-                result->st.st_gid = mountPoint->rootStat.st_gid;
+            result->st.st_uid = mountPoint->rootStat.st_uid;
+            result->st.st_gid = mountPoint->rootStat.st_gid;
+
+            /* nothing has been rendered yet, so make sure the contents look stale */
+            invalidateFH( mountPoint, result );
 
-                mountPoint->rootStat.st_mtime = now; // we have "m"odified the root directory
-                mountPoint->rootStat.st_ctime = now; // also "c"hanged the attributes of the root directory
+            mountPoint->rootStat.st_mtime = now; // we have "m"odified the root directory
+            mountPoint->rootStat.st_ctime = now; // also "c"hanged the attributes of the root directory
 
-                /* add it to the current list of files in the root dir */
-                result->next = mountPoint->rootFiles;
-                mountPoint->rootFiles = result;
+            /* add it to the table of files in the root dir */
+            if ( result->st.st_ino == 0 || insertRootFile( mountPoint, result ) != 0 )
+            {
+                releaseFH( result );
+                result = NULL;
             }
         }
     }
@@ -106,321 +659,683 @@ tFileHandle * newFH( const char * path, int mode )
 }
 
 /**
- * @brief
- * @param path
+ * @brief take an additional reference to fh, which must be balanced by a putFH()
+ * @param fh
+ * @return fh
+ */
+tFileHandle * retainFH( tFileHandle * fh )
+{
+    if ( fh != NULL )
+    {
+        __atomic_add_fetch( &fh->refCount, 1, __ATOMIC_RELAXED );
+    }
+    return fh;
+}
+
+/**
+ * @brief drop a reference to fh, freeing it if that was the last one
+ * @param fh
+ */
+void putFH( tFileHandle * fh )
+{
+    if ( fh != NULL && __atomic_sub_fetch( &fh->refCount, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        releaseFH( fh );
+    }
+}
+
+/**
+ * @brief create a file in the root directory. If another thread got there first,
+ * the existing file handle is returned instead.
+ * @param path
+ * @param mode
+ * @return a referenced file handle, to be released with putFH(), or NULL
+ */
+tFileHandle * newFH( const char * path, int mode )
+{
+    tFileHandle * result = NULL;
+
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    if ( mountPoint != NULL )
+    {
+        pthread_rwlock_wrlock( &mountPoint->lock );
+
+        result = lookupRootFile( mountPoint, path );
+        if ( result == NULL )
+        {
+            result = allocFH( mountPoint, path, mode );
+        }
+        retainFH( result );
+
+        pthread_rwlock_unlock( &mountPoint->lock );
+    }
+
+    return result;
+}
+
+/**
+ * @brief
+ * @param path
+ * @return a referenced file handle, to be released with putFH(), or NULL
+ */
+tFileHandle * findFH( const char * path )
+{
+    tFileHandle * result = NULL;
+
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    if ( mountPoint != NULL)
+    {
+        /* make sure the root cache is populated & up-to-date */
+        populateRoot( mountPoint );
+
+        pthread_rwlock_rdlock( &mountPoint->lock );
+        result = retainFH( lookupRootFile( mountPoint, path ) );
+        pthread_rwlock_unlock( &mountPoint->lock );
+    }
+
+    return result;
+}
+
+/**
+ * @brief hold the root file table steady while it is walked with nextFH()
+ * @param mountPoint
+ */
+void readLockRoot( tMountPoint * mountPoint )
+{
+    pthread_rwlock_rdlock( &mountPoint->lock );
+}
+
+/**
+ * @brief
+ * @param mountPoint
+ */
+void unlockRoot( tMountPoint * mountPoint )
+{
+    pthread_rwlock_unlock( &mountPoint->lock );
+}
+
+/**
+ * @brief the caller must hold the root lock (see readLockRoot()) for the whole walk
+ * @param fh
+ * @return
+ */
+tFileHandle * nextFH( tFileHandle * fh )
+{
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    if ( mountPoint == NULL || mountPoint->rootFiles.slots == NULL )
+    {
+        return NULL;
+    }
+
+    /* resume the scan of the table from the slot following the previous fh */
+    size_t slot = ( fh != NULL ) ? fh->slot + 1 : 0;
+
+    for ( fh = NULL; fh == NULL && slot < mountPoint->rootFiles.size; ++slot )
+    {
+        fh = mountPoint->rootFiles.slots[slot];
+    }
+    return fh;
+}
+
+/**
+ * @brief
+ * @param fh
+ * @return
+ */
+const char * getFHpath( tFileHandle * fh )
+{
+    return fh->path;
+}
+
+/**
+ * @brief take a consistent copy of the file's attributes
+ * @param fh
+ * @param st
+ */
+void getFHstat( tFileHandle * fh, struct stat * st )
+{
+    pthread_rwlock_rdlock( &fh->lock );
+    memcpy( st, (const void *)&fh->st, sizeof( struct stat ));
+    pthread_rwlock_unlock( &fh->lock );
+}
+
+/**
+ * @brief read the contents as they are now, including anything written that hasn't been
+ * committed yet. An open that pinned a snapshot reads that instead, see readSnapshot().
+ * @param fh
+ * @param buffer
+ * @param size
+ * @param offset
+ * @return the number of bytes copied, or -1 at the end of the file
+ */
+ssize_t readFH( tFileHandle * fh, char *buffer, size_t size, off_t offset)
+{
+    ssize_t length = -1; // no more data to read - 'end of file'
+
+    pthread_rwlock_rdlock( &fh->lock );
+
+    if ( fh->dirty )
+    {
+        ssize_t remaining = fh->st.st_size - offset;
+        if ( remaining < 0 )
+            remaining = 0;
+
+        length = (ssize_t)size;
+        // do we have enough data to satisfy the whole request?
+        if ( length > remaining )
+        {
+            // no, so trim it down to what remains
+            length = remaining;
+        }
+
+        if ( length > 0 )
+        {
+            memcpy( buffer, &fh->contents.data[offset], length );
+        }
+        else {
+            length = -1;
+        }
+    }
+    else if ( fh->snapshot != NULL )
+    {
+        length = readSnapshot( fh->snapshot, buffer, size, offset );
+    }
+
+    pthread_rwlock_unlock( &fh->lock );
+
+    return length;
+}
+
+/**
+ * @brief the tFillFH used by writeFH()
+ * @param dst
+ * @param size
+ * @param context the source buffer
+ * @return size
+ */
+static ssize_t copyFill( char * dst, size_t size, void * context )
+{
+    memcpy( dst, context, size );
+    return (ssize_t)size;
+}
+
+/**
+ * @brief make room for size bytes at offset in the contents, and let fill() put the data
+ * straight there. That way data arriving in a fuse_bufvec is only copied once.
+ * @param fh
+ * @param size
+ * @param offset
+ * @param fill
+ * @param context passed to fill()
+ * @return the number of bytes filled, or a negative errno
+ */
+ssize_t fillFH( tFileHandle * fh, size_t size, off_t offset, tFillFH fill, void * context )
+{
+    pthread_rwlock_wrlock( &fh->lock );
+
+    ssize_t result = beginWriteFH( fh, SIZE_MAX );
+
+    size_t end = offset + size;
+    if ( result == 0 && end > fh->contents.length )
+    {
+        /* the capacity grows geometrically, so a file streamed in small writes isn't
+         * copied again on every one of them */
+        result = reserveBuffer( &fh->contents, end - fh->contents.length );
+        if ( result != 0 )
+        {
+            logError( "failed to allocate memory for write" );
+        }
+        else if ( (size_t)offset > fh->contents.length )
+        {
+            /* any gap before offset reads back as zeros */
+            memset( &fh->contents.data[fh->contents.length], 0, offset - fh->contents.length );
+        }
+    }
+
+    if ( result == 0 )
+    {
+        result = fill( &fh->contents.data[offset], size, context );
+    }
+
+    if ( result > 0 )
+    {
+        end = offset + result;
+        if ( end > fh->contents.length )
+        {
+            fh->contents.length = end;
+            fh->st.st_size = end;
+        }
+        fh->st.st_mtime = time(NULL); // The last "m"odification of the contents of the file/directory
+        fh->st.st_size = fh->contents.length;
+        fh->dirty = 1;
+    }
+
+    pthread_rwlock_unlock( &fh->lock );
+
+    return result;
+}
+
+/**
+ * @brief
+ * @param fh
+ * @param buffer
+ * @param size
+ * @param offset
+ * @return the number of bytes written, or a negative errno
+ */
+ssize_t writeFH( tFileHandle * fh, const char *buffer, size_t size, off_t offset )
+{
+    return fillFH( fh, size, offset, copyFill, (void *)buffer );
+}
+
+/**
+ * @brief set the length of the file. The allocation is kept when it shrinks, so
+ * the usual truncate-then-rewrite of a config doesn't have to allocate again.
+ * @param fh
+ * @param offset
+ * @return 0 on success, or a negative errno
+ */
+int truncateFH( tFileHandle * fh, off_t offset )
+{
+    if ( offset < 0 )
+    {
+        logError( "attempted to truncate using a negative offset: %ld", offset );
+        return -EINVAL;
+    }
+
+    pthread_rwlock_wrlock( &fh->lock );
+
+    int result = beginWriteFH( fh, offset );
+    if ( result == 0 )
+    {
+        result = resizeBuffer( &fh->contents, offset );
+    }
+    fh->st.st_mtime = time(NULL); // The last "m"odification of the contents of the file
+    fh->st.st_size = fh->contents.length;
+    fh->dirty = 1;
+
+    pthread_rwlock_unlock( &fh->lock );
+
+    return result;
+}
+
+/**
+ * @brief pre-size the contents of a file, so later writes into the range don't have
+ * to grow it. Only plain allocation is supported, optionally with FALLOC_FL_KEEP_SIZE.
+ * @param fh
+ * @param mode
+ * @param offset
+ * @param length
+ * @return 0 on success, or a negative errno
+ */
+int allocateFH( tFileHandle * fh, int mode, off_t offset, off_t length )
+{
+    if ( offset < 0 || length <= 0 )
+    {
+        return -EINVAL;
+    }
+    if ( ( mode & ~FALLOC_FL_KEEP_SIZE ) != 0 )
+    {
+        /* punching holes, zeroing or collapsing ranges make no sense for a rendered config */
+        return -EOPNOTSUPP;
+    }
+
+    pthread_rwlock_wrlock( &fh->lock );
+
+    size_t end = offset + length;
+    int result = beginWriteFH( fh, SIZE_MAX );
+    if ( result == 0 && end > fh->contents.length )
+    {
+        if ( mode & FALLOC_FL_KEEP_SIZE )
+        {
+            result = reserveBuffer( &fh->contents, end - fh->contents.length );
+        }
+        else
+        {
+            result = resizeBuffer( &fh->contents, end );
+            fh->st.st_size  = fh->contents.length;
+            fh->st.st_mtime = time(NULL);
+            fh->dirty = 1;
+        }
+    }
+
+    pthread_rwlock_unlock( &fh->lock );
+
+    return result;
+}
+
+/**
+ * @brief the caller must hold fh->lock
+ * @param fh
+ * @return true if the contents need to be rendered again
+ */
+static tBool isStaleFH( tFileHandle * fh )
+{
+    return !fh->dirty && ( fh->snapshot == NULL
+                        || fh->renderedGeneration != __atomic_load_n( &fh->generation, __ATOMIC_ACQUIRE ) );
+}
+
+/**
+ * @brief render the backend copy of the package into a new snapshot, and publish it.
+ * fh->lock isn't held while elektra renders it, so reads (and writes) carry on meanwhile,
+ * and it's only taken to swap the new snapshot in. If the file was written to during the
+ * render, the writes win, and the snapshot is thrown away.
+ * @param fh
+ * @param onlyIfStale  don't render if the snapshot is already up to date
  * @return
  */
-tFileHandle * findFH( const char * path )
+static int renderFH( tFileHandle * fh, tBool onlyIfStale )
 {
-    tFileHandle * result = NULL;
+    int result = 0;
 
-    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
-    if ( mountPoint != NULL)
+    /* only one render at a time. Any other thread that wants it rendered waits here for the result */
+    pthread_mutex_lock( &fh->renderLock );
+
+    tBool stale = yes;
+    if ( onlyIfStale )
     {
-        /* make sure the root cache is populated & up-to-date */
-        populateRoot( mountPoint );
+        /* another thread may have rendered it while we waited for the lock */
+        pthread_rwlock_rdlock( &fh->lock );
+        stale = isStaleFH( fh );
+        pthread_rwlock_unlock( &fh->lock );
+    }
+
+    if ( stale )
+    {
+        /* ToDo: set the ctime & mtime from the 'last changed' timestamps of the enclosed UCI values */
+        const char * name = fh->path;
+        if ( *name == '/' ) ++name;
+
+        tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+
+        /* anything that changes the backend from here on will need another render */
+        unsigned long generation = __atomic_load_n( &fh->generation, __ATOMIC_ACQUIRE );
+        logDebug( "  render \'%s\' (generation %lu)", fh->path, generation );
 
-        tHash hash = hashString( path );
-        for ( result = mountPoint->rootFiles; result != NULL; result = result->next )
+        tBuffer output = { NULL, 0, 0 };
+        countStat( kStatRenders, 1 );
+        result = elektra2uci( mountPoint != NULL ? mountPoint->elektra : NULL, name, &output );
+
+        tSnapshot * snapshot = NULL;
+        if ( result == 0 )
         {
-            if ( hash == result->pathHash )
+            snapshot = newSnapshot( &output );
+            if ( snapshot == NULL )
             {
-                /* found an existing matching entry, so exit loop prematurely */
-                break;
+                result = -ENOMEM;
+            }
+        }
+        if ( result != 0 )
+        {
+            logError( "unable to populate %s", fh->path );
+            free( output.data );
+        }
+        else
+        {
+            pthread_rwlock_wrlock( &fh->lock );
+            if ( !fh->dirty )
+            {
+                publishSnapshotFH( fh, snapshot, generation );
+                snapshot = NULL;
             }
+            pthread_rwlock_unlock( &fh->lock );
+
+            putSnapshot( snapshot );
         }
     }
 
+    pthread_mutex_unlock( &fh->renderLock );
+
     return result;
 }
 
-
 /**
  * @brief
  * @param fh
- * @param path
  * @return
  */
-tFileHandle * getFH( tFileHandle * fh, const char * path )
+int populateFH( tFileHandle * fh )
 {
-    if ( path == NULL || *path == '\0' )
-    {
-        logError( "supplied path is empty" );
-        return NULL;
-    }
-
-    /* if fh is NULL, search through the root files for a
-     * match to the path. Often the case for doGetAttr() */
-    if ( fh == NULL )
-    {
-        fh = findFH( path );
-    }
+    int result = -EINVAL;
 
-#ifdef DEBUG
-    if ( fh == NULL)
-    {
-        logError("no matching UCI file handle found");
-    }
-    else if ( fh->path == NULL)
-    {
-        logError( "fh->path is null" );
-        free( fh );
-        fh = NULL;
-    }
-    else if ( strcmp( fh->path, path ) != 0 )
+    if ( fh != NULL )
     {
-        logError( "path and fh->path do not match" );
-        free( (void *)fh->path );
-        free( fh );
-        fh = NULL;
+        result = renderFH( fh, no );
     }
-#endif
 
-    return fh;
+    return result;
 }
 
 /**
- * @brief
+ * @brief make sure the contents of fh reflect the backend, re-rendering them only if the
+ * generation has moved on since they were last rendered. Contents that have been written
+ * to but not yet parsed are left alone, so they aren't clobbered by a getattr or open.
  * @param fh
  * @return
  */
-tFileHandle * nextFH( tFileHandle * fh )
+int refreshFH( tFileHandle * fh )
 {
+    int result = -EINVAL;
+
     if ( fh != NULL )
     {
-        fh = fh->next;
-    }
-    else
-    {
-        tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
-        fh = mountPoint->rootFiles;
+        result = 0;
+
+        /* the common case is that nothing has changed, which only needs the read lock to confirm */
+        pthread_rwlock_rdlock( &fh->lock );
+        tBool stale = isStaleFH( fh );
+        pthread_rwlock_unlock( &fh->lock );
+
+        if ( stale )
+        {
+            result = renderFH( fh, yes );
+        }
     }
-    return fh;
+
+    return result;
 }
 
 /**
- * @brief
+ * @brief note that fh is being opened, and pin the snapshot it will read. Also report whether
+ * the kernel's page cache of the previous open still matches the contents. If it does, the
+ * open can set keep_cache. Call after refreshFH(), so the snapshot is up to date.
  * @param fh
- * @return
+ * @param snapshot  set to a reference to the current snapshot, to be released with putSnapshot().
+ *                  NULL if the file has been written to, as then there's no clean copy to pin
+ * @return true if the contents haven't changed since the last open
  */
-const char * getFHpath( tFileHandle * fh )
+tBool openedFH( tFileHandle * fh, tSnapshot ** snapshot )
 {
-    return fh->path;
+    pthread_rwlock_wrlock( &fh->lock );
+
+    tBool unchanged = !fh->dirty && fh->snapshot != NULL
+                   && fh->openedGeneration == fh->renderedGeneration;
+    fh->openedGeneration = fh->renderedGeneration;
+    *snapshot = fh->dirty ? NULL : retainSnapshot( fh->snapshot );
+
+    pthread_rwlock_unlock( &fh->lock );
+
+    return unchanged;
 }
 
 /**
- * @brief
+ * @brief append an ETag for the contents a read would see now, including anything
+ * written that hasn't been committed yet
  * @param fh
- * @return
+ * @param etag  appended to
+ * @return 0 on success, or a negative errno
  */
-struct stat * getFHstat( tFileHandle * fh )
+int getFHetag( tFileHandle * fh, tBuffer * etag )
 {
-    return &fh->st;
+    int result = refreshFH( fh );
+    if ( result == 0 )
+    {
+        pthread_rwlock_rdlock( &fh->lock );
+        const tBuffer * contents = ( fh->dirty || fh->snapshot == NULL ) ? &fh->contents : &fh->snapshot->contents;
+        result = appendETag( etag, contents->data, contents->length );
+        pthread_rwlock_unlock( &fh->lock );
+    }
+    return result;
 }
 
 /**
- * @brief
+ * @brief the generation of the package in the backend. It moves on whenever the backend copy
+ * may have changed, so it's cheap to poll, but unlike the ETag it doesn't cover uncommitted writes.
  * @param fh
- * @param buffer
- * @param size
- * @param offset
  * @return
  */
-ssize_t readFH( tFileHandle * fh, char *buffer, size_t size, off_t offset)
+unsigned long getFHgeneration( tFileHandle * fh )
 {
-    ssize_t remaining = fh->st.st_size - offset;
-    if ( remaining < 0 )
-        remaining = 0;
-
-    ssize_t length = (ssize_t)size;
-    // do we have enough data to satisfy the whole request?
-    if ( length > remaining )
-    {
-        // no, so trim it down to what remains
-        length = remaining;
-    }
+    return __atomic_load_n( &fh->generation, __ATOMIC_ACQUIRE );
+}
 
-    if ( length > 0 )
-    {
-        memcpy( buffer, &fh->contents[offset], length );
-    }
-    else {
-        length = -1; // no more data to read - 'end of file'
-    }
+/**
+ * @brief the libelektra types of the options in the package, see getUCITypes()
+ * @param fh
+ * @param types appended to
+ * @return 0 on success, or a negative errno
+ */
+int getFHtypes( tFileHandle * fh, tBuffer * types )
+{
+    const char * name = fh->path;
+    if ( *name == '/' ) ++name;
 
-    return length;
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    return getUCITypes( mountPoint != NULL ? mountPoint->elektra : NULL, name, types );
 }
 
 /**
- * @brief
+ * @brief import the contents of fh as a UCI package, if they've been written to
+ * since they were last rendered or parsed
  * @param fh
- * @param buffer
- * @param size
- * @param offset
- * @return
+ * @param import
+ * @return true if fh was dirty
  */
-ssize_t writeFH( tFileHandle * fh, const char *buffer, size_t size, off_t offset )
+static tBool importFH( tFileHandle * fh, tUCIImport * import )
 {
-    ssize_t end = (ssize_t)(offset + size);
-    char * contents = fh->contents;
-    if ( contents == NULL )
-    {
-        logDebug( "  calloc %ld bytes", end );
-        contents = calloc( end, sizeof(byte) );
-        fh->st.st_size = end;
-    }
-    else if ( end > fh->st.st_size)
-    {
-        logDebug( "  realloc to %ld bytes", end );
-        contents = realloc( contents, end );
-        fh->st.st_size = end;
-    }
+    pthread_rwlock_wrlock( &fh->lock );
 
-    if ( contents == NULL )
+    tBool wasDirty = fh->dirty;
+    if ( wasDirty && fh->contents.data != NULL && fh->st.st_size > 0 )
     {
-        logError( "failed to allocate memory for write");
-        size = 0;
+        logDebug( "contents of %s:", fh->path );
+        logTextBlock( kLogDebug, fh->contents.data, fh->st.st_size );
+
+        const char *name = fh->path;
+        if (*name == '/') ++name;
+
+        /* parsed in place, which is safe as the lock keeps the contents from changing */
+        importUCIText( import, name, fh->contents.data, fh->st.st_size );
     }
-    else
+    if ( wasDirty )
     {
-        fh->contents = contents; // in case realloc() moved the block, or it's newly calloc'd.
-        fh->st.st_mtime = time(NULL); // The last "m"odification of the contents of the file/directory
-        fh->dirty = 1;
-        memcpy( &contents[offset], buffer, size );
+        /* until the commit is rendered back, opens and reads get what was written. It's
+         * still from the rendered generation, so the commit's invalidateFH() replaces it */
+        tSnapshot * written = newSnapshot( &fh->contents );
+        if ( written != NULL )
+        {
+            publishSnapshotFH( fh, written, fh->renderedGeneration );
+        }
     }
+    /* the package is now in the import, so any further writes will need another commit */
+    fh->dirty = 0;
 
-    return (ssize_t)size;
+    pthread_rwlock_unlock( &fh->lock );
+
+    return wasDirty;
 }
 
 /**
- * @brief
- * @param fh
- * @param offset
- * @return
+ * @brief commit a batch of files to the backend in one go. Every package is imported
+ * together, so commitUCIImport() can commit them with a single kdbSet.
+ * @param mountPoint
+ * @param batch
+ * @param count
  */
-int truncateFH( tFileHandle * fh, off_t offset )
+void commitFHs( tMountPoint * mountPoint, tFileHandle ** batch, size_t count )
 {
-    fh->st.st_mtime = time(NULL); // The last "m"odification of the contents of the file
+    /* every temporary made during the conversion is released in one go */
+    tArena * arena = newArena( kParseArenaChunkSize );
+    tUCIImport * import = ( arena != NULL ) ? newUCIImport( arena ) : NULL;
+    if ( import == NULL )
+    {
+        logError( "unable to start an import" );
+        if ( arena != NULL ) freeArena( arena );
+        return;
+    }
 
-    if ( offset == 0 )
+    tBool anyDirty = no;
+    for ( size_t i = 0; i < count; ++i )
     {
-        if ( fh->contents != NULL )
+        if ( importFH( batch[i], import ) )
         {
-            free( fh->contents );
-            fh->contents = NULL;
+            anyDirty = yes;
         }
-        fh->st.st_size = 0;
     }
-    else if ( offset > 0 )
+
+    if ( anyDirty && mountPoint != NULL )
     {
-        if ( fh->contents == NULL )
+        countStat( kStatCommits, 1 );
+        commitUCIImport( mountPoint->elektra, import );
+
+        /* the backend has (potentially) been changed, so render them afresh next time */
+        for ( size_t i = 0; i < count; ++i )
         {
-            fh->contents = calloc( offset, sizeof( byte ));
+            invalidateFH( mountPoint, batch[i] );
         }
-        else {
-            fh->contents = realloc( fh->contents, offset );
-        }
-        fh->st.st_size = offset;
-    }
-    else {
-        logError( "attempted to truncate using a negative offset: %ld", offset );
     }
-    return 0;
+
+    freeUCIImport( import );
+    freeArena( arena );
 }
 
 /**
- * @brief
+ * @brief pass the contents of fh back to the backend, if they've been written to.
+ * fh joins the committer's next batch, and this returns without waiting for it.
  * @param fh
  * @return
  */
-int populateFH( tFileHandle * fh )
+int parseFH( tFileHandle * fh )
 {
-    int result = -EINVAL;
+    if ( fh == NULL)
+    {
+        return -EINVAL;
+    }
 
-    if ( fh != NULL )
+    /* nothing to do if it hasn't been written to since it was last rendered or parsed */
+    pthread_rwlock_rdlock( &fh->lock );
+    tBool dirty = fh->dirty;
+    pthread_rwlock_unlock( &fh->lock );
+    if ( !dirty )
     {
-        /* ToDo: populate the contents from LibElektra */
-        /* ToDo: set the ctime & mtime from the 'last changed' timestamps of the enclosed UCI values */
-        if ( fh->contents != NULL)
-        {
-            free( fh->contents );
-            fh->contents = NULL;
-            fh->st.st_size = 0;
-        }
+        return 0;
+    }
 
-        /* ToDo: until we wire up LibElekta, set the contents to something */
-        int len = asprintf( (char **)&fh->contents, "Placeholder for %s\n", fh->path );
-        if ( len < 0 )
-        {
-            result = -errno;
-            logError( "unable to populate %s", fh->path );
-        }
-        else {
-            fh->st.st_size = len;
-            result = 0;
-        }
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    if ( mountPoint != NULL && mountPoint->committer != NULL
+      && queueCommit( mountPoint->committer, fh ) == 0 )
+    {
+        return 0;
     }
 
-    return result;
+    commitFHs( mountPoint, &fh, 1 );
+    return 0;
 }
 
 /**
- * @brief
+ * @brief make sure any changes to fh have reached the backend before returning
  * @param fh
  * @return
  */
-int parseFH( tFileHandle * fh )
+int syncFH( tFileHandle * fh )
 {
-    int result = -EINVAL;
+    int result = parseFH( fh );
 
-    if ( fh != NULL)
+    tMountPoint * mountPoint = (tMountPoint *)getPrivateData();
+    if ( result == 0 && mountPoint != NULL && mountPoint->committer != NULL )
     {
-        if ( fh->contents != NULL  )
-        {
-            if ( fh->st.st_size > 0 )
-            {
-                logDebug( "contents of %s:", fh->path );
-                logTextBlock( kLogDebug, fh->contents, fh->st.st_size );
-
-                /* use libuci to parse the contents into UCI structures */
-                struct uci_context * ctx = uci_alloc_context();
-
-                if ( ctx != NULL )
-                {
-                    const char *name = fh->path;
-                    if (*name == '/') ++name;
-
-                    struct uci_package * package = NULL;
-                    FILE * contentStream = fmemopen( fh->contents, fh->st.st_size, "r");
-
-                    result = uci_import( ctx, contentStream, name, &package, false);
-                    if ( result != 0 )
-                    {
-                        char * errStr;
-                        uci_get_errorstr( ctx, &errStr, "" );
-                        logError( " problem importing %s: %s", name, errStr );
-                    }
-                    else
-                    {
-                        uci2elektra( ctx );
-                    }
-                    uci_free_context(ctx);
-                }
-            }
-
-            fh->dirty = 0;
-
-#if 0
-            /* ToDDo: drop the contents, we're done parsing it */
-            free( fh->contents );
-            fh->contents = NULL;
-            fh->st.st_size = 0;
-#endif
-        }
-
-        result = 0;
+        waitForCommit( mountPoint->committer, fh );
     }
-
     return result;
 }
 
@@ -437,11 +1352,19 @@ void releaseFH( tFileHandle * fh )
             free( (void *)fh->path );
             fh->path = NULL;
         }
-        if ( fh->contents != NULL )
+        if ( fh->contents.data != NULL )
+        {
+            free( fh->contents.data );
+            fh->contents.data = NULL;
+        }
+        putSnapshot( fh->snapshot );
+        fh->snapshot = NULL;
+        if ( fh->mountPoint != NULL && fh->st.st_ino != 0 )
         {
-            free( fh->contents );
-            fh->contents = NULL;
+            freeInode( fh->mountPoint, fh->st.st_ino );
         }
+        pthread_mutex_destroy( &fh->renderLock );
+        pthread_rwlock_destroy( &fh->lock );
         free( fh );
     }
 }
@@ -457,15 +1380,24 @@ int releaseRoot( tMountPoint * mountPoint )
 
     if ( mountPoint != NULL )
     {
-        tFileHandle * fh = mountPoint->rootFiles;
-        mountPoint->rootFiles = NULL;
+        /* commit whatever is still waiting in the window before the session goes away */
+        stopCommitter( mountPoint->committer );
+        mountPoint->committer = NULL;
+        stopWatcher( mountPoint->watcher );
+        mountPoint->watcher = NULL;
+        closeElektraSession( mountPoint->elektra );
+        mountPoint->elektra = NULL;
+
         mountPoint->rootStat.st_nlink = 0;
-        while ( fh != NULL )
+        for ( size_t i = 0; i < mountPoint->rootFiles.size; ++i )
         {
-            tFileHandle * next = fh->next;
-            releaseFH( fh );
-            fh = next;
+            /* drop the table's reference */
+            putFH( mountPoint->rootFiles.slots[i] );
         }
+        free( mountPoint->rootFiles.slots );
+        free( mountPoint->inodes.slots );
+        pthread_mutex_destroy( &mountPoint->inodes.lock );
+        pthread_rwlock_destroy( &mountPoint->lock );
         free( mountPoint );
     }
 
@@ -484,9 +1416,12 @@ int getFileAttributes( tFileHandle * fh, struct stat * st )
 
     if ( fh != NULL )
     {
-        result = populateFH( fh );
-        fh->st.st_atime = time(NULL); // The last "a"ccess of the file/directory is right now
+        result = refreshFH( fh );
+
+        /* a stat isn't an access, so st_atime is left alone, and a read lock will do */
+        pthread_rwlock_rdlock( &fh->lock );
         memcpy( st, (const void *)&fh->st, sizeof( struct stat ));
+        pthread_rwlock_unlock( &fh->lock );
     }
 
     return result;
@@ -505,22 +1440,24 @@ int getDirAttributes( tMountPoint * mountPoint, struct stat * st )
     if ( mountPoint != NULL )
     {
         result = populateRoot( mountPoint );
-        mountPoint->rootStat.st_atime = time(NULL); // The last "a"ccess of the file/directory is right now
+
+        pthread_rwlock_rdlock( &mountPoint->lock );
         memcpy( st, (const void *)&mountPoint->rootStat, sizeof( struct stat ));
+        pthread_rwlock_unlock( &mountPoint->lock );
     }
 
     return result;
 }
 
 /**
- * @brief
- * @param path
- * @return
+ * @brief the libelektra session the mount point owns, for the hierarchical view, which
+ * reads and writes single keys instead of whole packages
+ * @param mountPoint
+ * @return the session, or NULL
  */
-int isDirectory( const char * path )
+tElektraSession * getElektraSession( tMountPoint * mountPoint )
 {
-    /* the only directory is at the root of the mount */
-    return ( path[0] == '/' && path[1] == '\0' );
+    return ( mountPoint != NULL ) ? mountPoint->elektra : NULL;
 }
 
 /**
@@ -528,80 +1465,137 @@ int isDirectory( const char * path )
  * Note: this is called *really* early, mountPoint can't be retrieved until _after_ this has returned
  * @param uid
  * @param gid
+ * @param watcher  the mount point takes ownership of it. May be NULL.
+ * @param elektra  the mount point takes ownership of it.
+ * @param commitWindowMillis  how long to gather written files before committing them together.
+ *                            Zero still commits in the background, just without waiting for more
  * @return
  */
-tMountPoint * initRoot( uid_t uid, gid_t gid )
+tMountPoint * initRoot( uid_t uid, gid_t gid, tWatcher * watcher, tElektraSession * elektra,
+                        unsigned int commitWindowMillis )
 {
     tMountPoint * mountPoint = calloc( 1, sizeof( tMountPoint ));
 
     if ( mountPoint != NULL)
     {
+        mountPoint->rootStat.st_ino = kRootInode;
         mountPoint->rootStat.st_uid = uid;
         mountPoint->rootStat.st_gid = gid;
+
+        mountPoint->rootFiles.slots = calloc( kInitialRootFileSlots, sizeof( tFileHandle * ) );
+        if ( mountPoint->rootFiles.slots == NULL )
+        {
+            logError( " failed to allocate root file table" );
+            free( mountPoint );
+            stopWatcher( watcher );
+            closeElektraSession( elektra );
+            return NULL;
+        }
+        mountPoint->rootFiles.size = kInitialRootFileSlots;
+        pthread_rwlock_init( &mountPoint->lock, NULL );
+        pthread_mutex_init( &mountPoint->inodes.lock, NULL );
+        mountPoint->watcher = watcher;
+        mountPoint->elektra = elektra;
+        /* if it can't be started, commits happen synchronously instead */
+        mountPoint->committer = startCommitter( mountPoint, commitWindowMillis );
     }
     else {
         logError( " failed to allocate mountPoint structure" );
+        stopWatcher( watcher );
+        closeElektraSession( elektra );
     }
 
     return mountPoint;
 }
 
 /**
- * @brief
+ * @brief apply the changes the watcher has seen in the backend since we last looked,
+ * so only the packages that were actually added, removed or modified are touched.
+ * The caller must hold the root lock for writing.
  * @param mountPoint
- * @return
  */
-int populateRoot( tMountPoint * mountPoint )
+static void applyRootChanges( tMountPoint * mountPoint )
 {
-    int result = 0;
+    char * path;
+    tBool  removed;
 
-    if ( mountPoint == NULL )
+    while ( (path = takeChangedPackage( mountPoint->watcher, &removed )) != NULL )
     {
-        logError("mountPoint structure is absent");
-        return -EFAULT;
-    }
-
-    time_t now = time(NULL);
+        tFileHandle * fh = lookupRootFile( mountPoint, path );
+        if ( removed )
+        {
+            if ( fh != NULL )
+            {
+                logDebug( "remove \'%s\'", path );
+                removeRootFile( mountPoint, fh->slot );
+                putFH( fh ); /* anyone still using it keeps it alive until they're done */
+            }
+        }
+        else if ( fh == NULL )
+        {
+            fh = allocFH( mountPoint, path, 0 );
+            if ( fh != NULL )
+            {
+                fh->buildCount = mountPoint->buildCounter;
+                populateFH( fh );
+            }
+        }
+        else
+        {
+            invalidateFH( mountPoint, fh );
+        }
+        free( path );
 
-    /* if we recently populated, then assume it's unlikely
-     * anything has changed, and reuse what we just built */
-    time_t age = now - mountPoint->lastUpdated;
-    if ( age < 5 )
-    {
-        return 0;
+        time_t now = time(NULL);
+        mountPoint->rootStat.st_mtime = now;
+        mountPoint->rootStat.st_ctime = now;
+        mountPoint->rootStat.st_nlink = mountPoint->rootFiles.count + 2; /* +2 to include '.' and '..' entries */
     }
+}
 
-    logDebug( "root cache is %lu secs old, so rebuild", age );
+/**
+ * @brief rebuild the root file table from scratch. The caller must hold the root lock for writing.
+ * @param mountPoint
+ */
+static void rebuildRoot( tMountPoint * mountPoint )
+{
+    time_t now = time(NULL);
 
-    mountPoint->lastUpdated = now;
+    __atomic_store_n( &mountPoint->lastUpdated, now, __ATOMIC_RELEASE );
 
     mountPoint->rootStat.st_mode = S_IFDIR | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; // 0644
     mountPoint->rootStat.st_size = 1024;
 
-    mountPoint->rootStat.st_atime = time(NULL); // The last "a"ccess of the file/directory is right now
-    mountPoint->rootStat.st_mtime = time(NULL); // The last "m"odification of the file/directory is right now
-    mountPoint->rootStat.st_ctime = time(NULL); // The last "c"hange of the file/directory is right now
+    mountPoint->rootStat.st_atime = now; // The last "a"ccess of the file/directory is right now
+    mountPoint->rootStat.st_mtime = now; // The last "m"odification of the file/directory is right now
+    mountPoint->rootStat.st_ctime = now; // The last "c"hange of the file/directory is right now
 
-    int buildCount = ++mountPoint->buildCounter;
+    int buildCount = mountPoint->buildCounter + 1;
 
     /* iterate through the current list of UCI files, marking the ones that still
      * exist with the new buildCount, and adding new ones */
     tFileHandle * fh;
     const char * path;
     int i;
-    for ( i = 0; (path = iterateUCIfiles( i )) != NULL; ++i )
+    for ( i = 0; (path = iterateUCIfiles( mountPoint->elektra, i )) != NULL; ++i )
     {
-        fh = findFH( path );
+        fh = lookupRootFile( mountPoint, path );
         if ( fh == NULL )
         {
             // did not find a matching entry in the list, so create a new one and add it
-            fh = newFH( path, 0 );
+            fh = allocFH( mountPoint, path, 0 );
             if (fh != NULL)
             {
                 /* fill in the contents */
                 populateFH( fh );
             }
         }
+        else
+        {
+            /* without a way to tell what has changed in the backend,
+             * assume any existing file may have changed */
+            invalidateFH( mountPoint, fh );
+        }
         if ( fh != NULL )
         {
             /* mark fh as 'seen' by updating the buildCount */
@@ -611,28 +1605,77 @@ int populateRoot( tMountPoint * mountPoint )
 
     mountPoint->rootStat.st_nlink = i + 2; /* +2 to include '.' and '..' entries */
 
-    /* now scan the list and remove anything that wasn't just marked with the new buildCount */
-    fh = mountPoint->rootFiles;
-    tFileHandle ** prev = &mountPoint->rootFiles;
-    while ( fh != NULL )
+    /* now scan the table and remove anything that wasn't just marked with the new buildCount */
+    size_t slot = 0;
+    while ( slot < mountPoint->rootFiles.size )
     {
-        /* preserve the pointer to the address holding the 'next' field used
-         * at the end of this loop to set 'prev' after it has been used */
-        tFileHandle ** nextprev = &fh->next;
-        if ( fh->buildCount != buildCount )
+        fh = mountPoint->rootFiles.slots[slot];
+        if ( fh != NULL && fh->buildCount != buildCount )
         {
             /* a stale buildCount value means it's a 'dead' entry - i.e. a LibElektra entry that
-             * is no longer being returned by iterateUCIfiles(). So unlink and dispose of it */
+             * is no longer being returned by iterateUCIfiles(). So unlink it, and drop the
+             * table's reference. It's freed once any thread still using it has finished. */
             logDebug( "remove \'%s\'", fh->path );
-            *prev = fh->next; /* 'unhook' this fh from the linked list */
-            releaseFH( fh );
-            nextprev = prev;  /* in case we need to also remove the next fh in the list */
+            removeRootFile( mountPoint, slot );
+            putFH( fh );
+            /* removeRootFile() may have shifted another entry into this slot, so look at it again */
+        }
+        else
+        {
+            ++slot;
         }
-        /* on first iteration, prev points at mountPoint->rootFiles, subsequent
-         * iterations it points at the fh->next field of the _previous_ fh */
-        fh = *prev; /* pick up the next fh */
-        prev = nextprev; /* point at the 'next' field in the _previous_ fh */
     }
 
-    return result;
+    /* only publish the new buildCounter once the table is complete, since
+     * populateRoot() peeks at it without holding the lock */
+    __atomic_store_n( &mountPoint->buildCounter, buildCount, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief
+ * @param mountPoint
+ * @return
+ */
+int populateRoot( tMountPoint * mountPoint )
+{
+    if ( mountPoint == NULL )
+    {
+        logError("mountPoint structure is absent");
+        return -EFAULT;
+    }
+
+    if ( mountPoint->watcher != NULL && __atomic_load_n( &mountPoint->buildCounter, __ATOMIC_ACQUIRE ) > 0 )
+    {
+        /* the root has been built, and we'll be told when it changes.
+         * Only take the write lock if there is actually something to apply */
+        if ( hasChangedPackages( mountPoint->watcher ) )
+        {
+            pthread_rwlock_wrlock( &mountPoint->lock );
+            applyRootChanges( mountPoint );
+            pthread_rwlock_unlock( &mountPoint->lock );
+        }
+        return 0;
+    }
+
+    /* if we recently populated, then assume it's unlikely
+     * anything has changed, and reuse what we just built */
+    time_t age = time(NULL) - __atomic_load_n( &mountPoint->lastUpdated, __ATOMIC_ACQUIRE );
+    if ( age < kRootRefreshSecs )
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock( &mountPoint->lock );
+
+    /* check again, another thread may have rebuilt it while we waited for the lock */
+    age = time(NULL) - mountPoint->lastUpdated;
+    if ( age >= kRootRefreshSecs )
+    {
+        logDebug( "root cache is %lu secs old, so rebuild", age );
+        rebuildRoot( mountPoint );
+    }
+
+    pthread_rwlock_unlock( &mountPoint->lock );
+
+    return 0;
 }
@@ -5,28 +5,58 @@
 #ifndef UCIFS_FILEHANDLES_H
 #define UCIFS_FILEHANDLES_H
 
+#include "watcher.h"
+#include "uci2libelektra.h"
+
+/* the root directory's inode, which is also fuse's FUSE_ROOT_ID */
+#define kRootInode          1
+/* package inodes are never below this, leaving room for the root and any synthetic files */
+#define kFirstPackageInode  16
+
 typedef struct sMountPoint tMountPoint;
 typedef struct sFileHandle tFileHandle;
+typedef struct sSnapshot   tSnapshot;
+
+/* fills size bytes at dst, returning the number filled or a negative errno. See fillFH() */
+typedef ssize_t (*tFillFH)( char * dst, size_t size, void * context );
 
-int isDirectory( const char * path );
 int getFileAttributes( tFileHandle * fh, struct stat * st );
 int getDirAttributes( tMountPoint * mountPoint, struct stat * st );
 
-tMountPoint *   initRoot(     uid_t uid, gid_t gid );
+tMountPoint *   initRoot(     uid_t uid, gid_t gid, tWatcher * watcher, tElektraSession * elektra,
+                              unsigned int commitWindowMillis );
 int             populateRoot( tMountPoint * mountPoint );
 int             releaseRoot(  tMountPoint * mountPoint );
+void            readLockRoot( tMountPoint * mountPoint );
+void            unlockRoot(   tMountPoint * mountPoint );
+tElektraSession * getElektraSession( tMountPoint * mountPoint );
 
 tFileHandle *   newFH(      const char * path, int mode );
 tFileHandle *   findFH(     const char * path );
-tFileHandle *   getFH(      tFileHandle * fh, const char * path );
+tFileHandle *   retainFH(   tFileHandle * fh );
+void            putFH(      tFileHandle * fh );
 tFileHandle *   nextFH(     tFileHandle * fh );
 const char *    getFHpath(  tFileHandle * fh );
-struct stat *   getFHstat(  tFileHandle * fh );
+void            getFHstat(  tFileHandle * fh, struct stat * st );
 ssize_t         readFH(     tFileHandle * fh, char *buffer, size_t size, off_t offset );
 ssize_t         writeFH(    tFileHandle * fh, const char *buffer, size_t size, off_t offset );
+ssize_t         fillFH(     tFileHandle * fh, size_t size, off_t offset, tFillFH fill, void * context );
 int             truncateFH( tFileHandle * fh, off_t offset );
+int             allocateFH( tFileHandle * fh, int mode, off_t offset, off_t length );
 int             populateFH( tFileHandle * fh );
+int             refreshFH(  tFileHandle * fh );
+tBool           openedFH(   tFileHandle * fh, tSnapshot ** snapshot );
+int             getFHetag(  tFileHandle * fh, tBuffer * etag );
+unsigned long   getFHgeneration( tFileHandle * fh );
+int             getFHtypes( tFileHandle * fh, tBuffer * types );
 int             parseFH(    tFileHandle * fh );
+int             syncFH(     tFileHandle * fh );
+void            commitFHs(  tMountPoint * mountPoint, tFileHandle ** batch, size_t count );
 void            releaseFH(  tFileHandle * fh );
 
+tSnapshot *     retainSnapshot( tSnapshot * snapshot );
+void            putSnapshot(    tSnapshot * snapshot );
+ssize_t         readSnapshot(   tSnapshot * snapshot, char * buffer, size_t size, off_t offset );
+int             getSnapshotFd(  tSnapshot * snapshot, const char * path, size_t * length );
+
 #endif //UCIFS_FILEHANDLES_H
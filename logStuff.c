@@ -13,8 +13,11 @@
 #include <string.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "logStuff.h"
+#include "traceStuff.h"
 
 #ifdef UNUSED
 #elif defined(__GNUC__)
@@ -51,16 +54,11 @@ FILE *          gLogFile;
 
 void *          gDLhandle = NULL;
 tBool           gFunctionTraceEnabled = off;
-int             gCallDepth = 1;
+/* each thread has its own call stack */
+static __thread int gCallDepth = 1;
 
 static char * leader = "..........................................................................................";
 
-#ifdef __GNUC__
-#define DISABLE_FUNCTION_INSTRUMENTATION  __attribute__((no_instrument_function))
-#else
-#define DISABLE_FUNCTION_INSTRUMENTATION
-#endif
-
 /* {{{{{{{{ DO NOT INSTRUMENT THE INSTRUMENTATION! {{{{{{{{ */
 
 void initLogStuff( const char *name )    DISABLE_FUNCTION_INSTRUMENTATION;
@@ -79,6 +77,14 @@ void _logToStderr(  eLogPriority priority, const char *msg )   DISABLE_FUNCTION_
 
 void _profileHelper( void *leftAddr, const char *middle, void *rightAddr )  DISABLE_FUNCTION_INSTRUMENTATION;
 
+static void   emitLog( unsigned int priority, const char * msg, size_t length )    DISABLE_FUNCTION_INSTRUMENTATION;
+static tBool  enqueueLog( unsigned int priority, const char * msg, size_t length ) DISABLE_FUNCTION_INSTRUMENTATION;
+static size_t drainLog( void )                                                     DISABLE_FUNCTION_INSTRUMENTATION;
+static void * logThread( void * arg )                                              DISABLE_FUNCTION_INSTRUMENTATION;
+static tBool  startLogThread( void )                                               DISABLE_FUNCTION_INSTRUMENTATION;
+static void   resetLogRing( void )                                                 DISABLE_FUNCTION_INSTRUMENTATION;
+static void   stopLogThread( void )                                                DISABLE_FUNCTION_INSTRUMENTATION;
+
 const char * addressToString( void * addr, char * scratch )    DISABLE_FUNCTION_INSTRUMENTATION;
 
 #ifdef __GNUC__
@@ -107,6 +113,307 @@ fpLogTo gLogOutputFP[kLogMaxDestination] =
         [kLogToStderr]  = &_logToStderr
     };
 
+/*
+ * Log records are queued in a lock-free ring, and written out by a background thread, so a
+ * caller never waits on syslog() or a slow file. Any number of threads may add to the ring
+ * (each claims a slot by advancing 'head'), only the log thread removes from it. Each slot
+ * has a sequence number that says whose turn it is: 'position' when it's free to be filled,
+ * 'position + 1' once it holds a record. If the ring is full, the record is dropped and
+ * counted, and the log thread reports how many were lost.
+ */
+
+#define kLogRingSlots   512     /* must be a power of two */
+#define kLogRecordSize  512     /* longer messages are truncated */
+
+typedef struct {
+    unsigned long   sequence;           /* only accessed atomically */
+    unsigned int    priority;
+    eLogDestination destination;        /* as it was when the record was made */
+    char            text[kLogRecordSize];
+} tLogRecord;
+
+typedef enum {
+    kLogThreadStopped = 0,              /* not started yet (or lost in a fork), so write synchronously */
+    kLogThreadStarting,
+    kLogThreadRunning,
+    kLogThreadFailed                    /* couldn't be started, or has been stopped: write synchronously */
+} eLogThreadState;
+
+static struct {
+    tLogRecord      slot[kLogRingSlots];
+    unsigned long   head;               /* next position to be claimed by a producer. atomic */
+    unsigned long   tail;               /* next position to be read by the log thread */
+    unsigned long   dropped;            /* records lost because the ring was full. atomic */
+    unsigned long   reported;           /* how many of those the log thread has reported */
+    int             state;              /* an eLogThreadState. atomic */
+    int             idle;               /* the log thread is waiting for records. atomic */
+    int             stop;               /* ask the log thread to drain and exit. atomic */
+    pthread_t       thread;
+    pthread_mutex_t lock;               /* only used to sleep and wake the log thread */
+    pthread_cond_t  wake;
+} gLogRing = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+
+static pthread_once_t gLogRingOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief mark every slot as free, and the ring as empty
+ */
+static void resetLogRing( void )
+{
+    for ( unsigned long i = 0; i < kLogRingSlots; ++i )
+    {
+        __atomic_store_n( &gLogRing.slot[i].sequence, i, __ATOMIC_RELAXED );
+    }
+    __atomic_store_n( &gLogRing.head, 0, __ATOMIC_RELAXED );
+    gLogRing.tail = 0;
+}
+
+/**
+ * @brief fuse forks to put itself in the background, and the log thread doesn't survive
+ * that. Start the child afresh, a record half-written by another thread would block the ring.
+ */
+static void logForkChild( void )
+{
+    resetLogRing();
+    __atomic_store_n( &gLogRing.state, kLogThreadStopped, __ATOMIC_RELAXED );
+    __atomic_store_n( &gLogRing.idle,  0, __ATOMIC_RELAXED );
+    __atomic_store_n( &gLogRing.stop,  0, __ATOMIC_RELAXED );
+    pthread_mutex_init( &gLogRing.lock, NULL );
+    pthread_cond_init( &gLogRing.wake, NULL );
+}
+
+/**
+ * @brief
+ */
+static void initLogRing( void )
+{
+    resetLogRing();
+    pthread_atfork( NULL, NULL, logForkChild );
+    /* whatever is still in the ring when the process exits is written out first */
+    atexit( stopLogThread );
+}
+
+/**
+ * @brief claim a slot and copy the record into it
+ * @param priority
+ * @param msg
+ * @param length
+ * @return false if the ring was full, and the record was dropped
+ */
+static tBool enqueueLog( unsigned int priority, const char * msg, size_t length )
+{
+    unsigned long position = __atomic_load_n( &gLogRing.head, __ATOMIC_RELAXED );
+    tLogRecord *  record;
+
+    for (;;)
+    {
+        record = &gLogRing.slot[ position & ( kLogRingSlots - 1 ) ];
+        long diff = (long)( __atomic_load_n( &record->sequence, __ATOMIC_ACQUIRE ) - position );
+        if ( diff == 0 )
+        {
+            /* the slot is free, try to claim it */
+            if ( __atomic_compare_exchange_n( &gLogRing.head, &position, position + 1,
+                                              yes, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                break;
+            }
+            /* another producer got there first. position now holds the new head */
+        }
+        else if ( diff < 0 )
+        {
+            /* the log thread hasn't got round to this slot yet, so the ring is full */
+            __atomic_add_fetch( &gLogRing.dropped, 1, __ATOMIC_RELAXED );
+            return no;
+        }
+        else
+        {
+            position = __atomic_load_n( &gLogRing.head, __ATOMIC_RELAXED );
+        }
+    }
+
+    if ( length >= kLogRecordSize )
+    {
+        length = kLogRecordSize - 1;
+    }
+    memcpy( record->text, msg, length );
+    record->text[length] = '\0';
+    record->priority    = priority;
+    record->destination = gLogSetting[ priority ].destination;
+
+    /* publish it. Paired with the log thread setting 'idle', so one of us sees the other */
+    __atomic_store_n( &record->sequence, position + 1, __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n( &gLogRing.idle, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &gLogRing.lock );
+        pthread_cond_signal( &gLogRing.wake );
+        pthread_mutex_unlock( &gLogRing.lock );
+    }
+    return yes;
+}
+
+/**
+ * @brief write out every record in the ring, holding each stream's lock for the whole batch
+ * @return the number of records written
+ */
+static size_t drainLog( void )
+{
+    size_t count   = 0;
+    FILE * logFile = NULL;
+
+    for (;;)
+    {
+        tLogRecord * record = &gLogRing.slot[ gLogRing.tail & ( kLogRingSlots - 1 ) ];
+        if ( __atomic_load_n( &record->sequence, __ATOMIC_SEQ_CST ) != gLogRing.tail + 1 )
+        {
+            break;  /* empty, or the next record is still being written */
+        }
+
+        if ( count == 0 )
+        {
+            logFile = gLogFile;
+            flockfile( stderr );
+            if ( logFile != NULL ) flockfile( logFile );
+        }
+        ( gLogOutputFP[ record->destination ] )( record->priority, record->text );
+        ++count;
+
+        /* hand the slot back to the producers, for the next lap of the ring */
+        __atomic_store_n( &record->sequence, gLogRing.tail + kLogRingSlots, __ATOMIC_RELEASE );
+        gLogRing.tail++;
+    }
+
+    if ( count > 0 )
+    {
+        if ( logFile != NULL )
+        {
+            fflush( logFile );
+            funlockfile( logFile );
+        }
+        fflush( stderr );
+        funlockfile( stderr );
+    }
+
+    unsigned long dropped = __atomic_load_n( &gLogRing.dropped, __ATOMIC_RELAXED );
+    if ( dropped != gLogRing.reported )
+    {
+        char msg[128];
+        snprintf( msg, sizeof( msg ), "%s: %lu log messages dropped, the log can't keep up",
+                  gPriorityAsStr[ kLogWarning ], dropped - gLogRing.reported );
+        ( gLogOutputFP[ gLogSetting[ kLogWarning ].destination ] )( kLogWarning, msg );
+        gLogRing.reported = dropped;
+    }
+
+    return count;
+}
+
+/**
+ * @brief write out records as they arrive, sleeping while there are none
+ * @param arg
+ * @return
+ */
+static void * logThread( void * arg )
+{
+    (void)arg;
+
+    for (;;)
+    {
+        if ( drainLog() > 0 )
+        {
+            continue;
+        }
+        if ( __atomic_load_n( &gLogRing.stop, __ATOMIC_ACQUIRE ) )
+        {
+            break;
+        }
+
+        pthread_mutex_lock( &gLogRing.lock );
+        __atomic_store_n( &gLogRing.idle, 1, __ATOMIC_SEQ_CST );
+        /* a record may have been published before 'idle' was seen, so look again before sleeping */
+        tLogRecord * record = &gLogRing.slot[ gLogRing.tail & ( kLogRingSlots - 1 ) ];
+        if ( __atomic_load_n( &record->sequence, __ATOMIC_SEQ_CST ) != gLogRing.tail + 1
+          && !__atomic_load_n( &gLogRing.stop, __ATOMIC_ACQUIRE ) )
+        {
+            /* the timeout is only a backstop */
+            struct timespec until;
+            clock_gettime( CLOCK_REALTIME, &until );
+            until.tv_sec += 1;
+            pthread_cond_timedwait( &gLogRing.wake, &gLogRing.lock, &until );
+        }
+        __atomic_store_n( &gLogRing.idle, 0, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &gLogRing.lock );
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief start the log thread, if this is the first record since startup (or a fork)
+ * @return true if records should be queued for the log thread
+ */
+static tBool startLogThread( void )
+{
+    int state = __atomic_load_n( &gLogRing.state, __ATOMIC_ACQUIRE );
+    if ( state == kLogThreadStopped )
+    {
+        pthread_once( &gLogRingOnce, initLogRing );
+        if ( __atomic_compare_exchange_n( &gLogRing.state, &state, kLogThreadStarting,
+                                          no, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+        {
+            state = ( pthread_create( &gLogRing.thread, NULL, logThread, NULL ) == 0 )
+                    ? kLogThreadRunning : kLogThreadFailed;
+            __atomic_store_n( &gLogRing.state, state, __ATOMIC_RELEASE );
+        }
+    }
+    return state == kLogThreadRunning;
+}
+
+/**
+ * @brief write out anything still queued, and stop the log thread. Later records are
+ * written synchronously.
+ */
+static void stopLogThread( void )
+{
+    int state = kLogThreadRunning;
+    /* from now on, records are written synchronously */
+    if ( __atomic_compare_exchange_n( &gLogRing.state, &state, kLogThreadFailed,
+                                      no, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    {
+        __atomic_store_n( &gLogRing.stop, 1, __ATOMIC_RELEASE );
+        pthread_mutex_lock( &gLogRing.lock );
+        pthread_cond_signal( &gLogRing.wake );
+        pthread_mutex_unlock( &gLogRing.lock );
+
+        pthread_join( gLogRing.thread, NULL );
+        __atomic_store_n( &gLogRing.stop, 0, __ATOMIC_RELEASE );
+
+        /* pick up anything queued by a thread that saw the log thread still running */
+        drainLog();
+    }
+}
+
+/**
+ * @brief hand a formatted record to the log thread, or write it straight out if there isn't one
+ * @param priority
+ * @param msg
+ * @param length  of msg, excluding the NUL
+ */
+static void emitLog( unsigned int priority, const char * msg, size_t length )
+{
+    if ( gLogSetting[ priority ].destination == kLogToTheVoid )
+    {
+        return;
+    }
+    if ( !startLogThread() )
+    {
+        ( gLogOutputFP[ gLogSetting[ priority ].destination ] )( priority, msg );
+        return;
+    }
+    enqueueLog( priority, msg, length );
+}
+
 /*
  * the macros eventually expand to invoke this help function
  */
@@ -133,23 +440,31 @@ void _log( const char *inPath,
             prefixLen = snprintf( msg, sizeof( msg ), "%s: ", gPriorityAsStr[ priority ] );
         }
 
-        prefixLen += vsnprintf( &msg[ prefixLen ], sizeof( msg ) - prefixLen, format, vaptr );
+        if ( prefixLen < (int)sizeof( msg ) )
+        {
+            prefixLen += vsnprintf( &msg[ prefixLen ], sizeof( msg ) - prefixLen, format, vaptr );
+        }
 
-        if (error != 0)
+        if (error != 0 && prefixLen < (int)sizeof( msg ))
         {
             prefixLen += snprintf( &msg[ prefixLen ], sizeof( msg ) - prefixLen, " (%d: %s)",
                                    error, strerror( error ) );
         }
 
-        if ( gLogSetting[ priority ].mode == kLogWithLocation )
+        if ( gLogSetting[ priority ].mode == kLogWithLocation && prefixLen < (int)sizeof( msg ) )
         {
             const char * inFile = strrchr(inPath, '/');
             if ( inFile++ == NULL )
             { inFile = inPath; }
-            snprintf( &msg[ prefixLen ], sizeof( msg ) - prefixLen, " @ %s:%d", inFile, atLine );
+            prefixLen += snprintf( &msg[ prefixLen ], sizeof( msg ) - prefixLen, " @ %s:%d", inFile, atLine );
         }
 
-        ( gLogOutputFP[ gLogSetting[ priority ].destination ] )( priority, msg );
+        /* snprintf returns the length it would have liked, not what fitted */
+        if ( prefixLen >= (int)sizeof( msg ) )
+        {
+            prefixLen = sizeof( msg ) - 1;
+        }
+        emitLog( priority, msg, prefixLen );
 
         va_end( vaptr );
     }
@@ -159,11 +474,19 @@ void logTextBlock( eLogPriority priority, const char * textBlock, size_t textLen
 {
     unsigned int counter;
     char line[4096];
+    /* leave room for the NUL, and for the widest tab expansion */
+    const char * lineEnd = &line[ sizeof( line ) - 9 ];
+
+    if ( gLogSetting[ priority ].destination == kLogToTheVoid )
+    {
+        return;
+    }
 
+    /* the text isn't necessarily NUL-terminated, so never look beyond textLen */
     const char * textEnd = &textBlock[textLen];
     if ( textLen == 0 )
     {
-        textEnd = &textBlock[32767];
+        textEnd = &textBlock[ strnlen( textBlock, 32767 ) ];
     }
 
     const char * t   = textBlock;
@@ -171,17 +494,14 @@ void logTextBlock( eLogPriority priority, const char * textBlock, size_t textLen
 
     counter = 1;
     tBool newline = 1;
-    while ( *t != '\0' && t < textEnd  )
+    while ( t < textEnd && *t != '\0' )
     {
         if (newline)
         {
             newline = 0;
 
             int len = snprintf( line, sizeof( line ), "%3u: ", counter++ );
-            if ( len > 0 )
-            {
-                dst = &line[len];
-            }
+            dst = ( len > 0 ) ? &line[len] : line;
         }
 
         switch ( *t )
@@ -189,13 +509,13 @@ void logTextBlock( eLogPriority priority, const char * textBlock, size_t textLen
         case '\n':
         case '\r':
             newline = 1;
-            do { ++t; } while ( *t == '\n' || *t == '\r' );
+            do { ++t; } while ( t < textEnd && ( *t == '\n' || *t == '\r' ) );
             break;
 
         case '\t':
             {
                 unsigned int pos = dst - &line[5];
-                while ( (++pos % 8) != 0 )
+                while ( (++pos % 8) != 0 && dst < lineEnd )
                 {
                     *dst++ = ' ';
                 }
@@ -204,14 +524,19 @@ void logTextBlock( eLogPriority priority, const char * textBlock, size_t textLen
             break;
 
         default:
-            *dst++ = *t++;
+            /* an over-long line is truncated, the rest of it skipped */
+            if ( dst < lineEnd )
+            {
+                *dst++ = *t;
+            }
+            ++t;
             break;
         }
 
-        if ( newline || *t == '\0' )
+        if ( newline || t >= textEnd || *t == '\0' )
         {
             *dst = '\0';
-            ( gLogOutputFP[gLogSetting[priority].destination] )( priority, line );
+            emitLog( priority, line, dst - line );
         }
     }
 }
@@ -280,6 +605,9 @@ void setLogStuffFileDestination( const char * logFile )
 
 void stopLoggingStuff( void )
 {
+    /* write out whatever is still queued while the destinations are still open */
+    stopLogThread();
+
     for ( int i = kLogMaxPriotity; i <= 0; --i)
     {
         gLogOutputFP[i] = NULL;
@@ -340,18 +668,30 @@ void _profileHelper( void *leftAddr, const char *middle, void *rightAddr)
         addressToString( rightAddr, rightAddrAsStr );
         snprintf( msg, sizeof(msg), "%.*s %s() %s %s()",
                   gCallDepth, leader, leftAddrAsStr, middle, rightAddrAsStr );
-        (*logDestFP)( kLogFunctions, msg);
+        emitLog( kLogFunctions, msg, strnlen( msg, sizeof( msg ) ) );
     }
 }
 
 /*
     if the -finstrument-functions option is used with gcc, it inserts calls
     to these functions at the beginning and end of every compiled function.
+
+    The recorder and the profiler in traceStuff.c have switches of their own, rather than
+    riding on logFunctionTrace(): that one also logs a line per call, which would swamp the
+    log for the whole mount just to keep the counts.
 */
 
 /* just landed in a function */
 void __cyg_profile_func_enter(void *this_fn, void *call_site)
 {
+    if ( isFunctionTraceRecording() )
+    {
+        traceFunctionEvent( this_fn, no );
+    }
+    if ( isFunctionProfiling() )
+    {
+        profileFunctionEnter( this_fn );
+    }
     _profileHelper( call_site, "called", this_fn );
     ++gCallDepth;
 }
@@ -361,6 +701,14 @@ void __cyg_profile_func_exit(void *this_fn, void *call_site)
 {
     if (--gCallDepth < 1) gCallDepth = 1;
     _profileHelper( this_fn, "returned to", call_site );
+    if ( isFunctionProfiling() )
+    {
+        profileFunctionExit( this_fn );
+    }
+    if ( isFunctionTraceRecording() )
+    {
+        traceFunctionEvent( this_fn, yes );
+    }
 }
 
 /*
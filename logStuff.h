@@ -14,6 +14,13 @@ typedef enum { no = 0, off = 0,
 
 typedef int error_t;
 
+/* for the instrumentation itself, and anything it calls, when built with -finstrument-functions */
+#ifdef __GNUC__
+#define DISABLE_FUNCTION_INSTRUMENTATION  __attribute__((no_instrument_function))
+#else
+#define DISABLE_FUNCTION_INSTRUMENTATION
+#endif
+
 typedef enum {
     kLogEmergency   = LOG_EMERG,    /* 0: system is unusable */
     kLogAlert       = LOG_ALERT,	/* 1: action must be taken immediately */
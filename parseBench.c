@@ -0,0 +1,209 @@
+//
+// Runs the built-in UCI parser and libuci's uci_import() over the same files, checks they
+// produce the same keys, and times each of them. Only built with -DUCIFS_LIBUCI_PARSER=ON.
+//
+//   ucifs-parsebench [-n <repeats>] <file>...
+//
+// Each file is parsed as the package named after it, e.g. /etc/config/network as 'network'.
+// Exits with 1 if the parsers disagree about any file.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "logStuff.h"
+#include "utils.h"
+#include "arena.h"
+#include "uci2libelektra.h"
+
+#ifndef UCIFS_LIBUCI_PARSER
+#error "the parser benchmark compares against libuci, so needs -DUCIFS_LIBUCI_PARSER=ON"
+#endif
+
+#define kBenchArenaChunkSize    (16 * 1024)
+#define kDefaultRepeats         1000
+
+/**
+ * @brief
+ * @return the monotonic clock, in nanoseconds
+ */
+static long long nowNanos( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief read a whole file into the buffer
+ * @param path
+ * @param contents
+ * @return 0 on success, or a negative errno
+ */
+static int readFile( const char * path, tBuffer * contents )
+{
+    FILE * file = fopen( path, "r" );
+    if ( file == NULL )
+    {
+        return -errno;
+    }
+
+    int result = 0;
+    contents->length = 0;
+    while ( result == 0 && !feof( file ) )
+    {
+        result = reserveBuffer( contents, 4096 );
+        if ( result == 0 )
+        {
+            contents->length += fread( &contents->data[ contents->length ], 1, 4096, file );
+            if ( ferror( file ) )
+            {
+                result = -EIO;
+            }
+        }
+    }
+    fclose( file );
+
+    return result;
+}
+
+/**
+ * @brief time repeats conversions of the text with one parser
+ * @param parser
+ * @param package
+ * @param text
+ * @param repeats
+ * @return the mean time per conversion in nanoseconds, or a negative errno
+ */
+static long long timeParser( eUCIParser parser, const char * package, const tBuffer * text, long repeats )
+{
+    long long elapsed = 0;
+
+    for ( long i = 0; i < repeats; ++i )
+    {
+        /* a fresh arena each time, as commitFHs() does for each commit */
+        tArena * arena = newArena( kBenchArenaChunkSize );
+        if ( arena == NULL )
+        {
+            return -ENOMEM;
+        }
+
+        long long start = nowNanos();
+        long result = parseUCIPackageWith( arena, parser, package, text->data, text->length );
+        elapsed += nowNanos() - start;
+
+        freeArena( arena );
+        if ( result < 0 )
+        {
+            return result;
+        }
+    }
+    return elapsed / repeats;
+}
+
+/**
+ * @brief compare and time the parsers on one file
+ * @param path
+ * @param repeats
+ * @return yes if the parsers agree about it
+ */
+static tBool benchFile( const char * path, long repeats )
+{
+    const char * package = strrchr( path, '/' );
+    package = ( package == NULL ) ? path : package + 1;
+
+    tBuffer text   = { NULL, 0, 0 };
+    tBuffer report = { NULL, 0, 0 };
+    tBool   agree  = no;
+
+    int result = readFile( path, &text );
+    if ( result != 0 )
+    {
+        fprintf( stderr, "%s: unable to read it (%s)\n", path, strerror( -result ) );
+    }
+    else
+    {
+        tArena * arena = newArena( kBenchArenaChunkSize );
+        long differences = ( arena != NULL ) ? compareUCIParsers( arena, package, text.data, text.length, &report )
+                                             : -ENOMEM;
+        if ( arena != NULL ) freeArena( arena );
+
+        if ( differences < 0 )
+        {
+            fprintf( stderr, "%s: unable to compare the parsers (%s)\n", path, strerror( (int)-differences ) );
+        }
+        else if ( differences > 0 )
+        {
+            printf( "%s: %ld differences\n%.*s", path, differences, (int)report.length, report.data );
+        }
+        else
+        {
+            agree = yes;
+
+            long long builtIn = timeParser( kUCIParserBuiltIn, package, &text, repeats );
+            long long libuci  = timeParser( kUCIParserLibUCI,  package, &text, repeats );
+            if ( builtIn < 0 || libuci < 0 )
+            {
+                /* both rejected the text, which is agreement, but there's nothing to time */
+                printf( "%s: rejected by both parsers\n", path );
+            }
+            else
+            {
+                printf( "%s: %lu bytes, built-in %lld ns, libuci %lld ns per parse (%.2fx)\n",
+                        path, (unsigned long)text.length, builtIn, libuci,
+                        ( builtIn > 0 ) ? (double)libuci / (double)builtIn : 0.0 );
+            }
+        }
+    }
+
+    free( text.data );
+    free( report.data );
+    return agree;
+}
+
+int main( int argc, char *argv[] )
+{
+    long repeats = kDefaultRepeats;
+
+    initLogStuff( "ucifs-parsebench" );
+    /* keep the syntax errors, they explain why the parsers disagree, but not the chatter */
+    setLogStuffDestination( kLogDebug, kLogToTheVoid, kLogNormal );
+    setLogStuffDestination( kLogError, kLogToStderr,  kLogNormal );
+
+    int opt;
+    while ( (opt = getopt( argc, argv, "n:" )) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            repeats = strtol( optarg, NULL, 10 );
+            break;
+
+        default:
+            repeats = 0;
+            break;
+        }
+    }
+    if ( repeats <= 0 || optind >= argc )
+    {
+        fprintf( stderr, "usage: %s [-n <repeats>] <file>...\n", argv[0] );
+        return 2;
+    }
+
+    int result = 0;
+    for ( int i = optind; i < argc; ++i )
+    {
+        if ( !benchFile( argv[i], repeats ) )
+        {
+            result = 1;
+        }
+    }
+
+    stopLoggingStuff();
+    return result;
+}
@@ -0,0 +1,397 @@
+//
+// Latency histograms for every fuse operation, and counters for the expensive things they do.
+// Each thread records into its own tables, so the hot path takes no locks and shares no cache
+// lines. The tables are only summed when someone reads kStatsPath.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "logStuff.h"
+#include "utils.h"
+#include "stats.h"
+
+/* a latency in nanoseconds is bucketed by its highest set bit, then split into 2^kSubBucketBits
+ * linear sub-buckets, so every bucket is within 25% of its neighbours over the whole range */
+#define kSubBucketBits  2
+#define kSubBuckets     ( 1 << kSubBucketBits )
+#define kBucketCount    ( 64 * kSubBuckets )
+
+typedef struct {
+    uint64_t            count;
+    uint64_t            totalNanos;
+    uint64_t            maxNanos;
+    uint64_t            bucket[ kBucketCount ];
+} tHistogram;
+
+typedef struct sThreadStats {
+    struct sThreadStats *   next;
+    tHistogram              op[ kStatOpCount ];
+    uint64_t                counter[ kStatCounterCount ];
+} tThreadStats;
+
+static const char * const kOpName[ kStatOpCount ] =
+    {
+        [kStatLookup]     = "lookup",
+        [kStatForget]     = "forget",
+        [kStatGetAttr]    = "getattr",
+        [kStatSetAttr]    = "setattr",
+        [kStatInit]       = "init",
+        [kStatDestroy]    = "destroy",
+        [kStatOpenDir]    = "opendir",
+        [kStatReadDir]    = "readdir",
+        [kStatReleaseDir] = "releasedir",
+        [kStatCreate]     = "create",
+        [kStatOpen]       = "open",
+        [kStatRelease]    = "release",
+        [kStatRead]       = "read",
+        [kStatWrite]      = "write",
+        [kStatFAllocate]  = "fallocate",
+        [kStatFlush]      = "flush",
+        [kStatFSync]      = "fsync",
+        [kStatGetXAttr]   = "getxattr",
+        [kStatListXAttr]  = "listxattr"
+    };
+
+static const char * const kCounterName[ kStatCounterCount ] =
+    {
+        [kStatElektraGets]  = "elektra_gets",
+        [kStatElektraSets]  = "elektra_sets",
+        [kStatRenders]      = "renders",
+        [kStatCommits]      = "commits",
+        [kStatBytesRead]    = "bytes_read",
+        [kStatBytesWritten] = "bytes_written"
+    };
+
+/* the tables of every live thread, plus the totals of the threads that have exited */
+static pthread_mutex_t  gStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static tThreadStats *   gLiveStats = NULL;
+static tThreadStats     gRetiredStats;
+
+static __thread tThreadStats * gThreadStats = NULL;
+static pthread_key_t    gThreadStatsKey;
+static pthread_once_t   gThreadStatsOnce = PTHREAD_ONCE_INIT;
+
+/* only the owning thread writes its tables, so a plain load and store is enough. They're
+ * atomic so a concurrent renderStats() sees whole values */
+#define bumpStat( field, amount ) \
+    __atomic_store_n( &(field), __atomic_load_n( &(field), __ATOMIC_RELAXED ) + (amount), __ATOMIC_RELAXED )
+#define readStat( field ) \
+    __atomic_load_n( &(field), __ATOMIC_RELAXED )
+
+/**
+ * @brief fold the tables of an exiting thread into the retired totals. The caller holds gStatsLock
+ * @param stats
+ */
+static void retireThreadStats( tThreadStats * stats )
+{
+    for ( int i = 0; i < kStatOpCount; ++i )
+    {
+        tHistogram * from = &stats->op[i];
+        tHistogram * to   = &gRetiredStats.op[i];
+
+        to->count      += from->count;
+        to->totalNanos += from->totalNanos;
+        if ( from->maxNanos > to->maxNanos )
+        {
+            to->maxNanos = from->maxNanos;
+        }
+        for ( int b = 0; b < kBucketCount; ++b )
+        {
+            to->bucket[b] += from->bucket[b];
+        }
+    }
+    for ( int i = 0; i < kStatCounterCount; ++i )
+    {
+        gRetiredStats.counter[i] += stats->counter[i];
+    }
+}
+
+/**
+ * @brief pthread_key destructor, called as a thread exits
+ * @param arg
+ */
+static void releaseThreadStats( void * arg )
+{
+    tThreadStats * stats = arg;
+
+    pthread_mutex_lock( &gStatsLock );
+    retireThreadStats( stats );
+    tThreadStats ** link = &gLiveStats;
+    while ( *link != NULL && *link != stats )
+    {
+        link = &(*link)->next;
+    }
+    if ( *link != NULL )
+    {
+        *link = stats->next;
+    }
+    pthread_mutex_unlock( &gStatsLock );
+
+    gThreadStats = NULL;
+    free( stats );
+}
+
+/**
+ * @brief
+ */
+static void makeThreadStatsKey( void )
+{
+    pthread_key_create( &gThreadStatsKey, releaseThreadStats );
+}
+
+/**
+ * @brief
+ * @return the calling thread's tables, or NULL if they couldn't be allocated
+ */
+static tThreadStats * getThreadStats( void )
+{
+    tThreadStats * stats = gThreadStats;
+
+    if ( stats == NULL )
+    {
+        stats = calloc( 1, sizeof( tThreadStats ) );
+        if ( stats != NULL )
+        {
+            pthread_once( &gThreadStatsOnce, makeThreadStatsKey );
+            pthread_setspecific( gThreadStatsKey, stats );
+
+            pthread_mutex_lock( &gStatsLock );
+            stats->next = gLiveStats;
+            gLiveStats  = stats;
+            pthread_mutex_unlock( &gStatsLock );
+
+            gThreadStats = stats;
+        }
+    }
+    return stats;
+}
+
+/**
+ * @brief
+ * @param nanos
+ * @return the histogram bucket for a latency
+ */
+static int bucketOf( uint64_t nanos )
+{
+    if ( nanos < kSubBuckets )
+    {
+        return (int)nanos;
+    }
+    int msb = 63 - __builtin_clzll( nanos );
+    int sub = (int)( nanos >> ( msb - kSubBucketBits ) ) & ( kSubBuckets - 1 );
+    return ( ( msb - kSubBucketBits + 1 ) << kSubBucketBits ) | sub;
+}
+
+/**
+ * @brief
+ * @param bucket
+ * @return the largest latency that falls in the bucket
+ */
+static uint64_t bucketLimit( int bucket )
+{
+    if ( bucket < kSubBuckets )
+    {
+        return (uint64_t)bucket;
+    }
+    int msb = ( bucket >> kSubBucketBits ) + kSubBucketBits - 1;
+    uint64_t lower = (uint64_t)( kSubBuckets | ( bucket & ( kSubBuckets - 1 ) ) ) << ( msb - kSubBucketBits );
+    return lower + ( (uint64_t)1 << ( msb - kSubBucketBits ) ) - 1;
+}
+
+/**
+ * @brief
+ * @param op
+ * @return a timer for op, running from now
+ */
+tOpTimer startOpTimer( eStatOp op )
+{
+    tOpTimer timer = { .op = op };
+    clock_gettime( CLOCK_MONOTONIC, &timer.start );
+    return timer;
+}
+
+/**
+ * @brief record the time since the timer was started in the calling thread's histogram for its op
+ * @param timer
+ */
+void stopOpTimer( tOpTimer * timer )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    tThreadStats * stats = getThreadStats();
+    if ( stats == NULL )
+    {
+        return;
+    }
+
+    uint64_t nanos = (uint64_t)( now.tv_sec - timer->start.tv_sec ) * 1000000000ull
+                   + (uint64_t)( now.tv_nsec - timer->start.tv_nsec );
+
+    tHistogram * histogram = &stats->op[ timer->op ];
+    bumpStat( histogram->count, 1 );
+    bumpStat( histogram->totalNanos, nanos );
+    bumpStat( histogram->bucket[ bucketOf( nanos ) ], 1 );
+    if ( nanos > readStat( histogram->maxNanos ) )
+    {
+        __atomic_store_n( &histogram->maxNanos, nanos, __ATOMIC_RELAXED );
+    }
+}
+
+/**
+ * @brief
+ * @param counter
+ * @param amount
+ */
+void countStat( eStatCounter counter, unsigned long amount )
+{
+    tThreadStats * stats = getThreadStats();
+    if ( stats != NULL )
+    {
+        bumpStat( stats->counter[ counter ], amount );
+    }
+}
+
+/**
+ * @brief
+ * @param histogram
+ * @param fraction  e.g. 0.99 for the 99th percentile
+ * @return an upper bound on the latency below which that fraction of the samples fall
+ */
+static uint64_t percentile( const tHistogram * histogram, double fraction )
+{
+    uint64_t target = (uint64_t)( fraction * histogram->count + 0.5 );
+    if ( target == 0 )
+    {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for ( int b = 0; b < kBucketCount; ++b )
+    {
+        seen += histogram->bucket[b];
+        if ( seen >= target )
+        {
+            /* the bucket's limit may be beyond anything actually seen */
+            uint64_t limit = bucketLimit( b );
+            return ( limit < histogram->maxNanos ) ? limit : histogram->maxNanos;
+        }
+    }
+    return histogram->maxNanos;
+}
+
+/**
+ * @brief
+ * @param output
+ * @param format
+ * @param ...
+ * @return 0 on success, or -ENOMEM
+ */
+static int appendFormatted( tBuffer * output, const char * format, ... )
+{
+    char line[256];
+
+    va_list args;
+    va_start( args, format );
+    int length = vsnprintf( line, sizeof( line ), format, args );
+    va_end( args );
+
+    if ( length < 0 )
+    {
+        return -EINVAL;
+    }
+    if ( length >= (int)sizeof( line ) )
+    {
+        length = sizeof( line ) - 1;
+    }
+    return appendToBuffer( output, line, length );
+}
+
+/**
+ * @brief render the statistics of every thread, past and present, as text
+ * @param output
+ * @return 0 on success, or a negative errno
+ */
+int renderStats( tBuffer * output )
+{
+    /* too big for the stack of a fuse worker thread */
+    tThreadStats * total = malloc( sizeof( tThreadStats ) );
+    if ( total == NULL )
+    {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock( &gStatsLock );
+    *total = gRetiredStats;
+    for ( tThreadStats * stats = gLiveStats; stats != NULL; stats = stats->next )
+    {
+        for ( int i = 0; i < kStatOpCount; ++i )
+        {
+            const tHistogram * from = &stats->op[i];
+            tHistogram *       to   = &total->op[i];
+
+            to->count      += readStat( from->count );
+            to->totalNanos += readStat( from->totalNanos );
+            uint64_t maxNanos = readStat( from->maxNanos );
+            if ( maxNanos > to->maxNanos )
+            {
+                to->maxNanos = maxNanos;
+            }
+            for ( int b = 0; b < kBucketCount; ++b )
+            {
+                to->bucket[b] += readStat( from->bucket[b] );
+            }
+        }
+        for ( int i = 0; i < kStatCounterCount; ++i )
+        {
+            total->counter[i] += readStat( stats->counter[i] );
+        }
+    }
+    pthread_mutex_unlock( &gStatsLock );
+
+    /* the counts and buckets of a thread are read at slightly different times, so
+     * percentiles are worked out from the bucket total rather than the count */
+    int result = appendFormatted( output, "# op count mean_us p50_us p90_us p99_us max_us\n" );
+    for ( int i = 0; result == 0 && i < kStatOpCount; ++i )
+    {
+        tHistogram * histogram = &total->op[i];
+        uint64_t samples = 0;
+        for ( int b = 0; b < kBucketCount; ++b )
+        {
+            samples += histogram->bucket[b];
+        }
+        histogram->count = samples;
+        if ( samples == 0 )
+        {
+            /* never called, or the first call's count was read before its bucket was, which would divide by zero */
+            continue;
+        }
+
+        result = appendFormatted( output, "%s %lu %.1f %.1f %.1f %.1f %.1f\n",
+                                  kOpName[i],
+                                  (unsigned long)histogram->count,
+                                  histogram->totalNanos / 1000.0 / histogram->count,
+                                  percentile( histogram, 0.50 ) / 1000.0,
+                                  percentile( histogram, 0.90 ) / 1000.0,
+                                  percentile( histogram, 0.99 ) / 1000.0,
+                                  histogram->maxNanos / 1000.0 );
+    }
+    if ( result == 0 )
+    {
+        result = appendFormatted( output, "# counter value\n" );
+    }
+    for ( int i = 0; result == 0 && i < kStatCounterCount; ++i )
+    {
+        result = appendFormatted( output, "%s %lu\n", kCounterName[i], (unsigned long)total->counter[i] );
+    }
+
+    free( total );
+    return result;
+}
@@ -0,0 +1,61 @@
+#ifndef UCIFS_STATS_H
+#define UCIFS_STATS_H
+
+#include <time.h>
+
+#include "utils.h"
+
+/* a read-only file in the root dir, generated afresh each time it's opened */
+#define kStatsName  ".ucifs-stats"
+#define kStatsPath  "/" kStatsName
+#define kStatsInode 2               /* the root is 1, packages start at kFirstPackageInode */
+
+/* one for each entry in the fuse operations table */
+typedef enum {
+    kStatLookup = 0,
+    kStatForget,
+    kStatGetAttr,
+    kStatSetAttr,
+    kStatInit,
+    kStatDestroy,
+    kStatOpenDir,
+    kStatReadDir,
+    kStatReleaseDir,
+    kStatCreate,
+    kStatOpen,
+    kStatRelease,
+    kStatRead,
+    kStatWrite,
+    kStatFAllocate,
+    kStatFlush,
+    kStatFSync,
+    kStatGetXAttr,
+    kStatListXAttr,
+    kStatOpCount
+} eStatOp;
+
+typedef enum {
+    kStatElektraGets = 0,   // kdbGet round trips
+    kStatElektraSets,       // kdbSet round trips
+    kStatRenders,           // packages rendered as UCI text
+    kStatCommits,           // batches committed
+    kStatBytesRead,
+    kStatBytesWritten,
+    kStatCounterCount
+} eStatCounter;
+
+typedef struct {
+    eStatOp             op;
+    struct timespec     start;
+} tOpTimer;
+
+tOpTimer    startOpTimer( eStatOp op );
+void        stopOpTimer(  tOpTimer * timer );
+void        countStat(    eStatCounter counter, unsigned long amount );
+int         renderStats(  tBuffer * output );
+
+/* time the rest of the enclosing block as an 'op', however it's left */
+#define timeOp( op ) \
+    tOpTimer opTimer __attribute__(( cleanup( stopOpTimer ) )) = startOpTimer( op )
+
+#endif //UCIFS_STATS_H
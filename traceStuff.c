@@ -0,0 +1,1001 @@
+//
+// Function entry/exit recording for -finstrument-functions builds. Each thread appends
+// 16-byte events to its own chain of chunks, so the hooks take no locks. Symbol names are
+// only looked up when the recording is dumped, once per function.
+//
+// The profiler also works from the hooks, but keeps totals rather than events: each thread
+// builds its own call tree, with call counts and times per node. Per-function totals, call
+// edges and folded stacks are all derived from the trees when the profile is dumped.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <dlfcn.h>
+
+#include "logStuff.h"
+#include "traceStuff.h"
+
+#define kTraceChunkEvents   ( 64 * 1024 )   /* 1 MiB per chunk */
+#define kMaxTraceChunks     64              /* per thread. Later events are dropped */
+#define kMaxProfileDepth    256             /* deeper calls are counted, but not profiled */
+
+typedef struct {
+    uint64_t    nanos : 63;     /* since the recording started */
+    uint64_t    isExit : 1;
+    void *      fn;
+} tTraceEvent;
+
+typedef struct sTraceChunk {
+    struct sTraceChunk *    next;       /* published atomically */
+    size_t                  count;      /* published atomically, after the events it covers */
+    tTraceEvent             event[ kTraceChunkEvents ];
+} tTraceChunk;
+
+/* a node of a thread's call tree, i.e. a function called by way of a particular stack */
+typedef struct {
+    void *      fn;
+    uint32_t    parent;             /* the caller's node. Node 0 is the root, above every stack */
+    uint32_t    chain;              /* the next node in the same hash bucket, or 0 */
+    uint64_t    calls;
+    uint64_t    inclusiveNanos;     /* not counting calls made while fn was already on the stack */
+    uint64_t    exclusiveNanos;
+} tProfileNode;
+
+typedef struct {
+    void *      fn;
+    uint32_t    node;               /* 0 if it couldn't be added to the tree */
+    tBool       isRecursive;        /* fn is further up the stack too */
+    uint64_t    start;
+    uint64_t    childNanos;         /* spent in the functions it called */
+} tProfileFrame;
+
+typedef struct {
+    pthread_mutex_t lock;           /* the owning thread only contends with a dump */
+    tProfileNode *  node;
+    uint32_t        nodeCount;
+    uint32_t        nodeCapacity;
+    uint32_t *      bucket;         /* hashed on ( parent, fn ) */
+    uint32_t        bucketMask;
+    unsigned int    depth;          /* may exceed kMaxProfileDepth, the frames beyond aren't kept */
+    uint64_t        lost;           /* calls too deep, or that couldn't be added to the tree */
+    tProfileFrame   frame[ kMaxProfileDepth ];
+} tThreadProfile;
+
+/* outlives its thread, so the recording can be dumped later */
+typedef struct sTraceThread {
+    struct sTraceThread *   next;
+    pid_t                   tid;
+    char                    name[16];
+    tTraceChunk *           first;      /* published atomically */
+    tTraceChunk *           last;       /* only used by the owning thread */
+    unsigned int            chunks;
+    uint64_t                dropped;    /* atomic */
+    tThreadProfile          profile;
+} tTraceThread;
+
+/* totals for a function, or for a caller -> callee edge, summed over every thread */
+typedef struct {
+    void *      caller;
+    void *      fn;
+    uint64_t    calls;
+    uint64_t    inclusiveNanos;
+    uint64_t    exclusiveNanos;
+} tProfileTotal;
+
+typedef struct {
+    tProfileTotal * entry;
+    size_t          mask;
+    size_t          count;
+} tProfileTable;
+
+typedef struct {
+    void *          fn;
+    char *          name;
+} tTraceSymbol;
+
+int                         gFunctionTraceRecording = 0;
+int                         gFunctionProfiling = 0;
+
+static uint64_t             gTraceEpoch;        /* set once, before the first event */
+static pthread_once_t       gTraceEpochOnce = PTHREAD_ONCE_INIT;
+static tTraceThread *       gTraceThreads = NULL;
+static __thread tTraceThread * gThreadTrace = NULL;
+
+/* SIGUSR1 wakes a thread to dump the profile, as the handler itself can't */
+static const char *         gProfilePath = NULL;
+static sem_t                gProfileSignal;
+static pthread_t            gProfileThread;
+static int                  gProfileStopping = 0;
+
+/* serializes dumps, which share the symbol cache */
+static pthread_mutex_t      gTraceDumpLock = PTHREAD_MUTEX_INITIALIZER;
+static tTraceSymbol *       gTraceSymbol = NULL;
+static size_t               gTraceSymbolMask = 0;
+static size_t               gTraceSymbolCount = 0;
+
+static uint64_t         traceNow( void )                DISABLE_FUNCTION_INSTRUMENTATION;
+static tTraceThread *   newTraceThread( void )          DISABLE_FUNCTION_INSTRUMENTATION;
+static tTraceChunk *    newTraceChunk( tTraceThread * thread ) DISABLE_FUNCTION_INSTRUMENTATION;
+static void             setTraceEpoch( void )           DISABLE_FUNCTION_INSTRUMENTATION;
+static uint32_t         findProfileNode( tThreadProfile * profile, uint32_t parent, void * fn ) DISABLE_FUNCTION_INSTRUMENTATION;
+
+/* a dump locks each thread's profile in turn, including its own, so mustn't be profiled itself */
+static const char *     traceSymbolName( void * fn )    DISABLE_FUNCTION_INSTRUMENTATION;
+static tProfileTotal *  findProfileTotal( tProfileTable * table, void * caller, void * fn ) DISABLE_FUNCTION_INSTRUMENTATION;
+static size_t           sortProfileTable( tProfileTable * table, int (*compare)( const void *, const void * ) ) DISABLE_FUNCTION_INSTRUMENTATION;
+static int              compareExclusive( const void * a, const void * b ) DISABLE_FUNCTION_INSTRUMENTATION;
+static int              compareCalls( const void * a, const void * b ) DISABLE_FUNCTION_INSTRUMENTATION;
+static const char *     profileName( void * fn, char * scratch ) DISABLE_FUNCTION_INSTRUMENTATION;
+static void             writeFoldedStack( FILE * file, const tThreadProfile * profile, uint32_t index ) DISABLE_FUNCTION_INSTRUMENTATION;
+/* nor may the signal handler, which could interrupt the hooks with the profile locked */
+static void             onProfileSignal( int signum )   DISABLE_FUNCTION_INSTRUMENTATION;
+
+
+/**
+ * @brief
+ * @return monotonic nanoseconds
+ */
+static uint64_t traceNow( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief
+ */
+static void setTraceEpoch( void )
+{
+    gTraceEpoch = traceNow();
+}
+
+/**
+ * @brief set up the calling thread's recording, and add it to the list that gets dumped
+ * @return
+ */
+static tTraceThread * newTraceThread( void )
+{
+    tTraceThread * thread = calloc( 1, sizeof( tTraceThread ) );
+    if ( thread != NULL )
+    {
+        pthread_mutex_init( &thread->profile.lock, NULL );
+        thread->tid = gettid();
+        if ( pthread_getname_np( pthread_self(), thread->name, sizeof( thread->name ) ) != 0 )
+        {
+            thread->name[0] = '\0';
+        }
+
+        thread->next = __atomic_load_n( &gTraceThreads, __ATOMIC_RELAXED );
+        while ( !__atomic_compare_exchange_n( &gTraceThreads, &thread->next, thread,
+                                              yes, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+        { /* thread->next was updated, try again */ }
+
+        gThreadTrace = thread;
+    }
+    return thread;
+}
+
+/**
+ * @brief add another chunk to the end of the thread's chain
+ * @param thread
+ * @return the new chunk, or NULL if the thread has used its allowance
+ */
+static tTraceChunk * newTraceChunk( tTraceThread * thread )
+{
+    if ( thread->chunks >= kMaxTraceChunks )
+    {
+        return NULL;
+    }
+
+    tTraceChunk * chunk = malloc( sizeof( tTraceChunk ) );
+    if ( chunk != NULL )
+    {
+        chunk->next  = NULL;
+        chunk->count = 0;
+
+        if ( thread->last == NULL )
+        {
+            __atomic_store_n( &thread->first, chunk, __ATOMIC_RELEASE );
+        }
+        else
+        {
+            __atomic_store_n( &thread->last->next, chunk, __ATOMIC_RELEASE );
+        }
+        thread->last = chunk;
+        thread->chunks++;
+    }
+    return chunk;
+}
+
+/**
+ * @brief append an event to the calling thread's recording
+ * @param fn      the function entered or left
+ * @param isExit
+ */
+void traceFunctionEvent( void * fn, tBool isExit )
+{
+    uint64_t now = traceNow();
+
+    tTraceThread * thread = gThreadTrace;
+    if ( thread == NULL && ( thread = newTraceThread() ) == NULL )
+    {
+        return;
+    }
+
+    tTraceChunk * chunk = thread->last;
+    size_t        count = ( chunk != NULL ) ? chunk->count : kTraceChunkEvents;
+    if ( count == kTraceChunkEvents )
+    {
+        chunk = newTraceChunk( thread );
+        if ( chunk == NULL )
+        {
+            __atomic_store_n( &thread->dropped, thread->dropped + 1, __ATOMIC_RELAXED );
+            return;
+        }
+        count = 0;
+    }
+
+    tTraceEvent * event = &chunk->event[ count ];
+    event->nanos  = ( now > gTraceEpoch ) ? now - gTraceEpoch : 0;
+    event->isExit = isExit;
+    event->fn     = fn;
+    __atomic_store_n( &chunk->count, count + 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief find the node for fn called from parent, adding it if it's new. Called with the
+ * profile locked.
+ * @param profile
+ * @param parent
+ * @param fn
+ * @return the node's index, or 0 if it couldn't be added
+ */
+static uint32_t findProfileNode( tThreadProfile * profile, uint32_t parent, void * fn )
+{
+    uint32_t hash = (uint32_t)( ( (uintptr_t)fn >> 4 ) * 31 + parent );
+
+    if ( profile->bucket != NULL )
+    {
+        for ( uint32_t i = profile->bucket[ hash & profile->bucketMask ]; i != 0; i = profile->node[i].chain )
+        {
+            if ( profile->node[i].fn == fn && profile->node[i].parent == parent )
+            {
+                return i;
+            }
+        }
+    }
+
+    if ( profile->nodeCount >= profile->nodeCapacity )
+    {
+        uint32_t       capacity = ( profile->nodeCapacity == 0 ) ? 1024 : profile->nodeCapacity * 2;
+        tProfileNode * node     = realloc( profile->node, capacity * sizeof( tProfileNode ) );
+        if ( node == NULL )
+        {
+            return 0;
+        }
+        profile->node = node;
+
+        /* twice as many buckets as nodes */
+        uint32_t * bucket = calloc( capacity * 2, sizeof( uint32_t ) );
+        if ( bucket == NULL )
+        {
+            return 0;
+        }
+        if ( profile->nodeCount == 0 )
+        {
+            /* node 0 is the root */
+            memset( &node[0], 0, sizeof( tProfileNode ) );
+            profile->nodeCount = 1;
+        }
+
+        free( profile->bucket );
+        profile->bucket       = bucket;
+        profile->bucketMask   = capacity * 2 - 1;
+        profile->nodeCapacity = capacity;
+        for ( uint32_t i = 1; i < profile->nodeCount; ++i )
+        {
+            uint32_t h = (uint32_t)( ( (uintptr_t)node[i].fn >> 4 ) * 31 + node[i].parent ) & profile->bucketMask;
+            node[i].chain = bucket[h];
+            bucket[h]     = i;
+        }
+    }
+
+    uint32_t       i    = profile->nodeCount++;
+    tProfileNode * node = &profile->node[i];
+    memset( node, 0, sizeof( tProfileNode ) );
+    node->fn     = fn;
+    node->parent = parent;
+    node->chain  = profile->bucket[ hash & profile->bucketMask ];
+    profile->bucket[ hash & profile->bucketMask ] = i;
+
+    return i;
+}
+
+/**
+ * @brief push fn onto the calling thread's profile stack
+ * @param fn
+ */
+void profileFunctionEnter( void * fn )
+{
+    uint64_t now = traceNow();
+
+    tTraceThread * thread = gThreadTrace;
+    if ( thread == NULL && ( thread = newTraceThread() ) == NULL )
+    {
+        return;
+    }
+    tThreadProfile * profile = &thread->profile;
+
+    pthread_mutex_lock( &profile->lock );
+
+    if ( profile->depth < kMaxProfileDepth )
+    {
+        uint32_t parent = ( profile->depth > 0 ) ? profile->frame[ profile->depth - 1 ].node : 0;
+        uint32_t node   = findProfileNode( profile, parent, fn );
+
+        tProfileFrame * frame = &profile->frame[ profile->depth ];
+        frame->fn          = fn;
+        frame->node        = node;
+        frame->isRecursive = no;
+        frame->start       = now;
+        frame->childNanos  = 0;
+        for ( unsigned int i = 0; i < profile->depth; ++i )
+        {
+            if ( profile->frame[i].fn == fn )
+            {
+                frame->isRecursive = yes;
+                break;
+            }
+        }
+        if ( node == 0 )
+        {
+            profile->lost++;
+        }
+    }
+    else
+    {
+        profile->lost++;
+    }
+    profile->depth++;
+
+    pthread_mutex_unlock( &profile->lock );
+}
+
+/**
+ * @brief pop fn from the calling thread's profile stack, and add its time to the tree
+ * @param fn
+ */
+void profileFunctionExit( void * fn )
+{
+    uint64_t now = traceNow();
+
+    tTraceThread * thread = gThreadTrace;
+    if ( thread == NULL )
+    {
+        return;
+    }
+    tThreadProfile * profile = &thread->profile;
+
+    pthread_mutex_lock( &profile->lock );
+
+    if ( profile->depth > kMaxProfileDepth )
+    {
+        profile->depth--;
+    }
+    else if ( profile->depth > 0 )
+    {
+        /* profiling may have started part way down the stack, or been skipped by a longjmp */
+        unsigned int depth = profile->depth;
+        while ( depth > 0 && profile->frame[ depth - 1 ].fn != fn )
+        {
+            --depth;
+        }
+
+        if ( depth > 0 )
+        {
+            tProfileFrame * frame   = &profile->frame[ depth - 1 ];
+            uint64_t        elapsed = ( now > frame->start ) ? now - frame->start : 0;
+
+            if ( frame->node != 0 )
+            {
+                tProfileNode * node = &profile->node[ frame->node ];
+                node->calls++;
+                node->exclusiveNanos += ( elapsed > frame->childNanos ) ? elapsed - frame->childNanos : 0;
+                if ( !frame->isRecursive )
+                {
+                    node->inclusiveNanos += elapsed;
+                }
+            }
+
+            profile->depth = depth - 1;
+            if ( profile->depth > 0 )
+            {
+                profile->frame[ profile->depth - 1 ].childNanos += elapsed;
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &profile->lock );
+}
+
+/**
+ * @brief
+ */
+void startFunctionTrace( void )
+{
+    pthread_once( &gTraceEpochOnce, setTraceEpoch );
+    __atomic_store_n( &gFunctionTraceRecording, 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief
+ */
+void stopFunctionTrace( void )
+{
+    __atomic_store_n( &gFunctionTraceRecording, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * @brief look up the name of fn, from the cache if it's been seen before. Called with
+ * gTraceDumpLock held.
+ * @param fn
+ * @return the name, or NULL if it couldn't be added to the cache
+ */
+static const char * traceSymbolName( void * fn )
+{
+    if ( gTraceSymbolCount * 2 >= gTraceSymbolMask )
+    {
+        /* keep the load factor under a half */
+        size_t         mask   = ( gTraceSymbolMask == 0 ) ? 1023 : gTraceSymbolMask * 2 + 1;
+        tTraceSymbol * symbol = calloc( mask + 1, sizeof( tTraceSymbol ) );
+        if ( symbol == NULL )
+        {
+            return NULL;
+        }
+        for ( size_t i = 0; gTraceSymbol != NULL && i <= gTraceSymbolMask; ++i )
+        {
+            if ( gTraceSymbol[i].fn != NULL )
+            {
+                size_t j = ( (uintptr_t)gTraceSymbol[i].fn >> 4 ) & mask;
+                while ( symbol[j].fn != NULL )
+                {
+                    j = ( j + 1 ) & mask;
+                }
+                symbol[j] = gTraceSymbol[i];
+            }
+        }
+        free( gTraceSymbol );
+        gTraceSymbol     = symbol;
+        gTraceSymbolMask = mask;
+    }
+
+    size_t i = ( (uintptr_t)fn >> 4 ) & gTraceSymbolMask;
+    while ( gTraceSymbol[i].fn != NULL )
+    {
+        if ( gTraceSymbol[i].fn == fn )
+        {
+            return gTraceSymbol[i].name;
+        }
+        i = ( i + 1 ) & gTraceSymbolMask;
+    }
+
+    /* static functions aren't in the dynamic symbol table, so name them by their offset
+     * into the binary, which addr2line can turn into a name */
+    char    scratch[256];
+    Dl_info info;
+    if ( dladdr( fn, &info ) == 0 )
+    {
+        snprintf( scratch, sizeof( scratch ), "%p", fn );
+    }
+    else if ( info.dli_sname != NULL )
+    {
+        snprintf( scratch, sizeof( scratch ), "%s", info.dli_sname );
+    }
+    else
+    {
+        const char * file = ( info.dli_fname != NULL ) ? strrchr( info.dli_fname, '/' ) : NULL;
+        file = ( file != NULL ) ? file + 1 : ( info.dli_fname != NULL ) ? info.dli_fname : "?";
+        snprintf( scratch, sizeof( scratch ), "%s+0x%lx",
+                  file, (unsigned long)( (uintptr_t)fn - (uintptr_t)info.dli_fbase ) );
+    }
+
+    char * name = strdup( scratch );
+    if ( name == NULL )
+    {
+        return NULL;
+    }
+    gTraceSymbol[i].fn   = fn;
+    gTraceSymbol[i].name = name;
+    gTraceSymbolCount++;
+
+    return name;
+}
+
+/**
+ * @brief write a JSON string, escaped
+ * @param file
+ * @param string
+ */
+static void writeJSONString( FILE * file, const char * string )
+{
+    fputc( '"', file );
+    for ( const unsigned char * s = (const unsigned char *)string; *s != '\0'; ++s )
+    {
+        if ( *s == '"' || *s == '\\' )
+        {
+            fputc( '\\', file );
+            fputc( *s, file );
+        }
+        else if ( *s < ' ' )
+        {
+            fprintf( file, "\\u%04x", *s );
+        }
+        else
+        {
+            fputc( *s, file );
+        }
+    }
+    fputc( '"', file );
+}
+
+/**
+ * @brief write everything recorded so far as Chrome trace-event JSON. Threads may carry on
+ * recording meanwhile, their later events are left for the next dump.
+ * @param path
+ * @return 0 on success, or a negative errno
+ */
+int dumpFunctionTrace( const char * path )
+{
+    int      result = 0;
+    uint64_t events = 0;
+    uint64_t dropped = 0;
+
+    FILE * file = fopen( path, "w" );
+    if ( file == NULL )
+    {
+        result = -errno;
+        logError( "unable to write the function trace to \'%s\'", path );
+        return result;
+    }
+
+    pthread_mutex_lock( &gTraceDumpLock );
+
+    pid_t        pid   = getpid();
+    const char * comma = "";
+    fputs( "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file );
+
+    for ( tTraceThread * thread = __atomic_load_n( &gTraceThreads, __ATOMIC_ACQUIRE );
+          thread != NULL;
+          thread = thread->next )
+    {
+        fprintf( file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                 comma, pid, thread->tid );
+        writeJSONString( file, thread->name[0] != '\0' ? thread->name : "thread" );
+        fputs( "}}", file );
+        comma = ",\n";
+
+        for ( tTraceChunk * chunk = __atomic_load_n( &thread->first, __ATOMIC_ACQUIRE );
+              chunk != NULL;
+              chunk = __atomic_load_n( &chunk->next, __ATOMIC_ACQUIRE ) )
+        {
+            size_t count = __atomic_load_n( &chunk->count, __ATOMIC_ACQUIRE );
+            for ( size_t i = 0; i < count; ++i )
+            {
+                const tTraceEvent * event = &chunk->event[i];
+                const char *        name  = traceSymbolName( event->fn );
+
+                fprintf( file, "%s{\"name\":", comma );
+                if ( name != NULL )
+                {
+                    writeJSONString( file, name );
+                }
+                else
+                {
+                    fprintf( file, "\"%p\"", event->fn );
+                }
+                /* timestamps are in microseconds */
+                fprintf( file, ",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%d}",
+                         event->isExit ? 'E' : 'B',
+                         (unsigned long)( event->nanos / 1000 ), (unsigned long)( event->nanos % 1000 ),
+                         pid, thread->tid );
+            }
+            events += count;
+        }
+        dropped += __atomic_load_n( &thread->dropped, __ATOMIC_RELAXED );
+    }
+
+    fputs( "\n]}\n", file );
+
+    pthread_mutex_unlock( &gTraceDumpLock );
+
+    if ( ferror( file ) )
+    {
+        result = -EIO;
+    }
+    if ( fclose( file ) != 0 && result == 0 )
+    {
+        result = -errno;
+    }
+
+    if ( result != 0 )
+    {
+        logError( "unable to write the function trace to \'%s\'", path );
+    }
+    else if ( events == 0 )
+    {
+        logWarning( "no function calls were recorded. Was ucifs built with -finstrument-functions?" );
+    }
+    else
+    {
+        logInfo( "wrote %lu function events to \'%s\' (%lu dropped)",
+                 (unsigned long)events, path, (unsigned long)dropped );
+    }
+
+    return result;
+}
+
+/**
+ * @brief find the totals for caller -> fn, adding them if they're new
+ * @param table
+ * @param caller  NULL for the function's own totals
+ * @param fn
+ * @return the entry, or NULL if out of memory
+ */
+static tProfileTotal * findProfileTotal( tProfileTable * table, void * caller, void * fn )
+{
+    if ( table->count * 2 >= table->mask )
+    {
+        size_t          mask  = ( table->mask == 0 ) ? 1023 : table->mask * 2 + 1;
+        tProfileTotal * entry = calloc( mask + 1, sizeof( tProfileTotal ) );
+        if ( entry == NULL )
+        {
+            return NULL;
+        }
+        for ( size_t i = 0; table->entry != NULL && i <= table->mask; ++i )
+        {
+            if ( table->entry[i].fn != NULL )
+            {
+                size_t j = ( ( (uintptr_t)table->entry[i].fn >> 4 ) * 31 + ( (uintptr_t)table->entry[i].caller >> 4 ) ) & mask;
+                while ( entry[j].fn != NULL )
+                {
+                    j = ( j + 1 ) & mask;
+                }
+                entry[j] = table->entry[i];
+            }
+        }
+        free( table->entry );
+        table->entry = entry;
+        table->mask  = mask;
+    }
+
+    size_t i = ( ( (uintptr_t)fn >> 4 ) * 31 + ( (uintptr_t)caller >> 4 ) ) & table->mask;
+    while ( table->entry[i].fn != NULL )
+    {
+        if ( table->entry[i].fn == fn && table->entry[i].caller == caller )
+        {
+            return &table->entry[i];
+        }
+        i = ( i + 1 ) & table->mask;
+    }
+
+    table->entry[i].caller = caller;
+    table->entry[i].fn     = fn;
+    table->count++;
+
+    return &table->entry[i];
+}
+
+/**
+ * @brief pack the table's entries to the front, and sort them
+ * @param table
+ * @param compare
+ * @return the number of entries
+ */
+static size_t sortProfileTable( tProfileTable * table, int (*compare)( const void *, const void * ) )
+{
+    size_t count = 0;
+    for ( size_t i = 0; table->entry != NULL && i <= table->mask; ++i )
+    {
+        if ( table->entry[i].fn != NULL )
+        {
+            table->entry[count++] = table->entry[i];
+        }
+    }
+    qsort( table->entry, count, sizeof( tProfileTotal ), compare );
+    return count;
+}
+
+static int compareExclusive( const void * a, const void * b )
+{
+    const tProfileTotal * left  = a;
+    const tProfileTotal * right = b;
+    return ( left->exclusiveNanos < right->exclusiveNanos ) - ( left->exclusiveNanos > right->exclusiveNanos );
+}
+
+static int compareCalls( const void * a, const void * b )
+{
+    const tProfileTotal * left  = a;
+    const tProfileTotal * right = b;
+    return ( left->calls < right->calls ) - ( left->calls > right->calls );
+}
+
+/**
+ * @brief name a function, for the profile
+ * @param fn
+ * @param scratch  at least 32 bytes, in case the name isn't cached
+ * @return
+ */
+static const char * profileName( void * fn, char * scratch )
+{
+    const char * name = traceSymbolName( fn );
+    if ( name == NULL )
+    {
+        sprintf( scratch, "%p", fn );
+        name = scratch;
+    }
+    return name;
+}
+
+/**
+ * @brief write one line of folded stack for the node, i.e. 'outer;...;inner microseconds'
+ * @param file
+ * @param profile
+ * @param index
+ */
+static void writeFoldedStack( FILE * file, const tThreadProfile * profile, uint32_t index )
+{
+    void *   stack[ kMaxProfileDepth ];
+    unsigned depth = 0;
+    char     scratch[32];
+
+    for ( uint32_t i = index; i != 0 && depth < kMaxProfileDepth; i = profile->node[i].parent )
+    {
+        stack[ depth++ ] = profile->node[i].fn;
+    }
+    while ( depth > 0 )
+    {
+        fputs( profileName( stack[ --depth ], scratch ), file );
+        fputc( depth > 0 ? ';' : ' ', file );
+    }
+    fprintf( file, "%lu\n", (unsigned long)( profile->node[ index ].exclusiveNanos / 1000 ) );
+}
+
+/**
+ * @brief write the profile gathered so far. Functions sorted by exclusive time, then call
+ * edges by count, go to path. Folded stacks, ready for flamegraph.pl or speedscope, go to
+ * path with ".folded" appended.
+ * @param path
+ * @return 0 on success, or a negative errno
+ */
+int dumpFunctionProfile( const char * path )
+{
+    int           result    = 0;
+    tProfileTable functions = { NULL, 0, 0 };
+    tProfileTable edges     = { NULL, 0, 0 };
+    uint64_t      lost      = 0;
+    char          scratch[2][32];
+
+    size_t foldedLen  = strlen( path ) + sizeof( ".folded" );
+    char * foldedPath = malloc( foldedLen );
+    if ( foldedPath == NULL )
+    {
+        return -ENOMEM;
+    }
+    snprintf( foldedPath, foldedLen, "%s.folded", path );
+
+    FILE * file   = fopen( path, "w" );
+    FILE * folded = fopen( foldedPath, "w" );
+    if ( file == NULL || folded == NULL )
+    {
+        result = -errno;
+        logError( "unable to write the function profile to \'%s\'", file == NULL ? path : foldedPath );
+        if ( file   != NULL ) fclose( file );
+        if ( folded != NULL ) fclose( folded );
+        free( foldedPath );
+        return result;
+    }
+
+    pthread_mutex_lock( &gTraceDumpLock );
+
+    for ( tTraceThread * thread = __atomic_load_n( &gTraceThreads, __ATOMIC_ACQUIRE );
+          thread != NULL;
+          thread = thread->next )
+    {
+        tThreadProfile * profile = &thread->profile;
+
+        pthread_mutex_lock( &profile->lock );
+        for ( uint32_t i = 1; i < profile->nodeCount; ++i )
+        {
+            const tProfileNode * node = &profile->node[i];
+            if ( node->calls == 0 )
+            {
+                continue;   /* still on the stack */
+            }
+
+            tProfileTotal * total = findProfileTotal( &functions, NULL, node->fn );
+            tProfileTotal * edge  = findProfileTotal( &edges, profile->node[ node->parent ].fn, node->fn );
+            if ( total == NULL || edge == NULL )
+            {
+                result = -ENOMEM;
+                break;
+            }
+            total->calls          += node->calls;
+            total->inclusiveNanos += node->inclusiveNanos;
+            total->exclusiveNanos += node->exclusiveNanos;
+            edge->calls           += node->calls;
+
+            if ( node->exclusiveNanos >= 1000 )
+            {
+                writeFoldedStack( folded, profile, i );
+            }
+        }
+        lost += profile->lost;
+        pthread_mutex_unlock( &profile->lock );
+    }
+
+    fprintf( file, "# %-10s %14s %14s %12s  %s\n", "calls", "inclusive_us", "exclusive_us", "us/call", "function" );
+    size_t count = sortProfileTable( &functions, compareExclusive );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const tProfileTotal * total = &functions.entry[i];
+        fprintf( file, "  %-10lu %14.1f %14.1f %12.3f  %s\n",
+                 (unsigned long)total->calls,
+                 total->inclusiveNanos / 1000.0, total->exclusiveNanos / 1000.0,
+                 total->inclusiveNanos / 1000.0 / total->calls,
+                 profileName( total->fn, scratch[0] ) );
+    }
+
+    fprintf( file, "\n# %-10s  %s\n", "calls", "caller -> callee" );
+    count = sortProfileTable( &edges, compareCalls );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        const tProfileTotal * edge = &edges.entry[i];
+        fprintf( file, "  %-10lu  %s -> %s\n", (unsigned long)edge->calls,
+                 edge->caller != NULL ? profileName( edge->caller, scratch[0] ) : "(root)",
+                 profileName( edge->fn, scratch[1] ) );
+    }
+
+    if ( lost > 0 )
+    {
+        fprintf( file, "\n# %lu calls were too deep to profile\n", (unsigned long)lost );
+    }
+
+    pthread_mutex_unlock( &gTraceDumpLock );
+
+    if ( ( ferror( file ) || ferror( folded ) ) && result == 0 )
+    {
+        result = -EIO;
+    }
+    if ( fclose( file ) != 0 && result == 0 )
+    {
+        result = -errno;
+    }
+    if ( fclose( folded ) != 0 && result == 0 )
+    {
+        result = -errno;
+    }
+
+    if ( result != 0 )
+    {
+        logError( "unable to write the function profile to \'%s\'", path );
+    }
+    else if ( functions.count == 0 )
+    {
+        logWarning( "no function calls were profiled. Was ucifs built with -finstrument-functions?" );
+    }
+    else
+    {
+        logInfo( "wrote the profile of %lu functions to \'%s\' and \'%s\'",
+                 (unsigned long)functions.count, path, foldedPath );
+    }
+
+    free( functions.entry );
+    free( edges.entry );
+    free( foldedPath );
+
+    return result;
+}
+
+/**
+ * @brief the signal handler just wakes the profile thread, which does the work
+ * @param signum
+ */
+static void onProfileSignal( int signum )
+{
+    (void)signum;
+    sem_post( &gProfileSignal );
+}
+
+/**
+ * @brief dump the profile each time SIGUSR1 arrives
+ * @param arg
+ * @return
+ */
+static void * profileThread( void * arg )
+{
+    (void)arg;
+
+    for (;;)
+    {
+        if ( sem_wait( &gProfileSignal ) != 0 )
+        {
+            continue;   /* EINTR */
+        }
+        if ( __atomic_load_n( &gProfileStopping, __ATOMIC_ACQUIRE ) )
+        {
+            break;
+        }
+        dumpFunctionProfile( gProfilePath );
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief start profiling. The profile is written to path (and path.folded) by
+ * dumpFunctionProfile(), or whenever SIGUSR1 arrives.
+ * @param path
+ * @return 0 on success, or a negative errno
+ */
+int startFunctionProfile( const char * path )
+{
+    if ( gProfilePath != NULL )
+    {
+        return -EALREADY;
+    }
+
+    pthread_once( &gTraceEpochOnce, setTraceEpoch );
+
+    gProfilePath = path;
+    sem_init( &gProfileSignal, 0, 0 );
+    __atomic_store_n( &gProfileStopping, 0, __ATOMIC_RELEASE );
+
+    int result = pthread_create( &gProfileThread, NULL, profileThread, NULL );
+    if ( result != 0 )
+    {
+        logError( "unable to start the profile thread (%d: %s)", result, strerror( result ) );
+        gProfilePath = NULL;
+        sem_destroy( &gProfileSignal );
+        return -result;
+    }
+    pthread_setname_np( gProfileThread, "ucifs-profile" );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = onProfileSignal;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset( &action.sa_mask );
+    sigaction( SIGUSR1, &action, NULL );
+
+    __atomic_store_n( &gFunctionProfiling, 1, __ATOMIC_RELEASE );
+    return 0;
+}
+
+/**
+ * @brief stop profiling. What was gathered is kept, for dumpFunctionProfile().
+ */
+void stopFunctionProfile( void )
+{
+    if ( gProfilePath == NULL )
+    {
+        return;
+    }
+
+    __atomic_store_n( &gFunctionProfiling, 0, __ATOMIC_RELEASE );
+    signal( SIGUSR1, SIG_IGN );
+
+    __atomic_store_n( &gProfileStopping, 1, __ATOMIC_RELEASE );
+    sem_post( &gProfileSignal );
+    pthread_join( gProfileThread, NULL );
+    sem_destroy( &gProfileSignal );
+}
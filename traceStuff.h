@@ -0,0 +1,52 @@
+#ifndef UCIFS_TRACESTUFF_H
+#define UCIFS_TRACESTUFF_H
+
+#include "logStuff.h"
+
+/*
+ * Records function entry and exit, per thread, when built with -finstrument-functions.
+ * The recording is kept in memory as compact binary events, and only turned into
+ * Chrome/Perfetto trace-event JSON (load it in ui.perfetto.dev or chrome://tracing)
+ * when it is dumped.
+ *
+ * The profiler keeps call counts, inclusive and exclusive times and call edges instead,
+ * which is cheap enough to leave on for a whole session.
+ */
+
+extern int gFunctionTraceRecording;
+extern int gFunctionProfiling;
+
+/* start/stop recording function entry & exit. Recording picks up where it left off if restarted */
+void    startFunctionTrace( void );
+void    stopFunctionTrace( void );
+
+/* write everything recorded so far to path as trace-event JSON. Returns 0 or a negative errno */
+int     dumpFunctionTrace( const char * path );
+
+/* called by the __cyg_profile_func_* hooks */
+void    traceFunctionEvent( void * fn, tBool isExit ) DISABLE_FUNCTION_INSTRUMENTATION;
+
+/* start/stop profiling. SIGUSR1 dumps the profile while it's running */
+int     startFunctionProfile( const char * path );
+void    stopFunctionProfile( void );
+
+/* write the profile to path, sorted by exclusive time, and folded stacks to path.folded */
+int     dumpFunctionProfile( const char * path );
+
+/* called by the __cyg_profile_func_* hooks */
+void    profileFunctionEnter( void * fn ) DISABLE_FUNCTION_INSTRUMENTATION;
+void    profileFunctionExit( void * fn )  DISABLE_FUNCTION_INSTRUMENTATION;
+
+static inline tBool isFunctionTraceRecording( void ) DISABLE_FUNCTION_INSTRUMENTATION;
+static inline tBool isFunctionTraceRecording( void )
+{
+    return __atomic_load_n( &gFunctionTraceRecording, __ATOMIC_RELAXED ) != 0;
+}
+
+static inline tBool isFunctionProfiling( void ) DISABLE_FUNCTION_INSTRUMENTATION;
+static inline tBool isFunctionProfiling( void )
+{
+    return __atomic_load_n( &gFunctionProfiling, __ATOMIC_RELAXED ) != 0;
+}
+
+#endif //UCIFS_TRACESTUFF_H
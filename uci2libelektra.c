@@ -5,53 +5,260 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 
-#include <ctype.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <time.h>
 
 #include <stdio.h>
 #include <fcntl.h>
+#include <pthread.h>
 
+#ifdef UCIFS_LIBUCI_PARSER
 /* Note: need to build and install the uci project on x86 */
 #include <uci.h>
+#endif
 
 #include <elektra.h>
 
 #include "logStuff.h"
 #include "utils.h"
+#include "arena.h"
+#include "classify.h"
+#include "stats.h"
 #include "fileHandles.h"
+#include "uciParser.h"
 #include "uci2libelektra.h"
 
 
 typedef struct sSection {
-    struct sSection * next;
-    const char *      type;
+    struct sSection * next;     // the next entry in the same bucket
+    const char *      type;     // outlives the conversion, it's either in the uci_context or the parse arena
     tHash             hash;
     int               count;
     int               counter;
 } tSection;
 
+/* the types of the anonymous sections in a package, hashed by type. Allocated from the
+ * parse arena, and doubles in size whenever it becomes half full */
+typedef struct {
+    tSection ** bucket;
+    size_t      mask;           // the number of buckets (a power of two) minus one
+    size_t      count;          // the number of distinct types
+} tSectionTypes;
+
+/* the packages written since the last commit, waiting to be committed together */
+struct sUCIImport {
+    tArena *             arena;
+#ifdef UCIFS_LIBUCI_PARSER
+    struct uci_context * ctx;
+#else
+    KeySet *             imported;  // the keys of every package parsed so far
+    KeySet *             packages;  // the package keys, e.g. system:/config/network
+    tKeyPath             keyPath;
+#endif
+};
+
 
-/********************************/
+static const char kConfigRoot[] = kUCIConfigRoot;
 
-#ifdef DEBUG
-const char * testPaths[] = { "/network", "/system", "/wireless", "/dhcp", NULL };
-#endif
+/* a KDB handle and its KeySet must not be used by more than one thread at a time,
+ * so every public entry point below holds the session's lock while it uses them */
+typedef struct sElektraSession {
+    pthread_mutex_t     lock;
+    KDB *               kdb;
+    Key *               root;       // system:/config, which also collects any errors
+    KeySet *            keySet;     // everything fetched so far, so kdbGet only has to refresh what changed
+    tKeyPath            keyPath;    // scratch for building key names during a commit
+} tElektraSession;
+
+
+/**
+ * @brief open libelektra once for the life of the mount, so plugin loading and mountpoint
+ * resolution aren't repeated for every render and every commit.
+ * @return the session, or NULL on failure
+ */
+tElektraSession * openElektraSession( void )
+{
+    tElektraSession * session = calloc( 1, sizeof( tElektraSession ) );
+    if ( session == NULL )
+    {
+        logError( "failed to allocate libelektra session" );
+        return NULL;
+    }
+
+    pthread_mutex_init( &session->lock, NULL );
+    session->root   = keyNew( kConfigRoot, KEY_END );
+    session->keySet = ksNew( 0, KS_END );
+    session->kdb    = kdbOpen( NULL, session->root );
+    logDebug( "kdb = %p for \'%s\'", session->kdb, kConfigRoot );
+    if ( session->kdb == NULL )
+    {
+        /* not fatal, we'll try again the next time the session is used */
+        logError( "unable to open libelektra" );
+    }
+    return session;
+}
 
 /**
  * @brief
+ * @param session
+ */
+void closeElektraSession( tElektraSession * session )
+{
+    if ( session != NULL )
+    {
+        if ( session->kdb != NULL )
+        {
+            kdbClose( session->kdb, session->root );
+        }
+        ksDel( session->keySet );
+        keyDel( session->root );
+        freeKeyPath( &session->keyPath );
+        pthread_mutex_destroy( &session->lock );
+        free( session );
+    }
+}
+
+/**
+ * @brief throw away the handle and everything cached with it, and start afresh.
+ * Used to recover after libelektra reports an error (e.g. a conflicting commit).
+ * @param session
+ * @return 0 on success, or -EIO
+ */
+static int reopenElektraSession( tElektraSession * session )
+{
+    logWarning( "reopening libelektra" );
+
+    if ( session->kdb != NULL )
+    {
+        kdbClose( session->kdb, session->root );
+    }
+    ksDel( session->keySet );
+    session->keySet = ksNew( 0, KS_END );
+    session->kdb    = kdbOpen( NULL, session->root );
+
+    return ( session->kdb != NULL ) ? 0 : -EIO;
+}
+
+/**
+ * @brief refresh the keys below parent in the session's KeySet, reopening the session
+ * and retrying once if libelektra reports an error
+ * @param session
+ * @param parent
+ * @return 0 on success, or -EIO
+ */
+static int fetchKeys( tElektraSession * session, Key * parent )
+{
+    int result = -1;
+
+    if ( session->kdb != NULL )
+    {
+        countStat( kStatElektraGets, 1 );
+        result = kdbGet( session->kdb, session->keySet, parent );
+    }
+    if ( result < 0 && reopenElektraSession( session ) == 0 )
+    {
+        countStat( kStatElektraGets, 1 );
+        result = kdbGet( session->kdb, session->keySet, parent );
+    }
+    if ( result < 0 )
+    {
+        logError( "unable to fetch \'%s\' from libelektra", keyName( parent ) );
+        return -EIO;
+    }
+    return 0;
+}
+
+/********************************/
+
+/**
+ * @brief enumerate the UCI packages stored under system:/config.
+ * Calling with i == 0 takes a fresh snapshot of the list, the following calls walk it.
+ * The returned path remains valid until the next snapshot is taken, so the caller must
+ * make sure only one thread walks the list at a time (populateRoot() holds the root lock).
+ * @param session
  * @param i
- * @return
+ * @return the path of the i'th package (e.g. "/network"), or NULL once past the end
  */
-const char * iterateUCIfiles( int i )
+const char * iterateUCIfiles( tElektraSession * session, int i )
 {
-    const char * path = testPaths[i];
-    logDebug( "  %d: test path = \'%s\'", i, path );
+    static char ** paths = NULL;
+    static int     count = 0;
+
+    if ( session != NULL )
+    {
+        pthread_mutex_lock( &session->lock );
+    }
+
+    if ( i == 0 )
+    {
+        for ( int j = 0; j < count; ++j )
+        {
+            free( paths[j] );
+        }
+        free( paths );
+        paths = NULL;
+        count = 0;
+
+        if ( session != NULL && fetchKeys( session, session->root ) == 0 )
+        {
+            KeySet * keySet = session->keySet;
+            paths = calloc( ksGetSize( keySet ), sizeof( char * ) );
+            const size_t prefixLen = sizeof( kConfigRoot ) - 1;
+            for ( elektraCursor it = 0; paths != NULL && it < ksGetSize( keySet ); ++it )
+            {
+                const char * name = keyName( ksAtCursor( keySet, it ) );
+                if ( strncmp( name, kConfigRoot, prefixLen ) != 0 || name[prefixLen] != '/' )
+                {
+                    continue;
+                }
+                /* the KeySet is sorted, so all the keys of a package are adjacent */
+                const char * package = &name[prefixLen];
+                size_t packageLen = strcspn( package + 1, "/" ) + 1;
+                if ( count == 0
+                  || strncmp( paths[count - 1], package, packageLen ) != 0
+                  || paths[count - 1][packageLen] != '\0' )
+                {
+                    paths[count++] = strndup( package, packageLen );
+                }
+            }
+        }
+    }
+
+    const char * path = ( i < count ) ? paths[i] : NULL;
+    logDebug( "  %d: path = \'%s\'", i, path );
+
+    if ( session != NULL )
+    {
+        pthread_mutex_unlock( &session->lock );
+    }
+
     return path;
 }
 
+/**
+ * @brief format the index used to tell apart list items, and anonymous sections with the same type.
+ * Three digits are used up to 999, so existing keys are unaffected, then an '_' is prefixed for each
+ * digit beyond three, so the keys still sort in numeric order. This is our own scheme, not libelektra's
+ * array notation, which doesn't zero-pad and has an '_' for every digit after the first.
+ * @param buffer
+ * @param size
+ * @param index
+ */
+static void formatIndex( char * buffer, size_t size, int index )
+{
+    int digits = 3;
+    for ( int i = index / 1000; i > 0; i /= 10 )
+    {
+        ++digits;
+    }
+    snprintf( buffer, size, "#%.*s%03d", digits - 3, "__________", index );
+}
+
 
 void dumpKeyMeta( Key * key )
 {
@@ -86,6 +293,18 @@ void dumpKeySetMeta( KeySet * keySet )
  */
 int setMetadata( KeySet * keyset, const char * keyName, const char * metaKey, const char * metaValue )
 {
+    /* if the key already exists, add to its metadata rather than replacing the key (and losing the rest) */
+    Key * existing = ksLookupByName( keyset, keyName, KDB_O_NONE );
+    if ( existing != NULL )
+    {
+        int result = ( keySetMeta( existing, metaKey, metaValue ) < 0 ) ? -1 : 0;
+        if ( result < 0 )
+        {
+            logError( "failed to set metadata \'%s\' on key %s", metaKey, keyName );
+        }
+        return result;
+    }
+
     Key * key = keyNew( keyName,
                         KEY_META, metaKey, metaValue,
                         KEY_END );
@@ -153,46 +372,11 @@ int setKeyToString( KeySet * keyset, const char * keyName, const char * value, c
     return result;
 }
 
-/**
- * @brief
- * @param keySet
- * @param keyName
- * @param value
- * @return
- */
-int setKeyToMAC( KeySet * keyset, const char * keyName, const char * value )
-{
-    return setKeyToString( keyset, keyName, value, "macaddr" );
-}
-
-/**
- * @brief
- * @param keySet
- * @param keyName
- * @param value
- * @return
- */
-int setKeyToIPv4( KeySet * keyset, const char * keyName, const char * value )
-{
-    return setKeyToString( keyset, keyName, value, "ipv4addr" );
-}
-
-/**
- * @brief
- * @param keySet
- * @param keyName
- * @param value
- * @return
- */
-int setKeyToIPv6( KeySet * keyset, const char * keyName, const char * value )
-{
-    return setKeyToString( keyset, keyName, value, "ipv6addr" );
-}
-
 /**
  * @brief generic 'set a key to a value'
- * it also figures out what type of value is being set, and calls the right
- * routine to set it, which sets the 'type' metadata.
+ * it also figures out what type of value is being set (see classifyValue), and
+ * sets the 'type' metadata to match. Integers are stored as binary longs, all
+ * other types keep the value as written so it renders back unchanged.
  * @param keySet
  * @param keyName
  * @param value
@@ -200,51 +384,14 @@ int setKeyToIPv6( KeySet * keyset, const char * keyName, const char * value )
  */
 int setKey( KeySet * keyset, const char * keyName, const char * value )
 {
-    int result;
-    const char * p = value;
-
-    /* ToDo: tighten up the format checks - this is way too 'loose' */
-    /* ToDo: add support for netmask */
-    int periodCount = 0;
-    int colonCount  = 0;
-    int slashCount  = 0;
-    bool isDecimal  = true;
-    bool isHex      = true;
-    for ( p = value; *p != '\0'; ++p )
-    {
-        switch (*p)
-        {
-        case '.': ++periodCount; break;
-        case ':': ++colonCount;  break;
-        case '/': ++slashCount;  break;
-        default:
-            if ( !isdigit(*p) ) isDecimal = false;
-            if ( !isxdigit(*p) ) isHex = false;
-            break;
-        }
-    }
+    long integer;
+    eValueType type = classifyValue( value, &integer );
 
-    if ( isHex && colonCount == 5 && periodCount == 0 && slashCount == 0 )
-    {
-        result = setKeyToMAC( keyset, keyName, value );
-    }
-    else if ( isHex && colonCount > 2 )
-    {
-        result = setKeyToIPv6( keyset, keyName, value );
-    }
-    else if ( isDecimal )
+    if ( type == kValueInteger )
     {
-        if (periodCount == 0)
-            result = setKeyToInteger( keyset, keyName, atol( value ));
-        else if (periodCount == 3)
-            result = setKeyToIPv4( keyset, keyName, value );
-        else
-            result = setKeyToString( keyset, keyName, value, "string" );
+        return setKeyToInteger( keyset, keyName, integer );
     }
-    else
-        result = setKeyToString( keyset, keyName, value, "string" );
-
-    return result;
+    return setKeyToString( keyset, keyName, value, gValueTypeAsStr[ type ] );
 }
 
 /**
@@ -272,18 +419,23 @@ int createList( KeySet * keyset, const char * keyName )
     return result;
 }
 
+#ifdef UCIFS_LIBUCI_PARSER
 /**
  * @brief
  * @param keySet
- * @param keyName
+ * @param keyPath  the section's key. Restored to that before returning
  * @param section
- * @return
  */
-char * storeSection( KeySet * keySet, char * keyName, const struct uci_section * section )
+void storeSection( KeySet * keySet, tKeyPath * keyPath, const struct uci_section * section )
 {
     /* ToDo: establish the section in libelektra (i.e. check it exists, create it if not) */
-    logDebug( "%s section with type \'%s\'", keyName, section->type );
-    setMetadata(keySet, keyName, "type", section->type );
+    logDebug( "%s section with type \'%s\'", keyPathName( keyPath ), section->type );
+    setMetadata( keySet, keyPathName( keyPath ), "type", section->type );
+    if ( section->anonymous )
+    {
+        /* so elektra2uci() knows not to render the key's name as the section name */
+        setMetadata( keySet, keyPathName( keyPath ), "anonymous", "1" );
+    }
 
     struct uci_element * optionElement;
     uci_foreach_element( &section->options, optionElement )
@@ -292,230 +444,2259 @@ char * storeSection( KeySet * keySet, char * keyName, const struct uci_section *
         switch ( option->type )
         {
         case UCI_TYPE_STRING:
-            keyName = appendKeyName( keyName, option->e.name );
-
-            setKey( keySet, keyName, option->v.string );
+            if ( pushKeyPath( keyPath, option->e.name ) == 0 )
+            {
+                setKey( keySet, keyPathName( keyPath ), option->v.string );
+                popKeyPath( keyPath );
+            }
             break;
 
         case UCI_TYPE_LIST:
+            if ( pushKeyPath( keyPath, option->e.name ) == 0 )
             {
-                keyName = appendKeyName( keyName, option->e.name );
-                createList( keySet, keyName );
+                createList( keySet, keyPathName( keyPath ) );
 
                 int index = 0;
+                char itemStr[32];
                 char indexStr[32];
                 indexStr[0] = '\0';
 
                 struct uci_element * listElement;
                 uci_foreach_element( &option->v.list, listElement )
                 {
-                    snprintf( indexStr, sizeof(indexStr), "#%03d", index++ );
-                    keyName = appendKeyName( keyName, indexStr );
-
-                    setKey( keySet, keyName, listElement->name );
-
-                    keyName = trimKey( keyName );
+                    formatIndex( itemStr, sizeof(itemStr), index++ );
+                    if ( pushKeyPath( keyPath, itemStr ) != 0 )
+                    {
+                        break;
+                    }
+                    setKey( keySet, keyPathName( keyPath ), listElement->name );
+                    popKeyPath( keyPath );
+
+                    strcpy( indexStr, itemStr );
                 }
                 /* 'array' metadata value is set to the name of the last list element by convention */
-                setMetadata( keySet, keyName, "array", indexStr );
+                setMetadata( keySet, keyPathName( keyPath ), "array", indexStr );
+                popKeyPath( keyPath );
             }
             break;
 
         default:
-            keyName = appendKeyName( keyName, "<error>" );
             logError( "option '%s' has an unknown type (%d)",
                       option->e.name,
                       option->type );
             break;
         }
-        keyName = trimKey( keyName );
     }
-    return keyName;
+}
+#endif
+
+/**
+ * @brief find the entry for type in the map. Hashes can collide, so the type is compared too.
+ * @param types
+ * @param type
+ * @param hash    hashString( type )
+ * @return the entry, or NULL if type isn't in the map
+ */
+static tSection * findSectionType( const tSectionTypes * types, const char * type, tHash hash )
+{
+    /* hashString() only mixes upwards, so fold the high bits into the bucket index */
+    tSection * s = types->bucket[ ( hash ^ ( hash >> 16 ) ) & types->mask ];
+    while ( s != NULL && ( s->hash != hash || ( s->type != type && strcmp( s->type, type ) != 0 ) ) )
+    {
+        s = s->next;
+    }
+    return s;
+}
+
+/**
+ * @brief
+ * @param arena
+ * @param expected  the number of types expected, so the map can be sized for at most 50% load
+ * @return an empty map, or NULL if it couldn't be allocated
+ */
+static tSectionTypes * newSectionTypes( tArena * arena, size_t expected )
+{
+    size_t bucketCount = 8;
+    while ( bucketCount < 2 * expected )
+    {
+        bucketCount *= 2;
+    }
+
+    tSectionTypes * types = arenaAlloc( arena, sizeof( tSectionTypes ) );
+    if ( types == NULL )
+    {
+        return NULL;
+    }
+    types->bucket = arenaCalloc( arena, bucketCount * sizeof( tSection * ) );
+    types->mask   = bucketCount - 1;
+    types->count  = 0;
+    if ( types->bucket == NULL )
+    {
+        return NULL;
+    }
+    return types;
+}
+
+/**
+ * @brief add a type that isn't in the map yet, with a count of zero. If that makes the map
+ * more than half full, it's doubled in size first. The old buckets are left in the arena.
+ * @param arena
+ * @param types
+ * @param type    must outlive the map
+ * @param hash    hashString( type )
+ * @return the new entry, or NULL if it couldn't be allocated
+ */
+static tSection * addSectionType( tArena * arena, tSectionTypes * types, const char * type, tHash hash )
+{
+    if ( 2 * ( types->count + 1 ) > types->mask + 1 )
+    {
+        size_t bucketCount = 2 * ( types->mask + 1 );
+        tSection ** bucket = arenaCalloc( arena, bucketCount * sizeof( tSection * ) );
+        if ( bucket == NULL )
+        {
+            return NULL;
+        }
+        for ( size_t i = 0; i <= types->mask; ++i )
+        {
+            tSection * next;
+            for ( tSection * s = types->bucket[i]; s != NULL; s = next )
+            {
+                next = s->next;
+                s->next = bucket[ ( s->hash ^ ( s->hash >> 16 ) ) & ( bucketCount - 1 ) ];
+                bucket[ ( s->hash ^ ( s->hash >> 16 ) ) & ( bucketCount - 1 ) ] = s;
+            }
+        }
+        types->bucket = bucket;
+        types->mask   = bucketCount - 1;
+    }
+
+    tSection * s = arenaCalloc( arena, sizeof( tSection ) );
+    if ( s != NULL )
+    {
+        tSection ** bucket = &types->bucket[ ( hash ^ ( hash >> 16 ) ) & types->mask ];
+        s->type = type;
+        s->hash = hash;
+        s->next = *bucket;
+        *bucket = s;
+        types->count++;
+    }
+    return s;
 }
 
-tSection * buildAnonSectionList( const struct uci_package * packageElement )
+#ifdef UCIFS_LIBUCI_PARSER
+/**
+ * @brief build a map of the types of the anonymous sections in a package, and the
+ * number of times each one appears
+ * @param arena
+ * @param packageElement
+ * @return the map, or NULL if it couldn't be allocated
+ */
+tSectionTypes * buildAnonSectionTypes( tArena * arena, const struct uci_package * packageElement )
 {
-    tSection * result = NULL;
     struct uci_element * sectionElement;
 
+    /* size the table for at most 50% load, even if every anonymous section has a different type */
+    size_t anonCount = 0;
+    uci_foreach_element( &packageElement->sections, sectionElement )
+    {
+        if ( uci_to_section( sectionElement )->anonymous ) ++anonCount;
+    }
+
+    tSectionTypes * types = newSectionTypes( arena, anonCount );
+    if ( types == NULL )
+    {
+        return NULL;
+    }
+
     /* Scan the list of sections, looking for anonymous ones */
     uci_foreach_element( &packageElement->sections, sectionElement )
     {
         struct uci_section * section = uci_to_section( sectionElement );
         if ( section->anonymous ) {
-            /* if it's anonymous, then it does not have a unique name, only a type. So we pre-scan the
-             * list of sections to build a list of the types of anonymous sections, */
-            tSection * s;
+            /* if it's anonymous, then it does not have a unique name, only a type. So we count
+             * how many anonymous sections there are of each type */
             tHash typeHash = hashString( section->type );
-            for ( s = result; s != NULL; s = s->next )
+            tSection * s = findSectionType( types, section->type, typeHash );
+            if ( s == NULL )
             {
-                if ( s->hash == typeHash )
-                {
-                    /* found it, so bump up the count */
-                    s->count++;
-                    break;
-                }
+                /* first time we've seen this section type, so add it to its bucket */
+                s = addSectionType( arena, types, section->type, typeHash );
             }
-            if ( s == NULL )
+            if ( s != NULL )
             {
-                /* first time we've seen this section type, so add it to the list */
-                s = calloc( 1, sizeof( tSection ) );
-                if ( s != NULL )
-                {
-                    s->type  = strdup( section->type );
-                    s->hash  = typeHash;
-                    s->count = 1;
-                    s->next  = result;
-                    result = s;
-                }
+                s->count++;
             }
         }
     }
-    return result;
-}
-
-void freeAnonSectionList( tSection * anonSections )
-{/* clean up the anonSection list */
-    for ( tSection * s = anonSections; s != NULL; )
-    {
-        tSection * next = s->next;
-        free( (void *)s->type );
-        free( s );
-        s = next;
-    }
+    return types;
 }
+#endif
 
-/* look for the matching section type in the list created by buildAnonSectionList()
+/* look for the matching section type in the map of anonymous section types
  * to determine if the type is  ambiguous (i.e. there is more than one anonymous
  * section with this type in this package)
  *
  * Note: the counter in the entry for this type is incremented as a side-effect */
 
-bool isAmbiguous( tSection * anonSections, const char * type, int * counter )
+bool isAmbiguous( const tSectionTypes * anonSections, const char * type, int * counter )
 {
     bool result = false;
 
-    tHash typeHash = hashString( type );
-    tSection * s = anonSections;
-    while ( s != NULL )
+    tSection * s = NULL;
+    if ( anonSections != NULL )
     {
-        if ( s->hash == typeHash )
-        {
-            /* found it. is there more than one of them? */
-            if ( s->count > 1 )
-            {
-                result = true;
-                /* we need this later to disambiguate the anonymous sections with the same type */
-                (*counter) = s->counter++;
-            }
-            break;
-        }
-        s = s->next;
+        s = findSectionType( anonSections, type, hashString( type ) );
+    }
+    /* found it. is there more than one of them? */
+    if ( s != NULL && s->count > 1 )
+    {
+        result = true;
+        /* we need this later to disambiguate the anonymous sections with the same type */
+        (*counter) = s->counter++;
     }
     return result;
 }
 
 /**
- * @brief mirror the imported UCI structures into libelektra
- * @param ctx
+ * @brief compare two keys with the same name
+ * @param a
+ * @param b
+ * @return true if their values or metadata differ
  */
-void uci2elektra( const struct uci_context * ctx )
+static bool keysDiffer( const Key * a, const Key * b )
 {
-    char * keyName = strdup( "system:/config" );
+    if ( keyIsBinary( a ) != keyIsBinary( b )
+      || keyGetValueSize( a ) != keyGetValueSize( b )
+      || memcmp( keyValue( a ), keyValue( b ), keyGetValueSize( a ) ) != 0 )
+    {
+        return true;
+    }
 
-    /* ToDo: establish the config root in libelektra (i.e. check it exists, create it if not) */
-    Key * parent = keyNew(keyName, KEY_END);
-    KDB * kdb = kdbOpen( NULL, parent );
-    logDebug( "kdb = %p for \'%s\'", kdb, keyName );
-    if ( kdb == NULL )
+    /* keyMeta() isn't const-correct, but doesn't modify the key */
+    KeySet * metaA = keyMeta( (Key *)a );
+    KeySet * metaB = keyMeta( (Key *)b );
+    if ( ksGetSize( metaA ) != ksGetSize( metaB ) )
     {
-        logError( "unable to open libelektra" );
-        return;
+        return true;
     }
-    KeySet * keySet = ksNew(0, KS_END);
-    if ( keySet == NULL )
+    /* both are sorted by name, so they can be compared pairwise */
+    for ( elektraCursor it = 0; it < ksGetSize( metaA ); ++it )
     {
-        logError( "failed to create a KeySet" );
-        return;
+        Key * ma = ksAtCursor( metaA, it );
+        Key * mb = ksAtCursor( metaB, it );
+        if ( strcmp( keyName( ma ), keyName( mb ) ) != 0 || strcmp( keyString( ma ), keyString( mb ) ) != 0 )
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    /* It's necessary to preload the keySet. No idea why, but errors occur if you don't. */
-    kdbGet (kdb, keySet, parent);
-
-    struct uci_element * rootElement;
-    tSection * anonSections = NULL;
-
-    setMetadata( keySet, keyName, "type", "config" );
+/**
+ * @brief bring the package below parent in keySet in line with the freshly imported keys.
+ * Only the keys that differ are appended, and only the keys that are no longer present are
+ * cut, so the work scales with the size of the edit. Nothing is written to the backend,
+ * that's left to commitPackages().
+ * @param keySet   the current contents of the backend, as returned by kdbGet
+ * @param imported the packages as they were just imported
+ * @param parent   the package key, e.g. system:/config/network
+ * @return the number of keys changed or removed
+ */
+static long stagePackage( KeySet * keySet, KeySet * imported, Key * parent )
+{
+    KeySet * changed = ksNew( 0, KS_END );
+    KeySet * removed = ksNew( 0, KS_END );
 
-    uci_foreach_element( &ctx->root, rootElement )
+    /* both KeySets are sorted, so a single merge pass finds every difference */
+    elektraCursor currentEnd;
+    elektraCursor current = ksFindHierarchy( keySet, parent, &currentEnd );
+    if ( current < 0 )
     {
-        struct uci_package * packageElement = uci_to_package( rootElement );
-
-        keyName = appendKeyName( keyName, packageElement->e.name );
-        /* ToDo: establish the package (i.e. check it exists, create it if not) */
-        logDebug( "establish package \'%s\'", keyName );
+        current = currentEnd = 0;
+    }
+    elektraCursor importedEnd;
+    elektraCursor importedIt = ksFindHierarchy( imported, parent, &importedEnd );
+    if ( importedIt < 0 )
+    {
+        importedIt = importedEnd = 0;
+    }
 
-        /* build a list of the types of the anonymopus sections in this
-         * package and the number of times each one appears */
-        anonSections = buildAnonSectionList( packageElement );
+    while ( current < currentEnd || importedIt < importedEnd )
+    {
+        Key * was = ( current    < currentEnd  ) ? ksAtCursor( keySet,   current    ) : NULL;
+        Key * now = ( importedIt < importedEnd ) ? ksAtCursor( imported, importedIt ) : NULL;
 
-#ifdef DEBUG
-        for ( tSection * s = anonSections; s != NULL; s = s->next  )
+        int cmp = ( was == NULL ) ? 1 : ( now == NULL ) ? -1 : keyCmp( was, now );
+        if ( cmp < 0 )
         {
-            logDebug( "anon section - type: \'%s\' (hash: 0x%lx) count: %d", s->type, s->hash, s->count );
+            /* no longer in the package */
+            ksAppendKey( removed, was );
+            ++current;
         }
-#endif
-
-        struct uci_element * sectionElement;
-        uci_foreach_element( &packageElement->sections, sectionElement )
+        else if ( cmp > 0 )
         {
-            struct uci_section * section = uci_to_section( sectionElement );
-
-            logDebug( "section type: %s name: %s", section->type, section->e.name );
-            /* The list of anonymous types we built earlier can tell us if there's more than
-             * one anonymous section with the same type. If so, we set ambiguous = true. */
-            bool ambiguous = false;
-            int counter; /* only referenced when ambiguous == true */
-
-            if ( section->anonymous ) {
-                /* there's no e.name, so use the type instead */
-                keyName = appendKeyName( keyName, section->type );
-                ambiguous = isAmbiguous( anonSections, section->type, &counter );
-            } else {
-                keyName = appendKeyName( keyName, section->e.name );
-            }
-
-            if ( ambiguous ) {
-                /* there is more than one anonymous section with the same type. So append an index to
-                 * the key to produce /{type}/{index} so they can co-exist within the same package */
-                logDebug( "section: \'%s[%d]\'", section->type, counter );
-                char indexStr[32];
-                snprintf( indexStr, sizeof( indexStr ), "#%03d", counter );
-                keyName = appendKeyName( keyName, indexStr );
-            }
-
-            keyName = storeSection( keySet, keyName, section );
-
-            if ( ambiguous )
+            /* new to the package */
+            ksAppendKey( changed, now );
+            ++importedIt;
+        }
+        else
+        {
+            if ( keysDiffer( was, now ) )
             {
-                /* remove the additional index used to disambiguate */
-                keyName = trimKey( keyName );
+                ksAppendKey( changed, now );
             }
-            keyName = trimKey( keyName );
+            ++current;
+            ++importedIt;
         }
-        keyName = trimKey( keyName );
     }
-    int result;
-    result = kdbSet( kdb , keySet, parent );
-    if ( result != 0)
+
+    long result = ksGetSize( changed ) + ksGetSize( removed );
+    logDebug( "%s: %ld keys changed, %ld removed", keyName( parent ), ksGetSize( changed ), ksGetSize( removed ) );
+
+    for ( elektraCursor it = 0; it < ksGetSize( removed ); ++it )
     {
-        logDebug( "kdbSet returned %d", result );
-        dumpKeySetMeta( keySet );
+        Key * key = ksLookup( keySet, ksAtCursor( removed, it ), KDB_O_POP );
+        keyDel( key );
     }
+    ksAppend( keySet, changed );
 
-    result = kdbClose( kdb, parent );
-    logDebug( "kdbClose returned %d", result );
+    ksDel( removed );
+    ksDel( changed );
 
-    freeAnonSectionList( anonSections );
+    return result;
 }
 
+/**
+ * @brief stage every package, then commit them all with a single kdbSet. If
+ * nothing has changed, libelektra isn't asked to write anything at all.
+ * @param session
+ * @param imported the packages as they were just imported
+ * @param packages the package keys, e.g. system:/config/network
+ * @return the result of kdbSet, or 0 if nothing needed committing
+ */
+static int commitPackages( tElektraSession * session, KeySet * imported, KeySet * packages )
+{
+    long changes = 0;
+
+    for ( elektraCursor it = 0; it < ksGetSize( packages ); ++it )
+    {
+        changes += stagePackage( session->keySet, imported, ksAtCursor( packages, it ) );
+    }
+
+    int result = 0;
+    if ( changes > 0 )
+    {
+        countStat( kStatElektraSets, 1 );
+        result = kdbSet( session->kdb, session->keySet, session->root );
+        if ( result < 0 )
+        {
+            logError( "kdbSet of '%s' returned %d", kConfigRoot, result );
+            dumpKeySetMeta( session->keySet );
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief commit the imported packages, and if that fails (e.g. a conflict with another
+ * writer) start again from a fresh view of the backend, so the diff is taken against
+ * what's really there. The caller must hold the session's lock, and have fetched the keys.
+ * @param session
+ * @param imported
+ * @param packages
+ */
+static void commitImported( tElektraSession * session, KeySet * imported, KeySet * packages )
+{
+    if ( commitPackages( session, imported, packages ) < 0 )
+    {
+        if ( reopenElektraSession( session ) == 0 && fetchKeys( session, session->root ) == 0 )
+        {
+            commitPackages( session, imported, packages );
+        }
+    }
+}
+
+#ifdef UCIFS_LIBUCI_PARSER
+/**
+ * @brief convert one package into keys below keyPath, appending them to imported
+ * @param imported
+ * @param keyPath  the package key, e.g. system:/config/network
+ * @param packageElement
+ * @param arena
+ */
+static void importPackage( KeySet * imported, tKeyPath * keyPath,
+                           const struct uci_package * packageElement, tArena * arena )
+{
+    /* build a map of the types of the anonymous sections in this
+     * package and the number of times each one appears */
+    tSectionTypes * anonSections = buildAnonSectionTypes( arena, packageElement );
+
+#ifdef DEBUG
+    for ( size_t i = 0; anonSections != NULL && i <= anonSections->mask; ++i )
+    {
+        for ( tSection * s = anonSections->bucket[i]; s != NULL; s = s->next )
+        {
+            logDebug( "anon section - type: \'%s\' (hash: 0x%lx) count: %d", s->type, s->hash, s->count );
+        }
+    }
+#endif
+
+    struct uci_element * sectionElement;
+    uci_foreach_element( &packageElement->sections, sectionElement )
+    {
+        struct uci_section * section = uci_to_section( sectionElement );
+
+        logDebug( "section type: %s name: %s", section->type, section->e.name );
+        /* The map of anonymous types we built earlier can tell us if there's more than
+         * one anonymous section with the same type. If so, we set ambiguous = true. */
+        bool ambiguous = false;
+        int counter; /* only referenced when ambiguous == true */
+
+        /* there's no e.name for an anonymous section, so use the type instead */
+        if ( pushKeyPath( keyPath, section->anonymous ? section->type : section->e.name ) != 0 )
+        {
+            continue;
+        }
+        if ( section->anonymous ) {
+            ambiguous = isAmbiguous( anonSections, section->type, &counter );
+        }
+
+        if ( ambiguous ) {
+            /* there is more than one anonymous section with the same type. So append an index to
+             * the key to produce /{type}/{index} so they can co-exist within the same package */
+            logDebug( "section: \'%s[%d]\'", section->type, counter );
+            char indexStr[32];
+            formatIndex( indexStr, sizeof( indexStr ), counter );
+            if ( pushKeyPath( keyPath, indexStr ) == 0 )
+            {
+                storeSection( imported, keyPath, section );
+
+                /* remove the additional index used to disambiguate */
+                popKeyPath( keyPath );
+            }
+        }
+        else
+        {
+            storeSection( imported, keyPath, section );
+        }
+        popKeyPath( keyPath );
+    }
+}
+
+/**
+ * @brief convert every package libuci has imported into keys
+ * @param ctx
+ * @param keyPath   scratch for building the key names
+ * @param arena     all the temporaries of the conversion come from here
+ * @param imported  the keys are added to this
+ * @param packages  and the package keys, e.g. system:/config/network, to this
+ * @return 0, or -ENOMEM
+ */
+static int convertUCIPackages( const struct uci_context * ctx, tKeyPath * keyPath, tArena * arena,
+                               KeySet * imported, KeySet * packages )
+{
+    int result = initKeyPath( keyPath, kConfigRoot );
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    struct uci_element * rootElement;
+    uci_foreach_element( &ctx->root, rootElement )
+    {
+        struct uci_package * packageElement = uci_to_package( rootElement );
+
+        if ( pushKeyPath( keyPath, packageElement->e.name ) != 0 )
+        {
+            /* it isn't added to packages either, so what's in libelektra for it is left alone */
+            logError( "skipped package \'%s\'", packageElement->e.name );
+            continue;
+        }
+        logDebug( "import package \'%s\'", keyPathName( keyPath ) );
+        importPackage( imported, keyPath, packageElement, arena );
+        ksAppendKey( packages, keyNew( keyPathName( keyPath ), KEY_END ) );
+        popKeyPath( keyPath );
+    }
+    return 0;
+}
+
+/**
+ * @brief mirror the imported UCI structures into libelektra. Every package in ctx is
+ * committed together, with a single kdbSet.
+ * @param session
+ * @param ctx
+ * @param arena  all the temporaries of the conversion come from here
+ */
+static void uci2elektra( tElektraSession * session, const struct uci_context * ctx, tArena * arena )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    KeySet * imported = ksNew( 0, KS_END );
+    KeySet * packages = ksNew( 0, KS_END );
+    /* the session's key path keeps its buffer between imports */
+    if ( imported == NULL || packages == NULL || fetchKeys( session, session->root ) != 0
+      || convertUCIPackages( ctx, &session->keyPath, arena, imported, packages ) != 0 )
+    {
+        if ( imported != NULL ) ksDel( imported );
+        if ( packages != NULL ) ksDel( packages );
+        pthread_mutex_unlock( &session->lock );
+        return;
+    }
+
+    commitImported( session, imported, packages );
+
+    ksDel( packages );
+    ksDel( imported );
+
+    pthread_mutex_unlock( &session->lock );
+}
+#endif
+
+
+/**
+ * @brief
+ * @param key
+ * @param metaName
+ * @return the value of the metadata, or NULL if the key doesn't have it
+ */
+static const char * getMetaString( const Key * key, const char * metaName )
+{
+    const Key * meta = keyGetMeta( key, metaName );
+    return ( meta != NULL ) ? keyString( meta ) : NULL;
+}
+
+/**
+ * @brief how many levels below parent the key is, without allocating
+ * @param parent
+ * @param key must be below parent
+ * @return
+ */
+static int getDepthBelow( const Key * parent, const Key * key )
+{
+    int depth = 0;
+    for ( const char * p = &keyName( key )[ keyGetNameSize( parent ) - 1 ]; *p != '\0'; ++p )
+    {
+        if ( *p == '\\' && p[1] != '\0' )
+        {
+            ++p; /* skip the escaped character */
+        }
+        else if ( *p == '/' )
+        {
+            ++depth;
+        }
+    }
+    return depth;
+}
+
+/**
+ * @brief lists are marked by createList() with 'array' metadata, and a type of 'list'
+ * @param key
+ * @return
+ */
+static tBool isListKey( const Key * key )
+{
+    const char * type = getMetaString( key, "type" );
+    return ( keyGetMeta( key, "array" ) != NULL || ( type != NULL && strcmp( type, "list" ) == 0 ) );
+}
+
+/**
+ * @brief the value of a key as UCI text. Integers are stored as binary longs by setKeyToInteger()
+ * @param key
+ * @param scratch used to format an integer, so no allocation is needed
+ * @param scratchSize
+ * @return
+ */
+static const char * getValueAsString( const Key * key, char * scratch, size_t scratchSize )
+{
+    if ( keyIsBinary( key ) )
+    {
+        scratch[0] = '\0';
+        if ( keyGetValueSize( key ) == sizeof( long ) )
+        {
+            long value;
+            memcpy( &value, keyValue( key ), sizeof( long ) );
+            snprintf( scratch, scratchSize, "%ld", value );
+        }
+        return scratch;
+    }
+    return keyString( key );
+}
+
+/**
+ * @brief append a value in single quotes, escaping embedded quotes the way 'uci export' does
+ * @param output
+ * @param value
+ * @return 0 on success, or -ENOMEM
+ */
+static int appendQuoted( tBuffer * output, const char * value )
+{
+    int result = appendToBuffer( output, "'", 1 );
+
+    const char * quote;
+    while ( result == 0 && (quote = strchr( value, '\'' )) != NULL )
+    {
+        result = appendToBuffer( output, value, quote - value );
+        if ( result == 0 )
+        {
+            result = appendToBuffer( output, "'\\''", 4 );
+        }
+        value = quote + 1;
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, value, strlen( value ) );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, "'", 1 );
+    }
+    return result;
+}
+
+/**
+ * @brief append a 'config' line, starting a section
+ * @param output
+ * @param type
+ * @param name NULL for an anonymous section
+ * @return 0 on success, or -ENOMEM
+ */
+static int appendSection( tBuffer * output, const char * type, const char * name )
+{
+    int result = 0;
+
+    if ( output->length > 0 )
+    {
+        /* separate the sections with a blank line */
+        result = appendToBuffer( output, "\n", 1 );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, "config ", 7 );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, type, strlen( type ) );
+    }
+    if ( result == 0 && name != NULL )
+    {
+        result = appendToBuffer( output, " ", 1 );
+        if ( result == 0 )
+        {
+            result = appendQuoted( output, name );
+        }
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, "\n", 1 );
+    }
+    return result;
+}
+
+/**
+ * @brief append an 'option' or 'list' line within a section
+ * @param output
+ * @param kind  "option" or "list"
+ * @param name
+ * @param value
+ * @return 0 on success, or -ENOMEM
+ */
+static int appendOption( tBuffer * output, const char * kind, const char * name, const char * value )
+{
+    int result = appendToBuffer( output, "\t", 1 );
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, kind, strlen( kind ) );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, " ", 1 );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, name, strlen( name ) );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, " ", 1 );
+    }
+    if ( result == 0 )
+    {
+        result = appendQuoted( output, value );
+    }
+    if ( result == 0 )
+    {
+        result = appendToBuffer( output, "\n", 1 );
+    }
+    return result;
+}
+
+/**
+ * @brief render a package from libelektra as UCI text - the reverse of uci2elektra().
+ *
+ * The keys of a package are fetched with a single kdbGet, and rendered in one pass over the
+ * (sorted) KeySet, since every key follows its parent. The layout is the one uci2elektra() writes:
+ *
+ *   system:/config/{package}/{section}/{option}         named, or lone anonymous, sections
+ *   system:/config/{package}/{type}/#{index}/{option}   anonymous sections that share a type
+ *   system:/config/{package}/.../{list}/#{index}        list items, the list key has 'array' metadata
+ *
+ * Nothing is allocated per key, the output buffer just grows geometrically.
+ * @param session
+ * @param package the package name, e.g. "network"
+ * @param output  appended to
+ * @return 0 on success, or a negative errno
+ */
+int elektra2uci( tElektraSession * session, const char * package, tBuffer * output )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+
+    Key * parent = keyNew( kConfigRoot, KEY_END );
+    keyAddBaseName( parent, package );
+
+    /* hold the lock until the render is done, the KeySet is shared with other threads */
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, parent );
+    if ( result == 0 )
+    {
+        KeySet * keySet = session->keySet;
+
+        /* make sure there's a buffer, even if the package is empty */
+        result = reserveBuffer( output, 4096 );
+
+        const Key * container = NULL;   // the current key directly below the package
+        const Key * section   = NULL;   // the current section, if any
+        const Key * list      = NULL;   // the current list, if any
+        char        scratch[32];
+
+        elektraCursor end;
+        elektraCursor it = ksFindHierarchy( keySet, parent, &end );
+        for ( ; result == 0 && it >= 0 && it < end; ++it )
+        {
+            const Key *  key      = ksAtCursor( keySet, it );
+            const char * baseName = keyBaseName( key );
+            const char * type     = getMetaString( key, "type" );
+
+            if ( list != NULL && keyIsDirectlyBelow( list, key ) == 1 )
+            {
+                result = appendOption( output, "list", keyBaseName( list ),
+                                       getValueAsString( key, scratch, sizeof( scratch ) ) );
+                continue;
+            }
+            list = NULL;
+
+            if ( section != NULL && keyIsDirectlyBelow( section, key ) == 1 )
+            {
+                if ( isListKey( key ) )
+                {
+                    /* the items of the list immediately follow it */
+                    list = key;
+                }
+                else
+                {
+                    result = appendOption( output, "option", baseName,
+                                           getValueAsString( key, scratch, sizeof( scratch ) ) );
+                }
+            }
+            else if ( keyIsDirectlyBelow( parent, key ) == 1 )
+            {
+                /* either a section, or the parent of anonymous sections that share a type */
+                container = key;
+                section   = NULL;
+                if ( type != NULL )
+                {
+                    section = key;
+                    result = appendSection( output, type,
+                                            getMetaString( key, "anonymous" ) != NULL ? NULL : baseName );
+                }
+            }
+            else if ( baseName[0] == '#' && getDepthBelow( parent, key ) == 2 )
+            {
+                /* one of several anonymous sections with the same type. The parent key
+                 * usually doesn't exist, so the type comes from the section's metadata */
+                if ( type == NULL && container != NULL && keyIsDirectlyBelow( container, key ) == 1 )
+                {
+                    type = keyBaseName( container );
+                }
+                section = key;
+                result = appendSection( output, ( type != NULL ) ? type : "unknown", NULL );
+            }
+            else
+            {
+                logDebug( "ignoring unexpected key \'%s\'", keyName( key ) );
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( parent );
+
+    return result;
+}
+
+/********************************/
+
+/* the state of parseUCIPackage() as it works through the statements of one file */
+typedef struct {
+    tArena *        arena;
+    tKeyPath *      keyPath;
+    KeySet *        parsed;         // the file's keys, only added to the import if it parses cleanly
+    KeySet *        packages;       // the packages the file contains
+    tSectionTypes * anonTypes;      // keyed by '{package} {type}', as a file can switch packages
+    tBuffer         package;        // the name of the current package
+    tBuffer         string;         // a nul-terminated copy of an argument
+    tBuffer         typeKey;        // scratch for building anonTypes' keys
+    size_t          sectionDepth;   // the segments the current section added to the key path
+} tTextImport;
+
+/**
+ * @brief copy a slice, so it can be used as a C string
+ * @param buffer
+ * @param data
+ * @param length
+ * @return the nul-terminated copy, or NULL if there wasn't enough memory
+ */
+static const char * copyString( tBuffer * buffer, const char * data, size_t length )
+{
+    buffer->length = 0;
+    if ( reserveBuffer( buffer, length + 1 ) != 0 )
+    {
+        return NULL;
+    }
+    memcpy( buffer->data, data, length );
+    buffer->data[ length ] = '\0';
+    buffer->length = length;
+    return buffer->data;
+}
+
+/**
+ * @brief the inverse of formatIndex()
+ * @param index e.g. '#007' or '#_1000'
+ * @return the index, or -1 if there isn't one
+ */
+static long parseIndex( const char * index )
+{
+    if ( index == NULL || *index++ != '#' )
+    {
+        return -1;
+    }
+    while ( *index == '_' )
+    {
+        ++index;
+    }
+    return ( *index != '\0' ) ? strtol( index, NULL, 10 ) : -1;
+}
+
+/**
+ * @brief find the entry for an anonymous section type in the current package
+ * @param text
+ * @param type
+ * @param add   add an entry if there isn't one yet
+ * @return the entry, or NULL if there isn't one (or it couldn't be allocated)
+ */
+static tSection * lookupAnonType( tTextImport * text, const tSlice * type, tBool add )
+{
+    tBuffer * key = &text->typeKey;
+    key->length = 0;
+    if ( appendToBuffer( key, text->package.data, text->package.length ) != 0
+      || appendToBuffer( key, " ", 1 ) != 0
+      || appendToBuffer( key, type->data, type->length ) != 0
+      || appendToBuffer( key, "", 1 ) != 0 )
+    {
+        return NULL;
+    }
+
+    tHash hash = hashString( key->data );
+    tSection * s = findSectionType( text->anonTypes, key->data, hash );
+    if ( s == NULL && add )
+    {
+        const char * copy = arenaStrdup( text->arena, key->data );
+        if ( copy != NULL )
+        {
+            s = addSectionType( text->arena, text->anonTypes, copy, hash );
+        }
+    }
+    return s;
+}
+
+/**
+ * @brief the first pass over the text, counting the anonymous sections of each type,
+ * so the second pass knows which ones need an index to tell them apart
+ * @param statement
+ * @param context  the tTextImport
+ * @return 0, or -ENOMEM
+ */
+static int countAnonSection( const tUCIStatement * statement, void * context )
+{
+    tTextImport * text = context;
+
+    switch ( statement->kind )
+    {
+    case kUCIStatementPackage:
+        if ( copyString( &text->package, statement->arg[0].data, statement->arg[0].length ) == NULL )
+        {
+            return -ENOMEM;
+        }
+        break;
+
+    case kUCIStatementConfig:
+        if ( statement->arg[1].length == 0 )
+        {
+            tSection * s = lookupAnonType( text, &statement->arg[0], yes );
+            if ( s == NULL )
+            {
+                return -ENOMEM;
+            }
+            s->count++;
+        }
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief start a section, leaving the key path at its key
+ * @param text
+ * @param statement
+ * @return 0, -EINVAL if it clashes with an earlier section, or -ENOMEM
+ */
+static int importSection( tTextImport * text, const tUCIStatement * statement )
+{
+    tKeyPath * keyPath = text->keyPath;
+    tBool anonymous = ( statement->arg[1].length == 0 );
+    int counter;
+
+    /* anonymous sections don't have a name, so use the type instead */
+    const tSlice * name = anonymous ? &statement->arg[0] : &statement->arg[1];
+    if ( copyString( &text->string, name->data, name->length ) == NULL
+      || pushKeyPath( keyPath, text->string.data ) != 0 )
+    {
+        return -ENOMEM;
+    }
+    text->sectionDepth = 1;
+
+    if ( anonymous && lookupAnonType( text, &statement->arg[0], no ) != NULL
+      && isAmbiguous( text->anonTypes, text->typeKey.data, &counter ) )
+    {
+        /* there is more than one anonymous section with the same type. So append an index to
+         * the key to produce /{type}/{index} so they can co-exist within the same package */
+        char indexStr[32];
+        formatIndex( indexStr, sizeof( indexStr ), counter );
+        if ( pushKeyPath( keyPath, indexStr ) != 0 )
+        {
+            return -ENOMEM;
+        }
+        text->sectionDepth = 2;
+    }
+
+    const char * type = copyString( &text->string, statement->arg[0].data, statement->arg[0].length );
+    if ( type == NULL )
+    {
+        return -ENOMEM;
+    }
+    if ( !anonymous )
+    {
+        /* a section may be reopened to add to it, but not with a different type */
+        const Key * existing = ksLookupByName( text->parsed, keyPathName( keyPath ), KDB_O_NONE );
+        const char * existingType = ( existing != NULL ) ? getMetaString( existing, "type" ) : NULL;
+        if ( existingType != NULL && strcmp( existingType, type ) != 0 )
+        {
+            logError( "%s, line %u: section of different type overwrites prior section with same name",
+                      text->package.data, statement->line );
+            return -EINVAL;
+        }
+    }
+
+    logDebug( "%s section with type \'%s\'", keyPathName( keyPath ), type );
+    setMetadata( text->parsed, keyPathName( keyPath ), "type", type );
+    if ( anonymous )
+    {
+        /* so elektra2uci() knows not to render the key's name as the section name */
+        setMetadata( text->parsed, keyPathName( keyPath ), "anonymous", "1" );
+    }
+    return 0;
+}
+
+/**
+ * @brief remove an option, and any list items below it
+ * @param keySet
+ * @param option
+ */
+static void removeOption( KeySet * keySet, Key * option )
+{
+    KeySet * removed = ksCut( keySet, option );
+    ksDel( removed );
+}
+
+/**
+ * @brief set an option, replacing whatever it was before. As with libuci, an empty
+ * value removes the option.
+ * @param text
+ * @param value
+ * @return 0, or -ENOMEM
+ */
+static int importOption( tTextImport * text, const tSlice * value )
+{
+    const char * optionName = keyPathName( text->keyPath );
+
+    Key * existing = ksLookupByName( text->parsed, optionName, KDB_O_NONE );
+    if ( existing != NULL && ( value->length == 0 || isListKey( existing ) ) )
+    {
+        removeOption( text->parsed, existing );
+    }
+    if ( value->length > 0 )
+    {
+        if ( copyString( &text->string, value->data, value->length ) == NULL )
+        {
+            return -ENOMEM;
+        }
+        setKey( text->parsed, optionName, text->string.data );
+    }
+    return 0;
+}
+
+/**
+ * @brief append an item to a list, creating the list if need be. As with libuci, an
+ * option with the same name becomes the first item of the list.
+ * @param text
+ * @param value
+ * @return 0, or -ENOMEM
+ */
+static int importListItem( tTextImport * text, const tSlice * value )
+{
+    tKeyPath * keyPath = text->keyPath;
+    const char * listName = keyPathName( keyPath );
+
+    long index = 0;
+    Key * existing = ksLookupByName( text->parsed, listName, KDB_O_NONE );
+    if ( existing != NULL && isListKey( existing ) )
+    {
+        index = parseIndex( getMetaString( existing, "array" ) ) + 1;
+    }
+    else
+    {
+        const char * first = NULL;
+        if ( existing != NULL )
+        {
+            char scratch[32];
+            const char * was = getValueAsString( existing, scratch, sizeof( scratch ) );
+            first = copyString( &text->string, was, strlen( was ) );
+            if ( first == NULL )
+            {
+                return -ENOMEM;
+            }
+            removeOption( text->parsed, existing );
+        }
+        createList( text->parsed, listName );
+        if ( first != NULL )
+        {
+            char indexStr[32];
+            formatIndex( indexStr, sizeof( indexStr ), index++ );
+            if ( pushKeyPath( keyPath, indexStr ) != 0 )
+            {
+                return -ENOMEM;
+            }
+            setKey( text->parsed, keyPathName( keyPath ), first );
+            popKeyPath( keyPath );
+        }
+    }
+
+    char indexStr[32];
+    formatIndex( indexStr, sizeof( indexStr ), index );
+    if ( copyString( &text->string, value->data, value->length ) == NULL
+      || pushKeyPath( keyPath, indexStr ) != 0 )
+    {
+        return -ENOMEM;
+    }
+    setKey( text->parsed, keyPathName( keyPath ), text->string.data );
+    popKeyPath( keyPath );
+
+    /* 'array' metadata value is set to the name of the last list element by convention */
+    setMetadata( text->parsed, keyPathName( keyPath ), "array", indexStr );
+    return 0;
+}
+
+/**
+ * @brief switch to another package, as a 'package' statement asks
+ * @param text
+ * @param name
+ * @param length
+ * @return 0, or -ENOMEM
+ */
+static int importPackageStatement( tTextImport * text, const char * name, size_t length )
+{
+    tKeyPath * keyPath = text->keyPath;
+    while ( keyPath->depth > 0 )
+    {
+        popKeyPath( keyPath );
+    }
+    text->sectionDepth = 0;
+
+    if ( copyString( &text->package, name, length ) == NULL
+      || pushKeyPath( keyPath, text->package.data ) != 0 )
+    {
+        return -ENOMEM;
+    }
+    logDebug( "import package \'%s\'", keyPathName( keyPath ) );
+    ksAppendKey( text->packages, keyNew( keyPathName( keyPath ), KEY_END ) );
+    return 0;
+}
+
+/**
+ * @brief the second pass over the text, converting each statement into keys
+ * @param statement
+ * @param context  the tTextImport
+ * @return 0, -EINVAL or -ENOMEM
+ */
+static int importStatement( const tUCIStatement * statement, void * context )
+{
+    tTextImport * text = context;
+    tKeyPath * keyPath = text->keyPath;
+    int result = 0;
+
+    switch ( statement->kind )
+    {
+    case kUCIStatementPackage:
+        result = importPackageStatement( text, statement->arg[0].data, statement->arg[0].length );
+        break;
+
+    case kUCIStatementConfig:
+        while ( text->sectionDepth > 0 )
+        {
+            popKeyPath( keyPath );
+            --text->sectionDepth;
+        }
+        result = importSection( text, statement );
+        break;
+
+    case kUCIStatementOption:
+    case kUCIStatementList:
+        if ( copyString( &text->string, statement->arg[0].data, statement->arg[0].length ) == NULL
+          || pushKeyPath( keyPath, text->string.data ) != 0 )
+        {
+            return -ENOMEM;
+        }
+        if ( statement->kind == kUCIStatementOption )
+        {
+            result = importOption( text, &statement->arg[1] );
+        }
+        else
+        {
+            result = importListItem( text, &statement->arg[1] );
+        }
+        popKeyPath( keyPath );
+        break;
+    }
+    return result;
+}
+
+/**
+ * @brief convert the text of a package into keys with the built-in parser
+ * @param arena
+ * @param keyPath   scratch for building the key names
+ * @param package   the package's name, e.g. 'network'
+ * @param text      need not be nul-terminated
+ * @param length
+ * @param imported  the keys are added to this, but only if the whole text parses
+ * @param packages  and the keys of the packages it contains to this
+ * @return 0, -EINVAL if the text isn't valid UCI, or -ENOMEM
+ */
+static int parseUCIPackage( tArena * arena, tKeyPath * keyPath, const char * package,
+                            const char * text, size_t length, KeySet * imported, KeySet * packages )
+{
+    tTextImport state;
+    memset( &state, 0, sizeof( state ) );
+    state.arena     = arena;
+    state.keyPath   = keyPath;
+    state.parsed    = ksNew( 0, KS_END );
+    state.packages  = ksNew( 0, KS_END );
+    state.anonTypes = newSectionTypes( arena, 0 );
+
+    int result = -ENOMEM;
+    if ( state.parsed != NULL && state.packages != NULL && state.anonTypes != NULL
+      && copyString( &state.package, package, strlen( package ) ) != NULL )
+    {
+        /* count the anonymous sections of each type, then convert the statements into keys */
+        result = parseUCIText( package, text, length, countAnonSection, &state );
+        if ( result == 0 )
+        {
+            result = initKeyPath( keyPath, kConfigRoot );
+        }
+        if ( result == 0 )
+        {
+            result = importPackageStatement( &state, package, strlen( package ) );
+        }
+        if ( result == 0 )
+        {
+            result = parseUCIText( package, text, length, importStatement, &state );
+        }
+    }
+
+    if ( result == 0 )
+    {
+        ksAppend( imported, state.parsed );
+        ksAppend( packages, state.packages );
+    }
+
+    if ( state.parsed != NULL ) ksDel( state.parsed );
+    if ( state.packages != NULL ) ksDel( state.packages );
+    free( state.package.data );
+    free( state.string.data );
+    free( state.typeKey.data );
+    return result;
+}
+
+/**
+ * @brief start collecting packages to be committed together
+ * @param arena  all the temporaries of the conversion come from here
+ * @return the import, or NULL on failure
+ */
+tUCIImport * newUCIImport( tArena * arena )
+{
+    tUCIImport * import = arenaCalloc( arena, sizeof( tUCIImport ) );
+    if ( import == NULL )
+    {
+        return NULL;
+    }
+    import->arena = arena;
+
+#ifdef UCIFS_LIBUCI_PARSER
+    import->ctx = uci_alloc_context();
+    if ( import->ctx == NULL )
+    {
+        logError( "unable to allocate a uci context" );
+        return NULL;
+    }
+#else
+    import->imported = ksNew( 0, KS_END );
+    import->packages = ksNew( 0, KS_END );
+    if ( import->imported == NULL || import->packages == NULL )
+    {
+        freeUCIImport( import );
+        return NULL;
+    }
+#endif
+    return import;
+}
+
+/**
+ * @brief
+ * @param import
+ */
+void freeUCIImport( tUCIImport * import )
+{
+    if ( import != NULL )
+    {
+#ifdef UCIFS_LIBUCI_PARSER
+        uci_free_context( import->ctx );
+#else
+        if ( import->imported != NULL ) ksDel( import->imported );
+        if ( import->packages != NULL ) ksDel( import->packages );
+        freeKeyPath( &import->keyPath );
+#endif
+        /* the import itself belongs to the arena */
+    }
+}
+
+/**
+ * @brief parse the text of a package, adding it to the import. The text is parsed in place,
+ * so the caller must keep it unchanged until this returns. If it has a syntax error,
+ * nothing in the text is imported, and the package is left as it is in the backend.
+ * @param import
+ * @param package  the package's name, e.g. 'network'
+ * @param text     need not be nul-terminated
+ * @param length
+ * @return 0, -EINVAL if the text isn't valid UCI, or -ENOMEM
+ */
+int importUCIText( tUCIImport * import, const char * package, const char * text, size_t length )
+{
+#ifdef UCIFS_LIBUCI_PARSER
+    /* use libuci to parse the contents into UCI structures */
+    struct uci_package * packageElement = NULL;
+    FILE * contentStream = fmemopen( (void *)text, length, "r" );
+
+    int result = 0;
+    if ( contentStream == NULL || uci_import( import->ctx, contentStream, package, &packageElement, false ) != 0 )
+    {
+        char * errStr;
+        uci_get_errorstr( import->ctx, &errStr, "" );
+        logError( " problem importing %s: %s", package, errStr );
+        result = -EINVAL;
+    }
+    if ( contentStream != NULL )
+    {
+        fclose( contentStream );
+    }
+    return result;
+#else
+    int result = parseUCIPackage( import->arena, &import->keyPath, package, text, length,
+                                  import->imported, import->packages );
+    if ( result != 0 )
+    {
+        logError( " problem importing %s (%d), it was not committed", package, result );
+    }
+    return result;
+#endif
+}
+
+/**
+ * @brief mirror the imported packages into libelektra, all of them with a single kdbSet
+ * @param session
+ * @param import
+ */
+void commitUCIImport( tElektraSession * session, tUCIImport * import )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return;
+    }
+
+#ifdef UCIFS_LIBUCI_PARSER
+    uci2elektra( session, import->ctx, import->arena );
+#else
+    pthread_mutex_lock( &session->lock );
+
+    if ( fetchKeys( session, session->root ) == 0 )
+    {
+        commitImported( session, import->imported, import->packages );
+    }
+
+    pthread_mutex_unlock( &session->lock );
+#endif
+}
+
+
+#ifdef UCIFS_LIBUCI_PARSER
+/**
+ * @brief convert the text of a package into keys with the given parser
+ * @param parser
+ * @param arena
+ * @param keyPath   scratch for building the key names
+ * @param package   the package's name, e.g. 'network'
+ * @param text
+ * @param length
+ * @param keys      the keys are added to this
+ * @return 0, -EINVAL if the text isn't valid UCI, or -ENOMEM
+ */
+static int parseWith( eUCIParser parser, tArena * arena, tKeyPath * keyPath, const char * package,
+                      const char * text, size_t length, KeySet * keys )
+{
+    KeySet * packages = ksNew( 0, KS_END );
+    if ( packages == NULL )
+    {
+        return -ENOMEM;
+    }
+
+    int result;
+    if ( parser == kUCIParserBuiltIn )
+    {
+        result = parseUCIPackage( arena, keyPath, package, text, length, keys, packages );
+    }
+    else
+    {
+        /* a context of its own, so the same package can be parsed again */
+        struct uci_context * ctx = uci_alloc_context();
+        FILE * contentStream = fmemopen( (void *)text, length, "r" );
+        struct uci_package * packageElement = NULL;
+
+        if ( ctx == NULL || contentStream == NULL )
+        {
+            result = -ENOMEM;
+        }
+        else if ( uci_import( ctx, contentStream, package, &packageElement, false ) != 0 )
+        {
+            result = -EINVAL;
+        }
+        else
+        {
+            result = convertUCIPackages( ctx, keyPath, arena, keys, packages );
+        }
+
+        if ( contentStream != NULL ) fclose( contentStream );
+        if ( ctx != NULL ) uci_free_context( ctx );
+    }
+
+    ksDel( packages );
+    return result;
+}
+
+/**
+ * @brief convert a package into keys with the given parser, and throw them away again.
+ * For timing the parsers against each other, see parseBench.c
+ * @param arena
+ * @param parser
+ * @param package   the package's name, e.g. 'network'
+ * @param text      need not be nul-terminated
+ * @param length
+ * @return the number of keys, or a negative errno
+ */
+long parseUCIPackageWith( tArena * arena, eUCIParser parser, const char * package,
+                          const char * text, size_t length )
+{
+    tKeyPath keyPath = { { NULL, 0, 0 }, 0, { 0 } };
+    KeySet * keys = ksNew( 0, KS_END );
+    if ( keys == NULL )
+    {
+        return -ENOMEM;
+    }
+
+    long result = parseWith( parser, arena, &keyPath, package, text, length, keys );
+    if ( result == 0 )
+    {
+        result = ksGetSize( keys );
+    }
+
+    ksDel( keys );
+    freeKeyPath( &keyPath );
+    return result;
+}
+
+/**
+ * @brief convert a package into keys with both parsers, and report every key that
+ * one has and the other doesn't, or where their values or metadata differ
+ * @param arena
+ * @param package   the package's name, e.g. 'network'
+ * @param text      need not be nul-terminated
+ * @param length
+ * @param report    a line is appended for each difference
+ * @return the number of keys that differ, or a negative errno if either parser failed
+ */
+long compareUCIParsers( tArena * arena, const char * package, const char * text, size_t length,
+                        tBuffer * report )
+{
+    tKeyPath keyPath = { { NULL, 0, 0 }, 0, { 0 } };
+    KeySet * builtIn = ksNew( 0, KS_END );
+    KeySet * libuci  = ksNew( 0, KS_END );
+
+    long result = -ENOMEM;
+    if ( builtIn != NULL && libuci != NULL )
+    {
+        int builtInResult = parseWith( kUCIParserBuiltIn, arena, &keyPath, package, text, length, builtIn );
+        int libuciResult  = parseWith( kUCIParserLibUCI,  arena, &keyPath, package, text, length, libuci );
+
+        if ( builtInResult == -ENOMEM || libuciResult == -ENOMEM )
+        {
+            result = -ENOMEM;
+        }
+        else if ( builtInResult != libuciResult )
+        {
+            /* one of them rejected the text. Whatever keys the other made don't matter */
+            const char * what = ( builtInResult == 0 ) ? "only the built-in parser accepts the text\n"
+                                                       : "only libuci accepts the text\n";
+            result = ( appendToBuffer( report, what, strlen( what ) ) == 0 ) ? 1 : -ENOMEM;
+            ksClear( builtIn );
+            ksClear( libuci );
+        }
+        else
+        {
+            /* both accepted it, or both rejected it */
+            result = 0;
+        }
+    }
+
+    /* both KeySets are sorted, so a single merge pass finds every difference */
+    elektraCursor a = 0;
+    elektraCursor b = 0;
+    while ( result >= 0 && ( a < ksGetSize( builtIn ) || b < ksGetSize( libuci ) ) )
+    {
+        Key * ka = ( a < ksGetSize( builtIn ) ) ? ksAtCursor( builtIn, a ) : NULL;
+        Key * kb = ( b < ksGetSize( libuci )  ) ? ksAtCursor( libuci,  b ) : NULL;
+
+        int cmp = ( ka == NULL ) ? 1 : ( kb == NULL ) ? -1 : keyCmp( ka, kb );
+        const char * what = NULL;
+        if ( cmp < 0 )
+        {
+            what = "only the built-in parser has ";
+            ++a;
+        }
+        else if ( cmp > 0 )
+        {
+            what = "only libuci has ";
+            ka = kb;
+            ++b;
+        }
+        else
+        {
+            if ( keysDiffer( ka, kb ) )
+            {
+                what = "the parsers disagree on ";
+            }
+            ++a;
+            ++b;
+        }
+
+        if ( what != NULL )
+        {
+            ++result;
+            if ( appendToBuffer( report, what, strlen( what ) ) != 0
+              || appendToBuffer( report, keyName( ka ), strlen( keyName( ka ) ) ) != 0
+              || appendToBuffer( report, "\n", 1 ) != 0 )
+            {
+                result = -ENOMEM;
+            }
+        }
+    }
+
+    if ( builtIn != NULL ) ksDel( builtIn );
+    if ( libuci  != NULL ) ksDel( libuci );
+    freeKeyPath( &keyPath );
+    return result;
+}
+#endif
+
+/********************************/
+
+/**
+ * @brief UCI limits the names of packages, sections and options to these characters,
+ * so a name that passes can be used as a key's base name without escaping
+ * @param name
+ * @return
+ */
+static tBool isValidUCIName( const char * name )
+{
+    if ( *name == '\0' )
+    {
+        return no;
+    }
+    for ( const char * p = name; *p != '\0'; ++p )
+    {
+        if ( !isalnum( (unsigned char)*p ) && *p != '_' && *p != '-' )
+        {
+            return no;
+        }
+    }
+    return yes;
+}
+
+/**
+ * @brief parse a uci-style reference to an anonymous section, e.g. '@rule[2]' or '@rule[-1]'
+ * @param name
+ * @param type      set to the section type
+ * @param typeSize
+ * @param index     set to the index, a negative index counts back from the last
+ * @return yes if name is such a reference
+ */
+static tBool parseSectionAlias( const char * name, char * type, size_t typeSize, int * index )
+{
+    const char * open = strchr( name, '[' );
+    if ( name[0] != '@' || open == NULL )
+    {
+        return no;
+    }
+    size_t typeLen = open - &name[1];
+    if ( typeLen == 0 || typeLen >= typeSize )
+    {
+        return no;
+    }
+
+    char * end;
+    long value = strtol( open + 1, &end, 10 );
+    if ( end == open + 1 || end[0] != ']' || end[1] != '\0' || value < INT_MIN || value > INT_MAX )
+    {
+        return no;
+    }
+
+    memcpy( type, &name[1], typeLen );
+    type[typeLen] = '\0';
+    *index = (int)value;
+    return isValidUCIName( type );
+}
+
+/**
+ * @brief the package a key belongs to, e.g. system:/config/network for system:/config/network/lan/ipaddr.
+ * The package is the unit that's fetched from and committed to the backend.
+ * @param keyName
+ * @return a new key, or NULL if keyName isn't below the config root
+ */
+static Key * newPackageKey( const char * keyName )
+{
+    const size_t prefixLen = sizeof( kConfigRoot ) - 1;
+    if ( strncmp( keyName, kConfigRoot, prefixLen ) != 0 || keyName[prefixLen] != '/' )
+    {
+        return NULL;
+    }
+
+    char * name = strndup( keyName, prefixLen + 1 + strcspn( &keyName[prefixLen + 1], "/" ) );
+    Key * key = ( name != NULL ) ? keyNew( name, KEY_END ) : NULL;
+    free( name );
+    return key;
+}
+
+/**
+ * @brief if key is an anonymous section, the type it was declared with. See importPackage()
+ * for the two ways an anonymous section is stored.
+ * @param package
+ * @param key must be below package
+ * @return the section type, or NULL if key isn't an anonymous section
+ */
+static const char * getAnonSectionType( const Key * package, const Key * key )
+{
+    const char * type = getMetaString( key, "type" );
+    if ( type != NULL )
+    {
+        int depth = getDepthBelow( package, key );
+        if ( depth == 1 && getMetaString( key, "anonymous" ) != NULL )
+        {
+            return type;    // the only section of its type
+        }
+        if ( depth == 2 && keyBaseName( key )[0] == '#' )
+        {
+            return type;    // one of several, numbered in the order they were written
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief find the index'th anonymous section of a type, as uci counts them
+ * @param keySet
+ * @param package
+ * @param type
+ * @param index a negative index counts back from the last
+ * @return the section's key, or NULL if there isn't one
+ */
+static const Key * findAnonSection( KeySet * keySet, const Key * package, const char * type, int index )
+{
+    elektraCursor end;
+    elektraCursor start = ksFindHierarchy( keySet, package, &end );
+    if ( start < 0 )
+    {
+        return NULL;
+    }
+
+    if ( index < 0 )
+    {
+        for ( elektraCursor it = start; it < end; ++it )
+        {
+            const char * anonType = getAnonSectionType( package, ksAtCursor( keySet, it ) );
+            if ( anonType != NULL && strcmp( anonType, type ) == 0 )
+            {
+                ++index;
+            }
+        }
+    }
+
+    /* the #NNN keys sort in numeric order, so the KeySet order is the uci order */
+    for ( elektraCursor it = start; index >= 0 && it < end; ++it )
+    {
+        const Key * key = ksAtCursor( keySet, it );
+        const char * anonType = getAnonSectionType( package, key );
+        if ( anonType != NULL && strcmp( anonType, type ) == 0 && index-- == 0 )
+        {
+            return key;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief commit the keys of one package, after a single option in it has changed
+ * @param session the caller holds its lock
+ * @param package
+ * @return 0 on success, or -EIO
+ */
+static int commitSinglePackage( tElektraSession * session, Key * package )
+{
+    countStat( kStatElektraSets, 1 );
+    if ( kdbSet( session->kdb, session->keySet, package ) < 0 )
+    {
+        logError( "unable to commit \'%s\' to libelektra", keyName( package ) );
+        /* the KeySet no longer matches the backend, start afresh */
+        reopenElektraSession( session );
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief find the key a name refers to in the package/section/option hierarchy, fetching
+ * only the package it's in. Below a package, name is either a named section or a uci-style
+ * '@type[index]' reference to an anonymous one. Below a section, it's an option or a list.
+ * @param session
+ * @param parent     the key name of the directory that contains name, or NULL for the root
+ * @param parentKind
+ * @param name
+ * @param resolved   set to the key name that was found
+ * @param kind       set to what the key is
+ * @return 0 on success, -ENOENT if there's no such key, or another negative errno
+ */
+int resolveUCIKey( tElektraSession * session, const char * parent, eUCIKeyKind parentKind,
+                   const char * name, tBuffer * resolved, eUCIKeyKind * kind )
+{
+    char  type[ NAME_MAX + 1 ];
+    int   index = 0;
+    tBool isAlias = ( parentKind == kUCIPackage && parseSectionAlias( name, type, sizeof( type ), &index ) );
+
+    *kind = kUCIMissing;
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+    if ( !isAlias && !isValidUCIName( name ) )
+    {
+        return -ENOENT;
+    }
+
+    Key * key = keyNew( ( parent != NULL ) ? parent : kConfigRoot, KEY_END );
+    if ( !isAlias )
+    {
+        keyAddBaseName( key, name );
+    }
+    Key * package = newPackageKey( keyName( key ) );
+    if ( package == NULL )
+    {
+        keyDel( key );
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        KeySet *    keySet = session->keySet;
+        const Key * found  = NULL;
+        eUCIKeyKind foundKind = kUCIMissing;
+
+        switch ( parentKind )
+        {
+        case kUCIMissing:
+            {
+                /* a package only exists as the keys below it */
+                elektraCursor end;
+                elektraCursor it = ksFindHierarchy( keySet, key, &end );
+                if ( it >= 0 && it < end )
+                {
+                    found = key;
+                    foundKind = kUCIPackage;
+                }
+            }
+            break;
+
+        case kUCIPackage:
+            if ( isAlias )
+            {
+                found = findAnonSection( keySet, key, type, index );
+            }
+            else
+            {
+                /* a named section. Anonymous ones are only reachable through an alias,
+                 * as their key names are an artifact of how they're stored */
+                found = ksLookup( keySet, key, KDB_O_NONE );
+                if ( found != NULL && ( getMetaString( found, "type" ) == NULL
+                                     || getMetaString( found, "anonymous" ) != NULL ) )
+                {
+                    found = NULL;
+                }
+            }
+            foundKind = kUCISection;
+            break;
+
+        case kUCISection:
+            found = ksLookup( keySet, key, KDB_O_NONE );
+            if ( found != NULL )
+            {
+                foundKind = isListKey( found ) ? kUCIList : kUCIOption;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        result = -ENOENT;
+        if ( found != NULL )
+        {
+            resolved->length = 0;
+            result = appendToBuffer( resolved, keyName( found ), keyGetNameSize( found ) );
+            if ( result == 0 )
+            {
+                resolved->length--;  // keep the terminating null out of the length
+                *kind = foundKind;
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( package );
+    keyDel( key );
+
+    return result;
+}
+
+/**
+ * @brief list the sections in a package, or the options in a section. Anonymous sections
+ * are listed as the '@type[index]' references resolveUCIKey() understands.
+ * @param session
+ * @param parentName
+ * @param kind      kUCIPackage or kUCISection
+ * @param visitor   called for each, a non-zero return stops the listing
+ * @param context   passed to the visitor
+ * @return 0 on success, the visitor's non-zero return, or a negative errno
+ */
+int listUCIKey( tElektraSession * session, const char * parentName, eUCIKeyKind kind,
+                tUCIKeyVisitor visitor, void * context )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+    if ( kind != kUCIPackage && kind != kUCISection )
+    {
+        return -ENOTDIR;
+    }
+
+    Key * parent  = keyNew( parentName, KEY_END );
+    Key * package = newPackageKey( parentName );
+    if ( package == NULL )
+    {
+        keyDel( parent );
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        KeySet *     keySet   = session->keySet;
+        const char * lastType = NULL;
+        int          counter  = 0;
+        char         alias[ NAME_MAX + 1 ];
+
+        elektraCursor end;
+        elektraCursor it = ksFindHierarchy( keySet, parent, &end );
+        for ( ; result == 0 && it >= 0 && it < end; ++it )
+        {
+            const Key * key = ksAtCursor( keySet, it );
+
+            if ( kind == kUCISection )
+            {
+                if ( keyIsDirectlyBelow( parent, key ) == 1 )
+                {
+                    result = visitor( keyBaseName( key ), keyName( key ),
+                                      isListKey( key ) ? kUCIList : kUCIOption, context );
+                }
+                continue;
+            }
+
+            const char * type = getAnonSectionType( parent, key );
+            if ( type != NULL )
+            {
+                /* all the anonymous sections of a type are adjacent, see findAnonSection() */
+                if ( lastType == NULL || strcmp( lastType, type ) != 0 )
+                {
+                    counter = 0;
+                }
+                lastType = type;
+                snprintf( alias, sizeof( alias ), "@%s[%d]", type, counter++ );
+                result = visitor( alias, keyName( key ), kUCISection, context );
+            }
+            else if ( keyIsDirectlyBelow( parent, key ) == 1 && getMetaString( key, "type" ) != NULL )
+            {
+                result = visitor( keyBaseName( key ), keyName( key ), kUCISection, context );
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( package );
+    keyDel( parent );
+
+    return result;
+}
+
+/**
+ * @brief the value of a single option as text, fetching only the package it's in.
+ * An option is rendered as its value followed by a newline, a list as one item per line.
+ * @param session
+ * @param optionName
+ * @param output    appended to
+ * @return 0 on success, or a negative errno
+ */
+int getUCIValue( tElektraSession * session, const char * optionName, tBuffer * output )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+
+    Key * package = newPackageKey( optionName );
+    if ( package == NULL )
+    {
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        Key * key = ksLookupByName( session->keySet, optionName, KDB_O_NONE );
+        char  scratch[32];
+
+        result = reserveBuffer( output, 256 );
+        if ( key == NULL )
+        {
+            result = -ENOENT;
+        }
+        else if ( isListKey( key ) )
+        {
+            elektraCursor end;
+            elektraCursor it = ksFindHierarchy( session->keySet, key, &end );
+            for ( ; result == 0 && it >= 0 && it < end; ++it )
+            {
+                const Key * item = ksAtCursor( session->keySet, it );
+                if ( keyIsDirectlyBelow( key, item ) == 1 )
+                {
+                    const char * value = getValueAsString( item, scratch, sizeof( scratch ) );
+                    result = appendToBuffer( output, value, strlen( value ) );
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, "\n", 1 );
+                    }
+                }
+            }
+        }
+        else if ( result == 0 )
+        {
+            const char * value = getValueAsString( key, scratch, sizeof( scratch ) );
+            result = appendToBuffer( output, value, strlen( value ) );
+            if ( result == 0 )
+            {
+                result = appendToBuffer( output, "\n", 1 );
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( package );
+
+    return result;
+}
+
+/**
+ * @brief set a single option, and commit just the package it's in. The text is parsed as
+ * getUCIValue() renders it: if the key is a list, each line becomes an item, otherwise the
+ * text (less one trailing newline) becomes the value. A key that doesn't exist yet is created
+ * as an option.
+ * @param session
+ * @param optionName
+ * @param value
+ * @param length
+ * @return 0 on success, or a negative errno
+ */
+int setUCIValue( tElektraSession * session, const char * optionName, const char * value, size_t length )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+
+    if ( length > 0 && value[length - 1] == '\n' )
+    {
+        --length;
+    }
+    char * text    = strndup( value, length );
+    Key *  package = newPackageKey( optionName );
+    if ( text == NULL || package == NULL )
+    {
+        free( text );
+        keyDel( package );
+        return ( text == NULL ) ? -ENOMEM : -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        KeySet * keySet   = session->keySet;
+        Key *    existing = ksLookupByName( keySet, optionName, KDB_O_NONE );
+
+        if ( existing != NULL && isListKey( existing ) )
+        {
+            /* replace the whole list, the items are renumbered from zero */
+            Key * list = keyNew( optionName, KEY_END );
+            ksDel( ksCut( keySet, list ) );
+            keyDel( list );
+            createList( keySet, optionName );
+
+            tKeyPath itemPath  = { 0 };
+            char     index[16] = "";
+            int      count     = 0;
+            result = initKeyPath( &itemPath, optionName );
+            char * next = ( length > 0 ) ? text : NULL;
+            for ( char * item; result == 0 && (item = strsep( &next, "\n" )) != NULL; )
+            {
+                formatIndex( index, sizeof( index ), count++ );
+                result = pushKeyPath( &itemPath, index );
+                if ( result == 0 )
+                {
+                    setKey( keySet, keyPathName( &itemPath ), item );
+                    popKeyPath( &itemPath );
+                }
+            }
+            freeKeyPath( &itemPath );
+            setMetadata( keySet, optionName, "array", index );
+        }
+        else
+        {
+            setKey( keySet, optionName, text );
+        }
+
+        if ( result == 0 )
+        {
+            result = commitSinglePackage( session, package );
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( package );
+    free( text );
+
+    return result;
+}
+
+/**
+ * @brief add an empty option to a section, and commit the package it's in
+ * @param session
+ * @param section   the section's key name
+ * @param name
+ * @param created   set to the new option's key name
+ * @return 0 on success, -EEXIST if the section already has that option, or another negative errno
+ */
+int createUCIOption( tElektraSession * session, const char * section, const char * name, tBuffer * created )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+    if ( !isValidUCIName( name ) )
+    {
+        return -EINVAL;
+    }
+
+    Key * key     = keyNew( section, KEY_END );
+    keyAddBaseName( key, name );
+    Key * package = newPackageKey( section );
+    if ( package == NULL )
+    {
+        keyDel( key );
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        if ( ksLookupByName( session->keySet, section, KDB_O_NONE ) == NULL )
+        {
+            result = -ENOENT;
+        }
+        else if ( ksLookup( session->keySet, key, KDB_O_NONE ) != NULL )
+        {
+            result = -EEXIST;
+        }
+        else
+        {
+            setKey( session->keySet, keyName( key ), "" );
+            result = commitSinglePackage( session, package );
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    if ( result == 0 )
+    {
+        created->length = 0;
+        result = appendToBuffer( created, keyName( key ), keyGetNameSize( key ) );
+        if ( result == 0 )
+        {
+            created->length--;  // keep the terminating null out of the length
+        }
+    }
+
+    keyDel( package );
+    keyDel( key );
+
+    return result;
+}
+
+/**
+ * @brief the 'type' metadata of an option, as classifyValue() and createList() set it
+ * @param session
+ * @param optionName
+ * @param output    appended to
+ * @return 0 on success, -ENODATA if the key has no type, or another negative errno
+ */
+int getUCIType( tElektraSession * session, const char * optionName, tBuffer * output )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+
+    Key * package = newPackageKey( optionName );
+    if ( package == NULL )
+    {
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, package );
+    if ( result == 0 )
+    {
+        Key * key = ksLookupByName( session->keySet, optionName, KDB_O_NONE );
+        const char * type = ( key != NULL ) ? getMetaString( key, "type" ) : NULL;
+        if ( key == NULL )
+        {
+            result = -ENOENT;
+        }
+        else if ( type == NULL )
+        {
+            result = -ENODATA;
+        }
+        else
+        {
+            result = appendToBuffer( output, type, strlen( type ) );
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( package );
+
+    return result;
+}
+
+/**
+ * @brief the 'type' metadata of every option in a package, one per line, named the way
+ * 'uci show' names them, e.g. "network.lan.ipaddr=ipv4addr" or "firewall.@rule[0].src=string"
+ * @param session
+ * @param package   the package name, e.g. "network"
+ * @param output    appended to
+ * @return 0 on success, or a negative errno
+ */
+int getUCITypes( tElektraSession * session, const char * package, tBuffer * output )
+{
+    if ( session == NULL )
+    {
+        logError( "no libelektra session" );
+        return -EIO;
+    }
+
+    Key * parent = keyNew( kConfigRoot, KEY_END );
+    keyAddBaseName( parent, package );
+
+    pthread_mutex_lock( &session->lock );
+
+    int result = fetchKeys( session, parent );
+    if ( result == 0 )
+    {
+        KeySet *     keySet   = session->keySet;
+        const Key *  section  = NULL;
+        const char * lastType = NULL;
+        int          counter  = 0;
+        char         sectionName[ NAME_MAX + 1 ];
+
+        elektraCursor end;
+        elektraCursor it = ksFindHierarchy( keySet, parent, &end );
+        for ( ; result == 0 && it >= 0 && it < end; ++it )
+        {
+            const Key *  key      = ksAtCursor( keySet, it );
+            const char * anonType = getAnonSectionType( parent, key );
+
+            if ( anonType != NULL )
+            {
+                /* numbered just as listUCIKey() does */
+                if ( lastType == NULL || strcmp( lastType, anonType ) != 0 )
+                {
+                    counter = 0;
+                }
+                lastType = anonType;
+                snprintf( sectionName, sizeof( sectionName ), "@%s[%d]", anonType, counter++ );
+                section = key;
+            }
+            else if ( keyIsDirectlyBelow( parent, key ) == 1 )
+            {
+                section = NULL;
+                if ( getMetaString( key, "type" ) != NULL )
+                {
+                    snprintf( sectionName, sizeof( sectionName ), "%s", keyBaseName( key ) );
+                    section = key;
+                }
+            }
+            else if ( section != NULL && keyIsDirectlyBelow( section, key ) == 1 )
+            {
+                const char * type = getMetaString( key, "type" );
+                if ( type != NULL )
+                {
+                    const char * name = keyBaseName( key );
+                    result = appendToBuffer( output, package, strlen( package ) );
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, ".", 1 );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, sectionName, strlen( sectionName ) );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, ".", 1 );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, name, strlen( name ) );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, "=", 1 );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, type, strlen( type ) );
+                    }
+                    if ( result == 0 )
+                    {
+                        result = appendToBuffer( output, "\n", 1 );
+                    }
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &session->lock );
+
+    keyDel( parent );
+
+    return result;
+}
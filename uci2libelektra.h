@@ -5,9 +5,61 @@
 #ifndef UCIFS_UCI2LIBELEKTRA_H
 #define UCIFS_UCI2LIBELEKTRA_H
 
-#include <uci.h>
+#include <stddef.h>
 
-void uci2elektra( const struct uci_context * ctx );
-const char *  iterateUCIfiles( int i );
+#include "utils.h"
+#include "arena.h"
+
+/* the root of the UCI packages in libelektra's namespace */
+#define kUCIConfigRoot  "system:/config"
+
+typedef struct sElektraSession tElektraSession;
+typedef struct sUCIImport      tUCIImport;
+
+/* what a key is in the package/section/option hierarchy */
+typedef enum {
+    kUCIMissing = 0,
+    kUCIPackage,
+    kUCISection,
+    kUCIOption,
+    kUCIList
+} eUCIKeyKind;
+
+/* called for each section in a package, or each option in a section */
+typedef int (*tUCIKeyVisitor)( const char * name, const char * keyName, eUCIKeyKind kind, void * context );
+
+tElektraSession * openElektraSession( void );
+void              closeElektraSession( tElektraSession * session );
+
+tUCIImport * newUCIImport(    tArena * arena );
+int          importUCIText(   tUCIImport * import, const char * package, const char * text, size_t length );
+void         commitUCIImport( tElektraSession * session, tUCIImport * import );
+void         freeUCIImport(   tUCIImport * import );
+
+#ifdef UCIFS_LIBUCI_PARSER
+/* for comparing the built-in parser with libuci's, see parseBench.c */
+typedef enum {
+    kUCIParserBuiltIn,
+    kUCIParserLibUCI
+} eUCIParser;
+
+long parseUCIPackageWith( tArena * arena, eUCIParser parser, const char * package,
+                          const char * text, size_t length );
+long compareUCIParsers(   tArena * arena, const char * package, const char * text, size_t length,
+                          tBuffer * report );
+#endif
+
+int  elektra2uci( tElektraSession * session, const char * package, tBuffer * output );
+const char *  iterateUCIfiles( tElektraSession * session, int i );
+
+int  resolveUCIKey(   tElektraSession * session, const char * parent, eUCIKeyKind parentKind,
+                      const char * name, tBuffer * resolved, eUCIKeyKind * kind );
+int  listUCIKey(      tElektraSession * session, const char * parentName, eUCIKeyKind kind,
+                      tUCIKeyVisitor visitor, void * context );
+int  getUCIValue(     tElektraSession * session, const char * optionName, tBuffer * output );
+int  setUCIValue(     tElektraSession * session, const char * optionName, const char * value, size_t length );
+int  createUCIOption( tElektraSession * session, const char * section, const char * name, tBuffer * created );
+int  getUCIType(      tElektraSession * session, const char * optionName, tBuffer * output );
+int  getUCITypes(     tElektraSession * session, const char * package, tBuffer * output );
 
 #endif //UCIFS_UCI2LIBELEKTRA_H
@@ -0,0 +1,456 @@
+//
+// A streaming tokenizer for the UCI file syntax, so a written package can be converted straight
+// from the file's contents, rather than via stdio and libuci's package tree. It follows the rules
+// libuci's own parser applies (see uci/file.c):
+//  - statements are 'package', 'config', 'option' and 'list', or just their first letter
+//  - a statement ends at the end of the line, or at an unquoted ';'
+//  - an unquoted '#' comments out the rest of the line
+//  - single quotes have no escapes, while a backslash in double quotes or an unquoted word takes
+//    the next character literally. A backslash at the end of a line joins it to the next
+//  - quoted strings may span lines, and adjacent quoted and unquoted parts form a single argument
+//  - names are letters, digits and '_' (plus '-' for package names), types any printable ASCII
+// Tokens are handed over as slices of the text wherever possible, so the common case of an
+// unquoted or simply-quoted word involves no copying at all.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "logStuff.h"
+#include "utils.h"
+#include "uciParser.h"
+
+typedef struct {
+    const char *    name;           // the package being parsed, for error messages
+    const char *    text;
+    const char *    pos;
+    const char *    end;
+    const char *    counted;        // newlines before this have been counted into line
+    unsigned int    line;
+    tBool           endOfStatement; // set once a ';' has been consumed
+    tBuffer         scratch[3];     // one per argument, for tokens that had quotes or escapes removed
+} tParser;
+
+static const struct {
+    const char *    word;
+    size_t          length;
+    eUCIStatement   kind;
+    int             argCount;
+} kKeywords[] = {
+    { "package", 7, kUCIStatementPackage, 1 },
+    { "config",  6, kUCIStatementConfig,  2 },
+    { "option",  6, kUCIStatementOption,  2 },
+    { "list",    4, kUCIStatementList,    2 }
+};
+
+/**
+ * @brief the line number of where. Only ever moves forwards, so the text is scanned just once
+ * @param parser
+ * @param where
+ * @return
+ */
+static unsigned int lineOf( tParser * parser, const char * where )
+{
+    const char * p = parser->counted;
+    while ( p < where && ( p = memchr( p, '\n', where - p ) ) != NULL )
+    {
+        ++parser->line;
+        ++p;
+    }
+    parser->counted = where;
+    return parser->line;
+}
+
+/**
+ * @brief report a syntax error at where
+ * @param parser
+ * @param where
+ * @param message
+ * @return -EINVAL
+ */
+static int parseError( tParser * parser, const char * where, const char * message )
+{
+    logError( "%s, line %u: %s", parser->name, lineOf( parser, where ), message );
+    return -EINVAL;
+}
+
+/**
+ * @brief whitespace that doesn't end a statement
+ * @param c
+ * @return
+ */
+static tBool isBlank( char c )
+{
+    return ( c != '\n' && isspace( (unsigned char)c ) );
+}
+
+/**
+ * @brief add a piece to the token being built. While the pieces are contiguous in the text,
+ * the token stays a slice of it. Otherwise it's moved to the scratch buffer.
+ * @param scratch
+ * @param token
+ * @param copied   set once the token has been moved to scratch
+ * @param data
+ * @param length
+ * @return 0, or -ENOMEM
+ */
+static int appendPiece( tBuffer * scratch, tSlice * token, tBool * copied, const char * data, size_t length )
+{
+    if ( !*copied )
+    {
+        if ( token->length == 0 )
+        {
+            token->data   = data;
+            token->length = length;
+            return 0;
+        }
+        if ( token->data + token->length == data )
+        {
+            token->length += length;
+            return 0;
+        }
+        scratch->length = 0;
+        if ( appendToBuffer( scratch, token->data, token->length ) != 0 )
+        {
+            return -ENOMEM;
+        }
+        *copied = yes;
+    }
+    return appendToBuffer( scratch, data, length );
+}
+
+/**
+ * @brief take the character following a backslash literally. A backslash at the end of a
+ * line joins it to the next one instead, and one at the very end of the text is dropped.
+ * @param parser  positioned at the backslash. Left just past what it escaped
+ * @param scratch
+ * @param token
+ * @param copied
+ * @return 0, or -ENOMEM
+ */
+static int parseBackslash( tParser * parser, tBuffer * scratch, tSlice * token, tBool * copied )
+{
+    const char * p = parser->pos + 1;
+    if ( p >= parser->end )
+    {
+        parser->pos = p;
+        return 0;
+    }
+    if ( *p == '\n' || ( *p == '\r' && p + 1 < parser->end && p[1] == '\n' ) )
+    {
+        parser->pos = p + ( *p == '\r' ? 2 : 1 );
+        return 0;
+    }
+    parser->pos = p + 1;
+    return appendPiece( scratch, token, copied, p, 1 );
+}
+
+/**
+ * @brief extract the next argument of the current statement
+ * @param parser
+ * @param scratch  where the token is built if it can't be a slice of the text
+ * @param token    empty if the statement has no more arguments
+ * @return 0, -EINVAL on a syntax error, or -ENOMEM
+ */
+static int nextToken( tParser * parser, tBuffer * scratch, tSlice * token )
+{
+    tBool copied = no;
+    int result = 0;
+
+    while ( parser->pos < parser->end && isBlank( *parser->pos ) )
+    {
+        ++parser->pos;
+    }
+    token->data   = parser->pos;
+    token->length = 0;
+
+    while ( result == 0 && !parser->endOfStatement
+         && parser->pos < parser->end && !isspace( (unsigned char)*parser->pos ) )
+    {
+        const char * p = parser->pos;
+        switch ( *p )
+        {
+        case '\'':
+            {
+                const char * close = memchr( p + 1, '\'', parser->end - ( p + 1 ) );
+                if ( close == NULL )
+                {
+                    return parseError( parser, p, "unterminated \'" );
+                }
+                result = appendPiece( scratch, token, &copied, p + 1, close - ( p + 1 ) );
+                parser->pos = close + 1;
+            }
+            break;
+
+        case '"':
+            parser->pos = p + 1;
+            while ( result == 0 )
+            {
+                const char * run = parser->pos;
+                while ( parser->pos < parser->end && *parser->pos != '"' && *parser->pos != '\\' )
+                {
+                    ++parser->pos;
+                }
+                if ( result == 0 && parser->pos > run )
+                {
+                    result = appendPiece( scratch, token, &copied, run, parser->pos - run );
+                }
+                if ( parser->pos >= parser->end )
+                {
+                    return parseError( parser, p, "unterminated \"" );
+                }
+                if ( *parser->pos == '"' )
+                {
+                    ++parser->pos;
+                    break;
+                }
+                if ( result == 0 )
+                {
+                    result = parseBackslash( parser, scratch, token, &copied );
+                }
+            }
+            break;
+
+        case '#':
+            /* the rest of the line is a comment */
+            parser->pos = memchr( p, '\n', parser->end - p );
+            if ( parser->pos == NULL )
+            {
+                parser->pos = parser->end;
+            }
+            break;
+
+        case ';':
+            ++parser->pos;
+            parser->endOfStatement = yes;
+            break;
+
+        case '\\':
+            result = parseBackslash( parser, scratch, token, &copied );
+            break;
+
+        default:
+            while ( parser->pos < parser->end && !isspace( (unsigned char)*parser->pos )
+                 && memchr( "\'\"#;\\", *parser->pos, 5 ) == NULL )
+            {
+                ++parser->pos;
+            }
+            result = appendPiece( scratch, token, &copied, p, parser->pos - p );
+            break;
+        }
+    }
+
+    if ( copied )
+    {
+        token->data   = scratch->data;
+        token->length = scratch->length;
+    }
+    return result;
+}
+
+/**
+ * @brief
+ * @param name
+ * @param package  package names may also contain '-'
+ * @return true if name is a valid section, option or package name
+ */
+static tBool isValidName( const tSlice * name, tBool package )
+{
+    for ( size_t i = 0; i < name->length; ++i )
+    {
+        unsigned char c = name->data[i];
+        if ( !isalnum( c ) && c != '_' && !( package && c == '-' ) )
+        {
+            return no;
+        }
+    }
+    return yes;
+}
+
+/**
+ * @brief
+ * @param type
+ * @return true if type is a valid section type
+ */
+static tBool isValidType( const tSlice * type )
+{
+    for ( size_t i = 0; i < type->length; ++i )
+    {
+        unsigned char c = type->data[i];
+        if ( c < 33 || c > 126 )
+        {
+            return no;
+        }
+    }
+    return yes;
+}
+
+/**
+ * @brief check the arguments of a statement are all present and correct
+ * @param parser
+ * @param statement
+ * @param where      the start of the statement
+ * @param inSection  whether a 'config' statement has been seen in the current package
+ * @return 0, or -EINVAL
+ */
+static int checkStatement( tParser * parser, const tUCIStatement * statement, const char * where, tBool inSection )
+{
+    const tSlice * arg = statement->arg;
+
+    switch ( statement->kind )
+    {
+    case kUCIStatementPackage:
+        if ( arg[0].length == 0 )
+        {
+            return parseError( parser, where, "insufficient arguments" );
+        }
+        if ( !isValidName( &arg[0], yes ) )
+        {
+            return parseError( parser, where, "invalid character in name field" );
+        }
+        break;
+
+    case kUCIStatementConfig:
+        if ( arg[0].length == 0 )
+        {
+            return parseError( parser, where, "empty section type" );
+        }
+        if ( !isValidType( &arg[0] ) )
+        {
+            return parseError( parser, where, "invalid character in type field" );
+        }
+        if ( !isValidName( &arg[1], no ) )
+        {
+            return parseError( parser, where, "invalid character in name field" );
+        }
+        break;
+
+    case kUCIStatementOption:
+    case kUCIStatementList:
+        if ( !inSection )
+        {
+            return parseError( parser, where, "option/list command found before the first section" );
+        }
+        if ( arg[0].length == 0 )
+        {
+            return parseError( parser, where, "insufficient arguments" );
+        }
+        if ( !isValidName( &arg[0], no ) )
+        {
+            return parseError( parser, where, "invalid character in name field" );
+        }
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief parse UCI text, passing each statement to handler as it's found. Nothing is copied
+ * or allocated beyond a few scratch buffers, which are reused for every statement.
+ * @param name     the package being parsed, only used in error messages
+ * @param text     need not be nul-terminated
+ * @param length
+ * @param handler
+ * @param context  passed through to handler
+ * @return 0, -EINVAL on a syntax error, -ENOMEM, or the handler's non-zero return
+ */
+int parseUCIText( const char * name, const char * text, size_t length,
+                  tUCIStatementHandler handler, void * context )
+{
+    tParser parser;
+    memset( &parser, 0, sizeof( parser ) );
+    parser.name    = name;
+    parser.text    = text;
+    parser.pos     = text;
+    parser.end     = text + length;
+    parser.counted = text;
+    parser.line    = 1;
+
+    tBool inSection = no;
+    int result = 0;
+    while ( result == 0 )
+    {
+        /* find the start of the next statement, skipping blank lines and comments */
+        while ( parser.pos < parser.end && isspace( (unsigned char)*parser.pos ) )
+        {
+            ++parser.pos;
+        }
+        if ( parser.pos >= parser.end )
+        {
+            break;
+        }
+        if ( *parser.pos == '#' )
+        {
+            parser.pos = memchr( parser.pos, '\n', parser.end - parser.pos );
+            if ( parser.pos == NULL )
+            {
+                parser.pos = parser.end;
+            }
+            continue;
+        }
+
+        const char * start = parser.pos;
+        while ( parser.pos < parser.end && !isspace( (unsigned char)*parser.pos ) )
+        {
+            ++parser.pos;
+        }
+        size_t wordLength = parser.pos - start;
+
+        int k = sizeof( kKeywords ) / sizeof( kKeywords[0] );
+        while ( --k >= 0 )
+        {
+            if ( *start == kKeywords[k].word[0]
+              && ( wordLength == 1
+                || ( wordLength == kKeywords[k].length && memcmp( start, kKeywords[k].word, wordLength ) == 0 ) ) )
+            {
+                break;
+            }
+        }
+        if ( k < 0 )
+        {
+            result = parseError( &parser, start, "invalid command" );
+            break;
+        }
+
+        tUCIStatement statement;
+        memset( &statement, 0, sizeof( statement ) );
+        statement.kind = kKeywords[k].kind;
+        statement.line = lineOf( &parser, start );
+
+        parser.endOfStatement = no;
+        for ( int i = 0; result == 0 && i < kKeywords[k].argCount; ++i )
+        {
+            result = nextToken( &parser, &parser.scratch[i], &statement.arg[i] );
+        }
+
+        tSlice extra;
+        if ( result == 0 )
+        {
+            result = nextToken( &parser, &parser.scratch[2], &extra );
+        }
+        if ( result == 0 && extra.length > 0 )
+        {
+            result = parseError( &parser, start, "too many arguments" );
+        }
+        if ( result == 0 )
+        {
+            result = checkStatement( &parser, &statement, start, inSection );
+        }
+        if ( result == 0 )
+        {
+            /* switching package leaves the section that was being parsed behind */
+            inSection = ( statement.kind != kUCIStatementPackage );
+            result = handler( &statement, context );
+        }
+    }
+
+    for ( int i = 0; i < 3; ++i )
+    {
+        free( parser.scratch[i].data );
+    }
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef UCIFS_UCIPARSER_H
+#define UCIFS_UCIPARSER_H
+
+#include <stddef.h>
+
+/* a run of characters that is NOT nul-terminated. It points either straight into the
+ * text being parsed, or (if the token had quotes or escapes to remove) into the parser's
+ * scratch buffer, so it's only valid until the handler returns */
+typedef struct {
+    const char * data;
+    size_t       length;
+} tSlice;
+
+typedef enum {
+    kUCIStatementPackage,   // 'package <name>'
+    kUCIStatementConfig,    // 'config <type> [<name>]', the name is empty if the section is anonymous
+    kUCIStatementOption,    // 'option <name> <value>', the value is empty if the option is to be removed
+    kUCIStatementList       // 'list <name> <value>'
+} eUCIStatement;
+
+typedef struct {
+    eUCIStatement   kind;
+    tSlice          arg[2];     // the arguments, in the order they're written. Missing ones are empty
+    unsigned int    line;       // where the statement started, for error messages
+} tUCIStatement;
+
+/* called for each statement, in the order they appear. A non-zero return stops the parse */
+typedef int (*tUCIStatementHandler)( const tUCIStatement * statement, void * context );
+
+int parseUCIText( const char * name, const char * text, size_t length,
+                  tUCIStatementHandler handler, void * context );
+
+#endif //UCIFS_UCIPARSER_H
@@ -0,0 +1,556 @@
+//
+// The hierarchical view: each package is a directory of sections, and each section a directory
+// of options, e.g. /network/lan/ipaddr. Anonymous sections appear as uci's '@type[index]'.
+// An option maps onto a single libelektra key, so reading or writing one doesn't render or
+// parse the rest of its package.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logStuff.h"
+#include "utils.h"
+#include "ucifs.h"
+#include "fileHandles.h"
+#include "uci2libelektra.h"
+#include "uciTree.h"
+
+struct sTreeNode {
+    int             refCount;   // only accessed atomically
+    eUCIKeyKind     kind;
+    ino_t           ino;
+    time_t          modified;   // only accessed atomically
+    char *          keyName;    // e.g. system:/config/network/lan/ipaddr
+};
+
+/* an open option. The value is fetched once when it's opened, and written back as a
+ * whole when it's flushed, much as a package file is. */
+struct sTreeFile {
+    pthread_mutex_t lock;
+    tTreeNode *     node;       // holds a reference
+    tBuffer         contents;
+    tBool           dirty;
+};
+
+typedef struct {
+    tTreeVisitor    visitor;
+    void *          context;
+} tTreeListing;
+
+
+static tElektraSession * getSession( void )
+{
+    return getElektraSession( (tMountPoint *)getPrivateData() );
+}
+
+/**
+ * @brief a stable inode number for a key, kept clear of the root and synthetic files.
+ * Tools like tar and rsync -H take two names with the same st_ino for hard links, so this
+ * uses hashBytes() rather than hashString(), which collides far too easily for sibling keys.
+ * @param keyName
+ * @return
+ */
+static ino_t getTreeInode( const char * keyName )
+{
+    ino_t ino = hashBytes( 0, keyName, strlen( keyName ) );
+    return ( ino < kFirstPackageInode ) ? ino + kFirstPackageInode : ino;
+}
+
+static tBool isDirectoryKind( eUCIKeyKind kind )
+{
+    return ( kind == kUCIPackage || kind == kUCISection );
+}
+
+/**
+ * @brief
+ * @param keyName
+ * @param kind
+ * @param ino
+ * @return a node with one reference, or NULL
+ */
+static tTreeNode * newTreeNode( const char * keyName, eUCIKeyKind kind, ino_t ino )
+{
+    tTreeNode * node = calloc( 1, sizeof( tTreeNode ) );
+    if ( node != NULL )
+    {
+        node->keyName = strdup( keyName );
+        if ( node->keyName == NULL )
+        {
+            free( node );
+            return NULL;
+        }
+        node->refCount = 1;
+        node->kind     = kind;
+        node->ino      = ino;
+        node->modified = time( NULL );
+        logDebug( "new tree node %s (%lu)", keyName, (unsigned long)ino );
+    }
+    return node;
+}
+
+/**
+ * @brief
+ * @param node
+ * @return node
+ */
+tTreeNode * retainTreeNode( tTreeNode * node )
+{
+    if ( node != NULL )
+    {
+        __atomic_add_fetch( &node->refCount, 1, __ATOMIC_RELAXED );
+    }
+    return node;
+}
+
+/**
+ * @brief drop a reference to node, freeing it if that was the last one
+ * @param node
+ */
+void putTreeNode( tTreeNode * node )
+{
+    if ( node != NULL && __atomic_sub_fetch( &node->refCount, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        free( node->keyName );
+        free( node );
+    }
+}
+
+tBool isTreeDirectory( const tTreeNode * node )
+{
+    return ( node != NULL && isDirectoryKind( node->kind ) );
+}
+
+/**
+ * @brief find name in a directory of the hierarchical view
+ * @param parent    NULL for the root, where the packages are
+ * @param name
+ * @param node      set to a node with one reference, to be released with putTreeNode()
+ * @return 0 on success, or a negative errno
+ */
+int lookupTreeNode( tTreeNode * parent, const char * name, tTreeNode ** node )
+{
+    tBuffer     keyName = { 0 };
+    eUCIKeyKind kind    = kUCIMissing;
+    ino_t       ino     = 0;
+    int         result;
+
+    *node = NULL;
+    if ( parent == NULL )
+    {
+        /* the packages are the ones in the root table, so the listing and the inodes
+         * match the flat view. That doesn't need a trip to the backend, either */
+        char path[ NAME_MAX + 2 ];
+        if ( snprintf( path, sizeof( path ), "/%s", name ) >= (int)sizeof( path ) )
+        {
+            return -ENAMETOOLONG;
+        }
+        tFileHandle * fh = findFH( path );
+        if ( fh == NULL )
+        {
+            return -ENOENT;
+        }
+        struct stat st;
+        getFHstat( fh, &st );
+        putFH( fh );
+
+        ino  = st.st_ino;
+        kind = kUCIPackage;
+        result = appendToBuffer( &keyName, kUCIConfigRoot "/", sizeof( kUCIConfigRoot ) );
+        if ( result == 0 )
+        {
+            result = appendToBuffer( &keyName, name, strlen( name ) + 1 );
+        }
+    }
+    else if ( !isTreeDirectory( parent ) )
+    {
+        return -ENOTDIR;
+    }
+    else
+    {
+        result = resolveUCIKey( getSession(), parent->keyName, parent->kind, name, &keyName, &kind );
+    }
+
+    if ( result == 0 )
+    {
+        *node = newTreeNode( keyName.data, kind, ( ino != 0 ) ? ino : getTreeInode( keyName.data ) );
+        if ( *node == NULL )
+        {
+            result = -ENOMEM;
+        }
+    }
+    free( keyName.data );
+
+    return result;
+}
+
+/**
+ * @brief create an empty option in a section
+ * @param parent    the section
+ * @param name
+ * @param node      set to a node with one reference, to be released with putTreeNode()
+ * @return 0 on success, or a negative errno
+ */
+int createTreeNode( tTreeNode * parent, const char * name, tTreeNode ** node )
+{
+    *node = NULL;
+    if ( parent == NULL || parent->kind != kUCISection )
+    {
+        /* sections and packages don't map onto a plain file */
+        return -EPERM;
+    }
+
+    tBuffer keyName = { 0 };
+    int result = createUCIOption( getSession(), parent->keyName, name, &keyName );
+    if ( result == 0 )
+    {
+        *node = newTreeNode( keyName.data, kUCIOption, getTreeInode( keyName.data ) );
+        if ( *node == NULL )
+        {
+            result = -ENOMEM;
+        }
+    }
+    free( keyName.data );
+
+    return result;
+}
+
+/**
+ * @brief
+ * @param node
+ * @param st
+ * @return 0 on success, or a negative errno (e.g. -ENOENT if the key has since been removed)
+ */
+int getTreeNodeAttributes( tTreeNode * node, struct stat * st )
+{
+    memset( st, 0, sizeof( struct stat ) );
+    st->st_ino   = node->ino;
+    st->st_uid   = getuid();
+    st->st_gid   = getgid();
+    st->st_atime = time( NULL );
+    st->st_mtime = __atomic_load_n( &node->modified, __ATOMIC_RELAXED );
+    st->st_ctime = st->st_mtime;
+
+    if ( isTreeDirectory( node ) )
+    {
+        st->st_mode  = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    /* the size is that of the value as read() returns it */
+    tBuffer value = { 0 };
+    int result = getUCIValue( getSession(), node->keyName, &value );
+    if ( result == 0 )
+    {
+        st->st_mode  = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size  = value.length;
+    }
+    free( value.data );
+
+    return result;
+}
+
+static int visitTreeKey( const char * name, const char * keyName, eUCIKeyKind kind, void * context )
+{
+    tTreeListing * listing = context;
+    struct stat st;
+
+    memset( &st, 0, sizeof( st ) );
+    st.st_ino  = getTreeInode( keyName );
+    st.st_mode = isDirectoryKind( kind ) ? S_IFDIR : S_IFREG;
+
+    return listing->visitor( name, &st, listing->context );
+}
+
+/**
+ * @brief list the sections in a package, or the options in a section
+ * @param node
+ * @param visitor   called for each entry, a non-zero return stops the listing
+ * @param context   passed to the visitor
+ * @return 0 on success, the visitor's non-zero return, or a negative errno
+ */
+int listTreeNode( tTreeNode * node, tTreeVisitor visitor, void * context )
+{
+    tTreeListing listing = { visitor, context };
+    return listUCIKey( getSession(), node->keyName, node->kind, visitTreeKey, &listing );
+}
+
+/**
+ * @brief append an ETag of the option's value, as a read of it would see it now
+ * @param node
+ * @param etag  appended to
+ * @return 0 on success, or a negative errno
+ */
+int getTreeNodeETag( tTreeNode * node, tBuffer * etag )
+{
+    tBuffer value = { 0 };
+    int result = getUCIValue( getSession(), node->keyName, &value );
+    if ( result == 0 )
+    {
+        result = appendETag( etag, value.data, value.length );
+    }
+    free( value.data );
+
+    return result;
+}
+
+/**
+ * @brief libelektra doesn't keep a version per key, so this is the generation of the package
+ * the node is in, see getFHgeneration()
+ * @param node
+ * @param generation
+ * @return 0 on success, or -ENOENT if the package has gone
+ */
+int getTreeNodeGeneration( tTreeNode * node, unsigned long * generation )
+{
+    const char * package = &node->keyName[ sizeof( kUCIConfigRoot ) ];
+    char path[ NAME_MAX + 2 ];
+    snprintf( path, sizeof( path ), "/%.*s", (int)strcspn( package, "/" ), package );
+
+    tFileHandle * fh = findFH( path );
+    if ( fh == NULL )
+    {
+        return -ENOENT;
+    }
+    *generation = getFHgeneration( fh );
+    putFH( fh );
+
+    return 0;
+}
+
+/**
+ * @brief the libelektra 'type' metadata of an option, e.g. "ipv4addr", "long" or "list"
+ * @param node
+ * @param type  appended to
+ * @return 0 on success, or a negative errno
+ */
+int getTreeNodeType( tTreeNode * node, tBuffer * type )
+{
+    return getUCIType( getSession(), node->keyName, type );
+}
+
+/**
+ * @brief truncate, or extend with zeros, an option that isn't open
+ * @param node
+ * @param size
+ * @return 0 on success, or a negative errno
+ */
+int truncateTreeNode( tTreeNode * node, off_t size )
+{
+    if ( isTreeDirectory( node ) )
+    {
+        return -EISDIR;
+    }
+
+    tBuffer value = { 0 };
+    int result = ( size == 0 ) ? 0 : getUCIValue( getSession(), node->keyName, &value );
+    if ( result == 0 )
+    {
+        result = resizeBuffer( &value, size );
+    }
+    if ( result == 0 )
+    {
+        result = setUCIValue( getSession(), node->keyName, value.data, value.length );
+    }
+    if ( result == 0 )
+    {
+        __atomic_store_n( &node->modified, time( NULL ), __ATOMIC_RELAXED );
+    }
+    free( value.data );
+
+    return result;
+}
+
+/**
+ * @brief open an option, taking a copy of its value
+ * @param node
+ * @param flags     as passed to open()
+ * @param file      set to the open file, to be released with closeTreeFile()
+ * @return 0 on success, or a negative errno
+ */
+int openTreeFile( tTreeNode * node, int flags, tTreeFile ** file )
+{
+    *file = NULL;
+    if ( isTreeDirectory( node ) )
+    {
+        return -EISDIR;
+    }
+
+    tTreeFile * treeFile = calloc( 1, sizeof( tTreeFile ) );
+    if ( treeFile == NULL )
+    {
+        return -ENOMEM;
+    }
+
+    int result = 0;
+    if ( flags & O_TRUNC )
+    {
+        /* the truncation has to reach the backend even if nothing is written */
+        treeFile->dirty = yes;
+    }
+    else
+    {
+        result = getUCIValue( getSession(), node->keyName, &treeFile->contents );
+    }
+
+    if ( result != 0 )
+    {
+        free( treeFile->contents.data );
+        free( treeFile );
+        return result;
+    }
+
+    pthread_mutex_init( &treeFile->lock, NULL );
+    treeFile->node = retainTreeNode( node );
+    *file = treeFile;
+
+    return 0;
+}
+
+/**
+ * @brief
+ * @param file
+ * @param buffer
+ * @param size
+ * @param offset
+ * @return the number of bytes read
+ */
+ssize_t readTreeFile( tTreeFile * file, char * buffer, size_t size, off_t offset )
+{
+    ssize_t result = 0;
+
+    pthread_mutex_lock( &file->lock );
+    if ( (size_t)offset < file->contents.length )
+    {
+        result = file->contents.length - offset;
+        if ( (size_t)result > size )
+        {
+            result = size;
+        }
+        memcpy( buffer, &file->contents.data[offset], result );
+    }
+    pthread_mutex_unlock( &file->lock );
+
+    return result;
+}
+
+/**
+ * @brief make room for size bytes at offset, and let fill() put the data straight there.
+ * See fillFH().
+ * @param file
+ * @param size
+ * @param offset
+ * @param fill
+ * @param context passed to fill()
+ * @return the number of bytes filled, or a negative errno
+ */
+ssize_t fillTreeFile( tTreeFile * file, size_t size, off_t offset, tFillFH fill, void * context )
+{
+    ssize_t result = 0;
+
+    pthread_mutex_lock( &file->lock );
+
+    size_t end = offset + size;
+    if ( end > file->contents.length )
+    {
+        size_t length = file->contents.length;
+        result = resizeBuffer( &file->contents, end );
+        if ( result == 0 )
+        {
+            /* only the part that's filled counts, but any gap before offset reads back as zeros */
+            file->contents.length = ( (size_t)offset > length ) ? (size_t)offset : length;
+        }
+    }
+
+    if ( result == 0 )
+    {
+        result = fill( &file->contents.data[offset], size, context );
+    }
+
+    if ( result > 0 )
+    {
+        end = offset + result;
+        if ( end > file->contents.length )
+        {
+            file->contents.length = end;
+        }
+        file->dirty = yes;
+    }
+
+    pthread_mutex_unlock( &file->lock );
+
+    return result;
+}
+
+/**
+ * @brief
+ * @param file
+ * @param size
+ * @return 0 on success, or a negative errno
+ */
+int truncateTreeFile( tTreeFile * file, off_t size )
+{
+    pthread_mutex_lock( &file->lock );
+    int result = resizeBuffer( &file->contents, size );
+    if ( result == 0 )
+    {
+        file->dirty = yes;
+    }
+    pthread_mutex_unlock( &file->lock );
+
+    return result;
+}
+
+/**
+ * @brief write the value back to libelektra, if it has changed
+ * @param file
+ * @return 0 on success, or a negative errno
+ */
+int syncTreeFile( tTreeFile * file )
+{
+    int result = 0;
+
+    pthread_mutex_lock( &file->lock );
+    if ( file->dirty )
+    {
+        result = setUCIValue( getSession(), file->node->keyName, file->contents.data, file->contents.length );
+        if ( result == 0 )
+        {
+            file->dirty = no;
+            __atomic_store_n( &file->node->modified, time( NULL ), __ATOMIC_RELAXED );
+        }
+    }
+    pthread_mutex_unlock( &file->lock );
+
+    return result;
+}
+
+/**
+ * @brief write back any changes, then free the open file
+ * @param file
+ * @return the result of writing back the changes
+ */
+int closeTreeFile( tTreeFile * file )
+{
+    int result = 0;
+
+    if ( file != NULL )
+    {
+        result = syncTreeFile( file );
+
+        putTreeNode( file->node );
+        free( file->contents.data );
+        pthread_mutex_destroy( &file->lock );
+        free( file );
+    }
+    return result;
+}
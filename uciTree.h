@@ -0,0 +1,35 @@
+#ifndef UCIFS_UCITREE_H
+#define UCIFS_UCITREE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fileHandles.h"
+
+typedef struct sTreeNode tTreeNode;
+typedef struct sTreeFile tTreeFile;
+
+/* called for each entry of a directory in the hierarchical view. Only st_ino and the
+ * type bits of st_mode are filled in, which is all a directory listing needs */
+typedef int (*tTreeVisitor)( const char * name, const struct stat * st, void * context );
+
+int         lookupTreeNode(   tTreeNode * parent, const char * name, tTreeNode ** node );
+int         createTreeNode(   tTreeNode * parent, const char * name, tTreeNode ** node );
+tTreeNode * retainTreeNode(   tTreeNode * node );
+void        putTreeNode(      tTreeNode * node );
+tBool       isTreeDirectory(  const tTreeNode * node );
+int         getTreeNodeAttributes( tTreeNode * node, struct stat * st );
+int         listTreeNode(     tTreeNode * node, tTreeVisitor visitor, void * context );
+int         truncateTreeNode( tTreeNode * node, off_t size );
+int         getTreeNodeETag(  tTreeNode * node, tBuffer * etag );
+int         getTreeNodeGeneration( tTreeNode * node, unsigned long * generation );
+int         getTreeNodeType(  tTreeNode * node, tBuffer * type );
+
+int         openTreeFile(     tTreeNode * node, int flags, tTreeFile ** file );
+ssize_t     readTreeFile(     tTreeFile * file, char * buffer, size_t size, off_t offset );
+ssize_t     fillTreeFile(     tTreeFile * file, size_t size, off_t offset, tFillFH fill, void * context );
+int         truncateTreeFile( tTreeFile * file, off_t size );
+int         syncTreeFile(     tTreeFile * file );
+int         closeTreeFile(    tTreeFile * file );
+
+#endif //UCIFS_UCITREE_H
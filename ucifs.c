@@ -12,9 +12,11 @@
 #include <sys/types.h>
 #include <time.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
 
 #define FUSE_USE_VERSION 35
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 /* do this explicitly, as builds on x86-64 define it as zero */
 #undef  O_LARGEFILE
 #define O_LARGEFILE 0x00008000
@@ -23,439 +25,1561 @@
 #include "logStuff.h"
 #include "fileHandles.h"
 #include "uci2libelektra.h"
+#include "uciTree.h"
+#include "watcher.h"
+#include "stats.h"
+#include "traceStuff.h"
+
+/* how long the kernel may cache attributes and directory entries, in seconds. The watcher
+ * invalidates anything that changes in the backend, so these can be fairly generous */
+#define kDefaultAttrTimeout     5.0
+#define kDefaultEntryTimeout    5.0
+/* how long to gather saves before committing them together. Short enough that a save is
+ * in the backend by the time anyone looks, long enough to catch a script's burst of saves */
+#define kDefaultCommitWindow    100
+
+typedef struct {
+    double      attrTimeout;
+    double      entryTimeout;
+    int         keepCache;      // let the kernel keep cached contents if they haven't changed since the last open
+    unsigned    commitWindow;   // in milliseconds, zero commits as soon as the worker gets to it
+    int         syncFlush;      // make close() wait for the file to be committed
+    char *      traceFile;      // record function calls, and write them here on unmount. Needs -finstrument-functions
+    char *      profileFile;    // profile function calls, written here on unmount or SIGUSR1. Ditto
+    int         tree;           // show each package as a directory of sections and options, see uciTree.c
+} tOptions;
+
+/* an open package file */
+typedef struct {
+    tFileHandle *   fh;         // referenced until doRelease()
+    tSnapshot *     snapshot;   // the contents as they were when it was opened. NULL if they'd been written to
+    tBool           written;    // once it has written, it reads back the current contents instead. Only accessed atomically
+} tOpenFile;
+
+static tOptions gOptions = {
+    .attrTimeout  = kDefaultAttrTimeout,
+    .entryTimeout = kDefaultEntryTimeout,
+    .keepCache    = 1,
+    .commitWindow = kDefaultCommitWindow
+};
+
+#define UCIFS_OPT( templ, member, value ) { templ, offsetof( tOptions, member ), value }
+
+/* mount options, e.g. -o uci_attr_timeout=30,uci_no_keep_cache,uci_commit_window=0 */
+static const struct fuse_opt kOptionSpec[] = {
+    UCIFS_OPT( "uci_attr_timeout=%lf",  attrTimeout,  0 ),
+    UCIFS_OPT( "uci_entry_timeout=%lf", entryTimeout, 0 ),
+    UCIFS_OPT( "uci_keep_cache",        keepCache,    1 ),
+    UCIFS_OPT( "uci_no_keep_cache",     keepCache,    0 ),
+    UCIFS_OPT( "uci_commit_window=%u",  commitWindow, 0 ),
+    UCIFS_OPT( "uci_sync_flush",        syncFlush,    1 ),
+    UCIFS_OPT( "uci_trace_file=%s",     traceFile,    0 ),
+    UCIFS_OPT( "uci_profile_file=%s",   profileFile,  0 ),
+    UCIFS_OPT( "uci_tree",              tree,         1 ),
+    FUSE_OPT_END
+};
+
 
+/* the mount point, created by doInit(). The low-level ops are handed a request rather than
+ * a context to dig it out of, so it's kept here for getPrivateData() */
+static tMountPoint *            gMountPoint = NULL;
+/* the session the watcher sends its invalidations to */
+static struct fuse_session *    gSession    = NULL;
 
 /**
  * @brief
- * @param fi
- * @param path
  * @return
  */
-tFileHandle * fetchFH(  struct fuse_file_info * fi, const char * path )
+void * getPrivateData( void )
 {
-    tFileHandle * result = NULL;
-
-    if ( fi != NULL )
+    if ( gMountPoint == NULL )
     {
-        result = (tFileHandle *) fi->fh;
+        logError( "the mount point has not been initialized" );
     }
-    if (result == NULL)
+    return gMountPoint;
+}
+
+/**
+ * @brief the kernel knows each package by the address of its file handle, so finding the
+ * file handle for an op is a cast rather than a search. The file handle can't be freed while
+ * the kernel still knows it, as every lookup we reply to holds a reference until it's forgotten.
+ * @param ino
+ * @return the file handle, or NULL if ino is the root directory, the statistics file,
+ *         or part of the hierarchical view
+ */
+static tFileHandle * inodeFH( fuse_ino_t ino )
+{
+    if ( ino == FUSE_ROOT_ID || ino == kStatsInode || gOptions.tree )
     {
-        result = getFH( NULL, path );
+        return NULL;
     }
-    if ( result != NULL && fi != NULL )
+    return (tFileHandle *)ino;
+}
+
+/**
+ * @brief with uci_tree, everything below the root is a tree node instead, and the kernel
+ * knows it by its address in just the same way.
+ * @param ino
+ * @return the tree node, or NULL if ino is the root directory, the statistics file,
+ *         or a package file
+ */
+static tTreeNode * inodeTreeNode( fuse_ino_t ino )
+{
+    if ( ino == FUSE_ROOT_ID || ino == kStatsInode || !gOptions.tree )
     {
-        fi->fh = (uint64_t)result;
+        return NULL;
     }
+    return (tTreeNode *)ino;
+}
 
-    return result;
+/**
+ * @brief An open package holds its tOpenFile in fi->fh, from doOpen() until doRelease().
+ * @param ino
+ * @param fi
+ * @return the open package, or NULL if ino isn't a package
+ */
+static tOpenFile * openedFile( fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    if ( fi == NULL || inodeFH( ino ) == NULL )
+    {
+        return NULL;
+    }
+    return (tOpenFile *)fi->fh;
 }
 
 /**
  * @brief
- * @return
+ * @param ino
+ * @param fi
+ * @return the file handle of an open package, or NULL if ino isn't a package
  */
-void * getPrivateData( void )
+static tFileHandle * openedFileFH( fuse_ino_t ino, struct fuse_file_info * fi )
 {
-    struct fuse_context * fc = fuse_get_context();
-    if ( fc == NULL || fc->private_data == NULL)
+    tOpenFile * file = openedFile( ino, fi );
+    return ( file != NULL ) ? file->fh : NULL;
+}
+
+/**
+ * @brief note that an open package has been changed through, so from now on its reads
+ * see what it wrote rather than the snapshot it pinned when it was opened
+ * @param ino
+ * @param fi
+ */
+static void markWritten( fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    tOpenFile * file = openedFile( ino, fi );
+    if ( file != NULL )
+    {
+        __atomic_store_n( &file->written, yes, __ATOMIC_RELEASE );
+    }
+}
+
+/**
+ * @brief An open option holds its tTreeFile in fi->fh, from doOpen() until doRelease().
+ * @param ino
+ * @param fi
+ * @return the open option, or NULL if ino isn't one
+ */
+static tTreeFile * openedTreeFile( fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    if ( fi == NULL || inodeTreeNode( ino ) == NULL )
     {
-        logError( "unable to retrieve private data from fuse context" );
         return NULL;
     }
-    return fc->private_data;
+    return (tTreeFile *)fi->fh;
+}
+
+/**
+ * @brief the root file table is keyed by path, so turn a name in the root directory into one
+ * @param name
+ * @param path
+ * @param size
+ * @return 0 on success, or -ENAMETOOLONG
+ */
+static int rootPath( const char * name, char * path, size_t size )
+{
+    if ( snprintf( path, size, "/%s", name ) >= (int)size )
+    {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/**
+ * @brief reply with the part of buffer that starts at offset
+ * @param req
+ * @param buffer
+ * @param size  the most the kernel asked for
+ * @param offset
+ */
+static void replySlice( fuse_req_t req, const tBuffer * buffer, size_t size, off_t offset )
+{
+    if ( offset < 0 || (size_t)offset >= buffer->length )
+    {
+        fuse_reply_buf( req, NULL, 0 );
+        return;
+    }
+    size_t remaining = buffer->length - offset;
+    if ( size > remaining )
+    {
+        size = remaining;
+    }
+    fuse_reply_buf( req, &buffer->data[offset], size );
 }
 
 /**
  * @brief
+ * @param req
  * @param st
  */
-void setUserGroup( struct stat * st )
+static void getStatsAttributes( fuse_req_t req, struct stat * st )
 {
-    struct fuse_context * fc = fuse_get_context();
-    if ( fc != NULL)
+    memset( st, 0, sizeof( struct stat ) );
+    st->st_ino   = kStatsInode;
+    st->st_mode  = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    st->st_nlink = 1;
+    st->st_mtime = st->st_ctime = st->st_atime = time( NULL );
+
+    const struct fuse_ctx * ctx = fuse_req_ctx( req );
+    if ( ctx != NULL )
     {
-        st->st_uid = fc->uid;
-        st->st_gid = fc->gid;
+        st->st_uid = ctx->uid;
+        st->st_gid = ctx->gid;
     }
 }
 
+/**
+ * @brief
+ * @param req
+ * @param ino
+ * @param st
+ * @return 0 on success, or a negative errno
+ */
+static int getAttributes( fuse_req_t req, fuse_ino_t ino, struct stat * st )
+{
+    if ( ino == FUSE_ROOT_ID )
+    {
+        tMountPoint * mountPoint = getPrivateData();
+        return ( mountPoint != NULL ) ? getDirAttributes( mountPoint, st ) : -ENOENT;
+    }
+    if ( ino == kStatsInode )
+    {
+        getStatsAttributes( req, st );
+        return 0;
+    }
+    if ( gOptions.tree )
+    {
+        return getTreeNodeAttributes( inodeTreeNode( ino ), st );
+    }
+    return getFileAttributes( inodeFH( ino ), st );
+}
 
 /**
- * @brief Initialize filesystem
- *
- * The return value will passed in the `private_data` field of `struct fuse_context`
- * to all file operations, and as a parameter to the destroy() method. It overrides
- * the initial value provided to fuse_main() / fuse_new().
+ * @brief fill in the entry a lookup or create replies with
+ * @param fh
+ * @param entry
+ * @return 0 on success, or a negative errno
  */
-static void * doInit( struct fuse_conn_info * conn,
-                      struct fuse_config *    cfg )
+static int fillEntry( tFileHandle * fh, struct fuse_entry_param * entry )
 {
-    (void)conn;
+    memset( entry, 0, sizeof( struct fuse_entry_param ) );
+    entry->ino           = (fuse_ino_t)fh;
+    entry->attr_timeout  = gOptions.attrTimeout;
+    entry->entry_timeout = gOptions.entryTimeout;
 
-    logDebug( "### op: init" );
+    return getFileAttributes( fh, &entry->attr );
+}
 
-    void * result = (void *)initRoot( cfg->uid, cfg->gid );
-    logDebug( "mountPoint %p", result );
+/**
+ * @brief fill in the entry a lookup or create in the hierarchical view replies with
+ * @param node
+ * @param entry
+ * @return 0 on success, or a negative errno
+ */
+static int fillTreeEntry( tTreeNode * node, struct fuse_entry_param * entry )
+{
+    memset( entry, 0, sizeof( struct fuse_entry_param ) );
+    entry->ino           = (fuse_ino_t)node;
+    entry->attr_timeout  = gOptions.attrTimeout;
+    entry->entry_timeout = gOptions.entryTimeout;
 
-    return result;
+    return getTreeNodeAttributes( node, &entry->attr );
 }
 
 /**
- * @brief Clean up filesystem
- *
- * Called on filesystem exit.
+ * @brief take a snapshot of the statistics for an open of the statistics file. Every read of
+ * that open sees the same snapshot, so a reader that needs several reads gets consistent figures.
+ * @param fi  fi->fh is set to the snapshot, a tBuffer released by doRelease()
+ * @return 0 on success, or a negative errno
  */
-static void doDestroy( void * private_data )
+static int openStats( struct fuse_file_info * fi )
 {
-    errno = 0; logDebug( "### op: destroy" );
+    if ( ( fi->flags & O_ACCMODE ) != O_RDONLY )
+    {
+        return -EACCES;
+    }
 
-    if ( private_data != NULL )
+    tBuffer * snapshot = calloc( 1, sizeof( tBuffer ) );
+    if ( snapshot == NULL )
+    {
+        return -ENOMEM;
+    }
+    int result = renderStats( snapshot );
+    if ( result != 0 )
     {
-        releaseRoot( (tMountPoint *)private_data );
+        free( snapshot->data );
+        free( snapshot );
+        return result;
     }
+
+    /* its size isn't known until it's opened, so the kernel has to take reads at face value */
+    fi->direct_io = 1;
+    fi->fh = (uint64_t)snapshot;
+    return 0;
 }
 
+/**
+ * @brief
+ * @param snapshot  a tBuffer made by openStats() or doOpenDir()
+ */
+static void freeSnapshot( tBuffer * snapshot )
+{
+    if ( snapshot != NULL )
+    {
+        free( snapshot->data );
+        free( snapshot );
+    }
+}
 
 /**
- * @brief Get file attributes.
- *
- * Similar to stat().  The 'st_dev' and 'st_blksize' fields are ignored. The 'st_ino' field is
- * ignored except if the 'use_ino' mount option is given. In that case it is passed to userspace,
- * but libfuse and the kernel will still assign a different inode for internal use (called the "nodeid").
- *
- * `fuse_file_info` will always be NULL if the file is not currently open, but may also be NULL if
- * the file is open. Thus we cannot count on being able to retrieve the opaque value in fi->fh.
-**/
-static int doGetAttr( const char * path,
-                      struct stat * st,
-                      struct fuse_file_info * fi )
+ * @brief open a package. Shared by doOpen() and doCreate().
+ * Its reads see the contents as they were when it was opened, however they change meanwhile,
+ * until it writes to them itself. Opening a package that has been written to, but not committed,
+ * gets the written contents as they change instead.
+ * @param fh
+ * @param fi  on success, fi->fh holds a tOpenFile with a reference to fh until doRelease()
+ * @return 0 on success, or a negative errno
+ */
+static int openFile( tFileHandle * fh, struct fuse_file_info * fi )
 {
-    int result = -ENOENT;
+    tOpenFile * file = calloc( 1, sizeof( tOpenFile ) );
+    if ( file == NULL )
+    {
+        return -ENOMEM;
+    }
 
-    logDebug( "### op: getattr \'%s\' [%p]", path, fi );
+    if ( fi->flags & O_TRUNC )
+    {
+        logDebug( "  \'%s\' truncated", getFHpath( fh ) );
+        truncateFH( fh, 0 );
+    }
+    int result = refreshFH( fh );
+    if ( result == 0 )
+    {
+        /* if nothing has changed since the last open, whatever the kernel has in
+         * its page cache is still good, so don't make it read everything again */
+        tBool unchanged = openedFH( fh, &file->snapshot );
+        fi->keep_cache = ( gOptions.keepCache && unchanged );
+
+        /* the open file keeps this reference until doRelease() */
+        file->fh = retainFH( fh );
+        fi->fh = (uint64_t)file;
+    }
+    else
+    {
+        free( file );
+    }
+    return result;
+}
 
-    if ( isDirectory( path ) )
+/**
+ * @brief open an option in the hierarchical view. Shared by doOpen() and doCreate().
+ * @param node
+ * @param fi  on success, fi->fh holds the open option until doRelease()
+ * @return 0 on success, or a negative errno
+ */
+static int openTree( tTreeNode * node, struct fuse_file_info * fi )
+{
+    tTreeFile * file;
+    int result = openTreeFile( node, fi->flags, &file );
+    if ( result == 0 )
     {
-        tMountPoint * mountPoint = getPrivateData();
-        if ( mountPoint != NULL )
-        {
-            result = getDirAttributes( mountPoint, st );
-        }
+        /* the backend can change an option without the watcher noticing, so don't let the kernel
+         * cache it. It's a single value, so it isn't worth caching anyway */
+        fi->direct_io = 1;
+        fi->fh = (uint64_t)file;
+    }
+    return result;
+}
+
+/**
+ * @brief let go of whatever an open of ino was holding on to
+ * @param ino
+ * @param fi
+ * @return 0, or for an option in the hierarchical view, the result of writing it back
+ */
+static int closeFile( fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    int result = 0;
+
+    if ( ino == kStatsInode )
+    {
+        freeSnapshot( (tBuffer *)fi->fh );
+    }
+    else if ( gOptions.tree )
+    {
+        result = closeTreeFile( (tTreeFile *)fi->fh );
     }
     else
     {
-        tFileHandle * fh = fetchFH( fi, path );
-        if ( fh != NULL )
+        tOpenFile * file = (tOpenFile *)fi->fh;
+        if ( file != NULL )
         {
-            result = getFileAttributes( fh, st );
+            putSnapshot( file->snapshot );
+            putFH( file->fh );
+            free( file );
         }
     }
+    fi->fh = 0;
 
     return result;
 }
 
-/* * * * * * * * * * * * * * * * * * * * * *
- * * * * * * Directory Operations  * * * * *
- * * * * * * * * * * * * * * * * * * * * * */
+/**
+ * @brief Initialize filesystem
+ *
+ * Called before any other filesystem method. There's no reply to send.
+ */
+static void doInit( void * userdata, struct fuse_conn_info * conn )
+{
+    (void)userdata;
+
+    /* started here rather than in main(), as fuse has forked into the background by now */
+    if ( gOptions.traceFile != NULL )
+    {
+        startFunctionTrace();
+    }
+    if ( gOptions.profileFile != NULL )
+    {
+        startFunctionProfile( gOptions.profileFile );
+    }
+
+    timeOp( kStatInit );
+
+    logDebug( "### op: init" );
+
+    /* doRead() replies with a memfd, and doWriteBuf() can read straight from a pipe,
+     * so let the kernel splice data to and from us rather than copying it through a buffer */
+    conn->want |= conn->capable & ( FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ );
+
+    logDebug( "attr_timeout %g, entry_timeout %g, keep_cache %s, commit_window %u ms, sync_flush %s, tree %s",
+              gOptions.attrTimeout, gOptions.entryTimeout, gOptions.keepCache ? "on" : "off",
+              gOptions.commitWindow, gOptions.syncFlush ? "on" : "off", gOptions.tree ? "on" : "off" );
+
+    /* if the backend can't be watched, populateRoot() falls back to polling it */
+    tWatcher * watcher = startWatcher( gSession );
+
+    /* one libelektra session for the life of the mount, closed by releaseRoot() in doDestroy() */
+    tElektraSession * elektra = openElektraSession();
+
+    /* everything belongs to whoever mounted it */
+    gMountPoint = initRoot( getuid(), getgid(), watcher, elektra, gOptions.commitWindow );
+    logDebug( "mountPoint %p", gMountPoint );
+}
 
 /**
- * @brief Open directory
+ * @brief Clean up filesystem
  *
- * Unless the 'default_permissions' mount option is given, this method should check
- * opendir is permitted for this directory. Optionally opendir may also return an
- * arbitrary filehandle in the fuse_file_info structure, which will be passed to
- * readdir, releasedir and fsyncdir.
+ * Called on filesystem exit.
  */
-int doOpenDir( const char * path, struct fuse_file_info * fi )
+static void doDestroy( void * userdata )
 {
-    (void)fi;
+    timeOp( kStatDestroy );
 
-    logDebug("opendir \'%s\' [%p]", path, fi );
+    (void)userdata;
 
-    int result = -EINVAL;
+    errno = 0; logDebug( "### op: destroy" );
 
-    if ( path[0] == '/' && path[1] == '\0' )
+    if ( gMountPoint != NULL )
     {
-        tMountPoint * mountPoint = getPrivateData();
-        if ( mountPoint != NULL )
+        releaseRoot( gMountPoint );
+        gMountPoint = NULL;
+    }
+
+    if ( gOptions.traceFile != NULL )
+    {
+        stopFunctionTrace();
+        dumpFunctionTrace( gOptions.traceFile );
+    }
+    if ( gOptions.profileFile != NULL )
+    {
+        stopFunctionProfile();
+        dumpFunctionProfile( gOptions.profileFile );
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * Inode Operations  * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * */
+
+/**
+ * @brief look up name in the hierarchical view. As with a package, the reference the node
+ * starts with is the one the kernel holds until it forgets the inode.
+ * @param req
+ * @param parent NULL for the root
+ * @param name
+ */
+static void lookupTree( fuse_req_t req, tTreeNode * parent, const char * name )
+{
+    struct fuse_entry_param entry;
+    tTreeNode * node;
+
+    int result = lookupTreeNode( parent, name, &node );
+    if ( result == 0 )
+    {
+        result = fillTreeEntry( node, &entry );
+        if ( result != 0 )
         {
-            /* ToDo: check permissions */
-            result = populateRoot( mountPoint );
+            putTreeNode( node );
         }
     }
 
-    return result;
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+    }
+    else if ( fuse_reply_entry( req, &entry ) != 0 )
+    {
+        /* the kernel never got it, so there won't be a forget for it */
+        putTreeNode( node );
+    }
 }
 
 /**
- * @brief Read directory
- *
- * The filesystem may choose between two modes of operation:
- *
- * 1) The readdir implementation ignores the offset parameter, and passes zero to the
- *    filler function's offset. The filler function will not return '1' (unless an
- *    error happens), so the whole directory is read in a single readdir operation.
+ * @brief Look up a directory entry by name and get its attributes.
  *
- * 2) The readdir implementation keeps track of the offsets of the directory entries.
- *    It uses the offset parameter and always passes non-zero offset to the filler
- *    function.  When the buffer is full (or an error happens) the filler function
- *    will return '1'.
-**/
-static int doReadDir( const char * path,
-                      void * buffer,
-                      fuse_fill_dir_t filler,
-                      off_t offset,
-                      struct fuse_file_info * fi,
-                      enum fuse_readdir_flags flags )
+ * This is the only op that deals in names. Everything else is handed the inode the kernel
+ * got from here, and the kernel keeps it until it sends the matching forget. So this is
+ * the only op that has to bring the root file table up to date.
+ */
+static void doLookup( fuse_req_t req, fuse_ino_t parent, const char * name )
 {
-    (void)offset; (void)fi; (void)flags;
+    timeOp( kStatLookup );
 
-    logDebug( "### op: readdir \'%s\' [%p]", path, fi );
-
-    int result = -EINVAL;
+    logDebug( "### op: lookup \'%s\' in %lu", name, parent );
 
-    if ( isDirectory( path ) )
+    if ( parent == kStatsInode || ( parent != FUSE_ROOT_ID && !gOptions.tree ) )
     {
-        result = 0;
+        fuse_reply_err( req, ENOTDIR );
+        return;
+    }
 
-        filler( buffer, ".",  NULL, 0, 0 );  // this Directory (self)
-        filler( buffer, "..", NULL, 0, 0 );  // my parent directory
+    struct fuse_entry_param entry;
 
-        tFileHandle * fh = nextFH( NULL );
-        while ( fh != NULL )
-        {
-            const char *  filepath = getFHpath( fh );
-            if ( *filepath == '/' ) ++filepath;
+    if ( parent == FUSE_ROOT_ID && strcmp( name, kStatsName ) == 0 )
+    {
+        memset( &entry, 0, sizeof( entry ) );
+        entry.ino           = kStatsInode;
+        entry.attr_timeout  = gOptions.attrTimeout;
+        entry.entry_timeout = gOptions.entryTimeout;
+        getStatsAttributes( req, &entry.attr );
+        fuse_reply_entry( req, &entry );
+        return;
+    }
 
-            struct stat * filestat = getFHstat( fh );
+    if ( gOptions.tree )
+    {
+        lookupTree( req, inodeTreeNode( parent ), name );
+        return;
+    }
 
-            filler( buffer, filepath, filestat, 0, 0 );
+    char path[ NAME_MAX + 2 ];
+    int result = rootPath( name, path, sizeof( path ) );
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+        return;
+    }
 
-            fh = nextFH( fh );
-        }
+    /* the reference findFH() takes is the one the kernel holds until it forgets the inode */
+    tFileHandle * fh = findFH( path );
+    if ( fh == NULL )
+    {
+        fuse_reply_err( req, ENOENT );
+        return;
     }
 
-    return result;
+    result = fillEntry( fh, &entry );
+    if ( result != 0 )
+    {
+        putFH( fh );
+        fuse_reply_err( req, -result );
+    }
+    else if ( fuse_reply_entry( req, &entry ) != 0 )
+    {
+        /* the kernel never got it, so there won't be a forget for it */
+        putFH( fh );
+    }
 }
 
 /**
- * @brief Release a directory
+ * @brief drop the references held by nlookup lookups of ino
+ * @param ino
+ * @param nlookup
  */
-int doReleaseDir( const char * path, struct fuse_file_info * fi )
+static void forgetInode( fuse_ino_t ino, uint64_t nlookup )
 {
-    logDebug("releasedir \'%s\' [%p]", path, fi );
-
-    return 0;
+    tFileHandle * fh   = inodeFH( ino );
+    tTreeNode *   node = inodeTreeNode( ino );
+    while ( nlookup-- > 0 )
+    {
+        if ( fh != NULL )
+        {
+            putFH( fh );
+        }
+        else if ( node != NULL )
+        {
+            putTreeNode( node );
+        }
+    }
 }
 
-/* * * * * * * * * * * * * * * * * * * * * *
- * * * * * * * File Operations * * * * * * *
- * * * * * * * * * * * * * * * * * * * * * */
-
 /**
- * @brief Open a file
- *
- * Open flags are available in fi->flags. The following rules apply.
- *
- *  - Creation (O_CREAT, O_EXCL, O_NOCTTY) flags will be filtered out / handled by the kernel.
- *
- *  - Access modes (O_RDONLY, O_WRONLY, O_RDWR, O_EXEC, O_SEARCH) should be used by the filesystem
- *    to check if the operation is permitted.  If the ``-o default_permissions`` mount option is
- *    given, this check is already done by the kernel before calling open() and may thus be omitted
- *    by the filesystem.
- *
- *  - When writeback caching is enabled, the kernel may send read requests even for files opened
- *    with O_WRONLY. The filesystem should be prepared to handle this.
- *
- *  - When writeback caching is disabled, the filesystem is expected to properly handle the
- *    O_APPEND flag and ensure that each write is appending to the end of the file.
- *
- *  - When writeback caching is enabled, the kernel will handle O_APPEND. However, unless all
- *    changes to the file come through the kernel this will not work reliably. The filesystem
- *    should thus either ignore the O_APPEND flag (and let the kernel handle it), or return
- *    an error (indicating that reliably O_APPEND is not available).
- *
- * Filesystem may store an arbitrary file handle (pointer, index, etc) in fi->fh, and use
- * this in other all other file operations (read, write, flush, release, fsync).
- *
- * Filesystem may also implement stateless file I/O and not store anything in fi->fh.
+ * @brief Forget about an inode
  *
- * There are also some flags (direct_io, keep_cache) which the filesystem may set in fi, to
- * change the way the file is opened. See fuse_file_info structure in <fuse_common.h> for
- * more details.
- *
- * If this request is answered with an error code of ENOSYS and FUSE_CAP_NO_OPEN_SUPPORT is
- * set in `fuse_conn_info.capable`, this is treated as success and future calls to open will
- * also succeed without being send to the filesystem process.
-**/
+ * The kernel has let go of nlookup of the lookups it was given for ino. There's no reply.
+ */
+static void doForget( fuse_req_t req, fuse_ino_t ino, uint64_t nlookup )
+{
+    timeOp( kStatForget );
 
-static int doOpen( const char * path, struct fuse_file_info * fi )
+    logDebug( "### op: forget %lu (%lu)", ino, nlookup );
+
+    forgetInode( ino, nlookup );
+    fuse_reply_none( req );
+}
+
+/**
+ * @brief Forget about multiple inodes
+ */
+static void doForgetMulti( fuse_req_t req, size_t count, struct fuse_forget_data * forgets )
 {
-    logDebug( "### op: open \'%s\' %s [%p]", path, openFlagsAsStr(fi->flags), fi );
+    timeOp( kStatForget );
 
-    int result = 0;
+    logDebug( "### op: forget_multi (%lu)", count );
 
-    if ( fi != NULL )
+    for ( size_t i = 0; i < count; ++i )
     {
-        tFileHandle * fh = fetchFH( fi, path );
-        if ( fh == NULL )
-            result = -ENOENT;
-        else {
-            if ( fi->flags & O_TRUNC )
-            {
-                logDebug( "  \'%s\' truncated", path );
-                truncateFH( fh, 0 );
-            }
-            result = populateFH( fh );
+        forgetInode( forgets[i].ino, forgets[i].nlookup );
+    }
+    fuse_reply_none( req );
+}
+
+/**
+ * @brief Get file attributes.
+ *
+ * Every inode the kernel holds maps directly onto its file handle, so unlike the high-level
+ * API, there's no path to resolve, and the root file table isn't consulted.
+**/
+static void doGetAttr( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatGetAttr );
+
+    (void)fi;
+
+    logDebug( "### op: getattr %lu [%p]", ino, fi );
+
+    struct stat st;
+    int result = getAttributes( req, ino, &st );
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+    }
+    else
+    {
+        fuse_reply_attr( req, &st, gOptions.attrTimeout );
+    }
+}
+
+/**
+ * @brief Set file attributes
+ *
+ * to_set says which of the attributes in attr to change. Only the size can be changed, the
+ * times are kept by ucifs itself, and the ownership and permissions follow the mount.
+ *
+ * `fi` will be NULL if the file isn't open, or if it's a truncate() rather than an ftruncate().
+ */
+static void doSetAttr( fuse_req_t req, fuse_ino_t ino, struct stat * attr, int to_set,
+                       struct fuse_file_info * fi )
+{
+    timeOp( kStatSetAttr );
+
+    logDebug( "### op: setattr %lu 0x%x [%p]", ino, to_set, fi );
+
+    int result = 0;
+
+    if ( to_set & ( FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID ) )
+    {
+        result = -ENOSYS;
+    }
+    else if ( to_set & FUSE_SET_ATTR_SIZE )
+    {
+        tFileHandle * fh       = inodeFH( ino );
+        tTreeNode *   node     = inodeTreeNode( ino );
+        tTreeFile *   treeFile = openedTreeFile( ino, fi );
+        if ( ino == kStatsInode )
+        {
+            result = -EACCES;
+        }
+        else if ( treeFile != NULL )
+        {
+            /* an ftruncate(), the change goes out with the rest of what's written to the open file */
+            result = truncateTreeFile( treeFile, attr->st_size );
+        }
+        else if ( node != NULL )
+        {
+            result = truncateTreeNode( node, attr->st_size );
+        }
+        else if ( fh == NULL )
+        {
+            result = -EISDIR;
+        }
+        else
+        {
+            result = truncateFH( fh, attr->st_size );
+            /* if it's an ftruncate(), the open file reads back the truncated contents from now on */
+            markWritten( ino, fi );
+        }
+    }
+
+    struct stat st;
+    if ( result == 0 )
+    {
+        result = getAttributes( req, ino, &st );
+    }
+
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+    }
+    else
+    {
+        fuse_reply_attr( req, &st, gOptions.attrTimeout );
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * Directory Operations  * * * * *
+ * * * * * * * * * * * * * * * * * * * * * */
+
+/**
+ * @brief append a directory entry to a listing
+ * @param req
+ * @param listing
+ * @param name
+ * @param st  only st_ino and the file type in st_mode are used
+ * @return 0 on success, or a negative errno
+ */
+static int addDirEntry( fuse_req_t req, tBuffer * listing, const char * name, const struct stat * st )
+{
+    size_t size = fuse_add_direntry( req, NULL, 0, name, NULL, 0 );
+
+    int result = reserveBuffer( listing, size );
+    if ( result == 0 )
+    {
+        /* the offset of an entry is where the next one starts, which is where a readdir resumes */
+        fuse_add_direntry( req, &listing->data[listing->length], size, name, st, listing->length + size );
+        listing->length += size;
+    }
+    return result;
+}
+
+/**
+ * @brief list the root directory
+ * @param req
+ * @param mountPoint
+ * @param listing
+ * @return 0 on success, or a negative errno
+ */
+static int listRoot( fuse_req_t req, tMountPoint * mountPoint, tBuffer * listing )
+{
+    struct stat st;
+    memset( &st, 0, sizeof( st ) );
+    st.st_ino  = kRootInode;
+    st.st_mode = S_IFDIR;
+
+    int result = addDirEntry( req, listing, ".", &st );       // this Directory (self)
+    if ( result == 0 )
+    {
+        result = addDirEntry( req, listing, "..", &st );      // my parent directory
+    }
+    if ( result == 0 )
+    {
+        getStatsAttributes( req, &st );
+        result = addDirEntry( req, listing, kStatsName, &st );
+    }
+
+    /* keep the table from changing underneath the walk */
+    readLockRoot( mountPoint );
+
+    tFileHandle * fh = nextFH( NULL );
+    while ( fh != NULL && result == 0 )
+    {
+        const char * filepath = getFHpath( fh );
+        if ( *filepath == '/' ) ++filepath;
+
+        getFHstat( fh, &st );
+        if ( gOptions.tree )
+        {
+            /* same inode, but a directory of sections, see lookupTreeNode() */
+            st.st_mode = S_IFDIR;
+        }
+        result = addDirEntry( req, listing, filepath, &st );
+
+        fh = nextFH( fh );
+    }
+
+    unlockRoot( mountPoint );
+
+    return result;
+}
+
+typedef struct {
+    fuse_req_t  req;
+    tBuffer *   listing;
+} tDirListing;
+
+/**
+ * @brief the tTreeVisitor used by listTree()
+ * @param name
+ * @param st
+ * @param context the tDirListing
+ * @return 0 on success, or a negative errno
+ */
+static int addTreeEntry( const char * name, const struct stat * st, void * context )
+{
+    tDirListing * dir = context;
+    return addDirEntry( dir->req, dir->listing, name, st );
+}
+
+/**
+ * @brief list a package or section in the hierarchical view
+ * @param req
+ * @param node
+ * @param listing
+ * @return 0 on success, or a negative errno
+ */
+static int listTree( fuse_req_t req, tTreeNode * node, tBuffer * listing )
+{
+    struct stat st;
+    getTreeNodeAttributes( node, &st );
+
+    int result = addDirEntry( req, listing, ".", &st );
+    if ( result == 0 )
+    {
+        /* the kernel works out '..' for itself, only the type matters */
+        result = addDirEntry( req, listing, "..", &st );
+    }
+    if ( result == 0 )
+    {
+        tDirListing dir = { req, listing };
+        result = listTreeNode( node, addTreeEntry, &dir );
+    }
+    return result;
+}
+
+/**
+ * @brief Open directory
+ *
+ * The whole listing is built here, and kept in fi->fh for doReadDir() to hand out. That way
+ * a directory read in several chunks is consistent, however the root changes in between.
+ */
+static void doOpenDir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatOpenDir );
+
+    logDebug( "### op: opendir %lu [%p]", ino, fi );
+
+    tTreeNode * node = inodeTreeNode( ino );
+    if ( ino != FUSE_ROOT_ID && !isTreeDirectory( node ) )
+    {
+        fuse_reply_err( req, ENOTDIR );
+        return;
+    }
+
+    int result = -EINVAL;
+    tBuffer * listing = calloc( 1, sizeof( tBuffer ) );
+
+    tMountPoint * mountPoint = getPrivateData();
+    if ( listing == NULL )
+    {
+        result = -ENOMEM;
+    }
+    else if ( node != NULL )
+    {
+        result = listTree( req, node, listing );
+    }
+    else if ( mountPoint != NULL )
+    {
+        /* ToDo: check permissions */
+        result = populateRoot( mountPoint );
+        if ( result == 0 )
+        {
+            result = listRoot( req, mountPoint, listing );
+        }
+    }
+
+    if ( result != 0 )
+    {
+        freeSnapshot( listing );
+        fuse_reply_err( req, -result );
+        return;
+    }
+
+    fi->fh = (uint64_t)listing;
+    if ( fuse_reply_open( req, fi ) != 0 )
+    {
+        /* the opendir was interrupted, so there won't be a releasedir */
+        freeSnapshot( listing );
+    }
+}
+
+/**
+ * @brief Read directory
+ *
+ * The offset is the one the last entry read was added with, i.e. where the next one starts
+ * in the listing made by doOpenDir(). An entry cut short by size is read again next time.
+**/
+static void doReadDir( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info * fi )
+{
+    timeOp( kStatReadDir );
+
+    (void)ino;
+
+    logDebug( "### op: readdir %lu @%lu (%lu) [%p]", ino, offset, size, fi );
+
+    const tBuffer * listing = (const tBuffer *)fi->fh;
+    if ( listing == NULL )
+    {
+        fuse_reply_err( req, EBADF );
+        return;
+    }
+    replySlice( req, listing, size, offset );
+}
+
+/**
+ * @brief Release a directory
+ */
+static void doReleaseDir( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatReleaseDir );
+
+    (void)ino;
+
+    logDebug( "### op: releasedir %lu [%p]", ino, fi );
+
+    freeSnapshot( (tBuffer *)fi->fh );
+    fi->fh = 0;
+
+    fuse_reply_err( req, 0 );
+}
+
+/* * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * * File Operations * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * */
+
+/**
+ * @brief create and open an option in the hierarchical view. Only options can be created,
+ * in an existing section. The node's reference becomes the kernel's lookup reference.
+ * @param req
+ * @param parent
+ * @param name
+ * @param fi
+ */
+static void createTree( fuse_req_t req, tTreeNode * parent, const char * name, struct fuse_file_info * fi )
+{
+    struct fuse_entry_param entry;
+    tTreeNode * node;
+
+    int result = createTreeNode( parent, name, &node );
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+        return;
+    }
+
+    result = openTree( node, fi );
+    if ( result == 0 )
+    {
+        result = fillTreeEntry( node, &entry );
+        if ( result != 0 )
+        {
+            closeFile( (fuse_ino_t)node, fi );
+        }
+    }
+
+    if ( result != 0 )
+    {
+        putTreeNode( node );
+        fuse_reply_err( req, -result );
+    }
+    else if ( fuse_reply_create( req, &entry, fi ) != 0 )
+    {
+        /* the kernel never got it, so there won't be a forget or a release */
+        closeFile( (fuse_ino_t)node, fi );
+        putTreeNode( node );
+    }
+}
+
+/**
+ * @brief Create and open a file
+ *
+ * If the file does not exist, first create it with the specified mode, and then open it.
+ * The reply counts as a lookup too, so the kernel ends up holding two references: one as
+ * the inode, until it's forgotten, and one as the open file, until it's released.
+**/
+static void doCreate( fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode,
+                      struct fuse_file_info * fi )
+{
+    timeOp( kStatCreate );
+
+    logDebug( "### op: create \'%s\' (0x%x) %s [%p]", name, mode, createModeAsStr(mode), fi );
+
+    if ( gOptions.tree && parent != kStatsInode )
+    {
+        createTree( req, inodeTreeNode( parent ), name, fi );
+        return;
+    }
+    if ( parent != FUSE_ROOT_ID )
+    {
+        fuse_reply_err( req, ENOTDIR );
+        return;
+    }
+    if ( strcmp( name, kStatsName ) == 0 )
+    {
+        fuse_reply_err( req, EEXIST );
+        return;
+    }
+
+    char path[ NAME_MAX + 2 ];
+    int result = rootPath( name, path, sizeof( path ) );
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+        return;
+    }
+
+    /* make sure the root cache is up-to-date before adding to it */
+    populateRoot( getPrivateData() );
+
+    /* if another thread (or the backend) got there first, newFH() hands back the existing file.
+     * Its reference becomes the kernel's lookup reference */
+    tFileHandle * fh = newFH( path, mode );
+    if ( fh == NULL )
+    {
+        fuse_reply_err( req, ENOMEM );
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    result = openFile( fh, fi );
+    if ( result == 0 )
+    {
+        result = fillEntry( fh, &entry );
+        if ( result != 0 )
+        {
+            closeFile( (fuse_ino_t)fh, fi );
         }
     }
 
-    return result;
+    if ( result != 0 )
+    {
+        putFH( fh );
+        fuse_reply_err( req, -result );
+    }
+    else if ( fuse_reply_create( req, &entry, fi ) != 0 )
+    {
+        /* the kernel never got it, so there won't be a forget or a release */
+        closeFile( (fuse_ino_t)fh, fi );
+        putFH( fh );
+    }
+}
+
+/**
+ * @brief Open a file
+ *
+ * Open flags are available in fi->flags. The following rules apply.
+ *
+ *  - Creation (O_CREAT, O_EXCL, O_NOCTTY) flags will be filtered out / handled by the kernel.
+ *
+ *  - Access modes (O_RDONLY, O_WRONLY, O_RDWR, O_EXEC, O_SEARCH) should be used by the filesystem
+ *    to check if the operation is permitted.  If the ``-o default_permissions`` mount option is
+ *    given, this check is already done by the kernel before calling open() and may thus be omitted
+ *    by the filesystem.
+ *
+ *  - When writeback caching is disabled, the filesystem is expected to properly handle the
+ *    O_APPEND flag and ensure that each write is appending to the end of the file.
+ *
+ * fi->fh holds the open package (or the statistics snapshot, or the open option) until doRelease().
+**/
+static void doOpen( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatOpen );
+
+    logDebug( "### op: open %lu %s [%p]", ino, openFlagsAsStr(fi->flags), fi );
+
+    int result;
+
+    tFileHandle * fh   = inodeFH( ino );
+    tTreeNode *   node = inodeTreeNode( ino );
+    if ( ino == kStatsInode )
+    {
+        result = openStats( fi );
+    }
+    else if ( node != NULL )
+    {
+        result = openTree( node, fi );
+    }
+    else if ( fh == NULL )
+    {
+        result = -EISDIR;
+    }
+    else
+    {
+        result = openFile( fh, fi );
+    }
+
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+    }
+    else if ( fuse_reply_open( req, fi ) != 0 )
+    {
+        /* the open was interrupted, so there won't be a release */
+        closeFile( ino, fi );
+    }
+}
+
+/**
+ * @brief Release an open file
+ *
+ * Release is called when there are no more references to an open file: all file descriptors
+ * are closed and all memory mappings are unmapped.
+ *
+ * For every open() call there will be exactly one release() call with the same flags and
+ * file handle.
+ *
+ * Any error is ignored by the kernel.
+ */
+static void doRelease( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatRelease );
+
+    logDebug( "### op: release %lu [%p]", ino, fi );
+
+    int result = 0;
+
+    tFileHandle * fh = openedFileFH( ino, fi );
+    if ( fh != NULL )
+    {
+        result = parseFH( fh );
+    }
+    /* an option in the hierarchical view is written back as it's closed */
+    int closed = closeFile( ino, fi );
+    if ( result == 0 )
+    {
+        result = closed;
+    }
+
+    fuse_reply_err( req, -result );
+}
+
+/**
+ * @brief Read data from an open file
+ *
+ * Read should send exactly the number of bytes requested except on EOF or error,
+ * otherwise the rest of the data will be substituted with zeroes. An exception to
+ * this is when the file has been opened in 'direct_io' mode, in which case the return
+ * value of the read system call will reflect the size of the reply.
+ *
+ * An open package reads the snapshot it pinned when it was opened, without taking any locks.
+ * That's sent from a memfd, so fuse can splice it to the kernel without copying it.
+**/
+static void doRead( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                    struct fuse_file_info * fi )
+{
+    timeOp( kStatRead );
+
+    logDebug( "### op: read %lu @%lu (%lu) [%p]", ino, offset, size, fi );
+
+    if ( ino == kStatsInode )
+    {
+        /* it's small, and already in memory, so a plain reply will do */
+        replySlice( req, (const tBuffer *)fi->fh, size, offset );
+        return;
+    }
+
+    tOpenFile *   file     = openedFile( ino, fi );
+    tTreeFile *   treeFile = openedTreeFile( ino, fi );
+    if ( file == NULL && treeFile == NULL )
+    {
+        fuse_reply_err( req, EBADF );
+        return;
+    }
+
+    /* the pinned snapshot can't change or go away until the release */
+    tSnapshot * snapshot = NULL;
+    if ( file != NULL && !__atomic_load_n( &file->written, __ATOMIC_ACQUIRE ) )
+    {
+        snapshot = file->snapshot;
+    }
+
+    size_t length;
+    int fd = ( snapshot != NULL ) ? getSnapshotFd( snapshot, getFHpath( file->fh ), &length ) : -1;
+    if ( fd >= 0 )
+    {
+        /* point fuse at the memfd, so it can splice the contents to the kernel */
+        size_t remaining = ( offset >= 0 && (size_t)offset < length ) ? length - offset : 0;
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT( ( size < remaining ) ? size : remaining );
+        bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv.buf[0].fd    = fd;
+        bufv.buf[0].pos   = offset;
+
+        countStat( kStatBytesRead, bufv.buf[0].size );
+        fuse_reply_data( req, &bufv, FUSE_BUF_SPLICE_MOVE );
+        return;
+    }
+
+    /* the contents are being written to, or it's a single option, so fall back to a copy */
+    char * buffer = malloc( size );
+    if ( buffer == NULL )
+    {
+        fuse_reply_err( req, ENOMEM );
+        return;
+    }
+    ssize_t count;
+    if ( snapshot != NULL )
+        count = readSnapshot( snapshot, buffer, size, offset );
+    else if ( file != NULL )
+        count = readFH( file->fh, buffer, size, offset );
+    else
+        count = readTreeFile( treeFile, buffer, size, offset );
+    if ( count < 0 )
+    {
+        count = 0; // end of file
+    }
+    countStat( kStatBytesRead, count );
+    fuse_reply_buf( req, buffer, count );
+    free( buffer );
+}
+
+/**
+ * @brief the tFillFH used by doWriteBuf(), copies directly out of the fuse_bufvec
+ * @param dst
+ * @param size
+ * @param context the source fuse_bufvec
+ * @return the number of bytes copied, or a negative errno
+ */
+static ssize_t fillFromBufvec( char * dst, size_t size, void * context )
+{
+    struct fuse_bufvec dstBuf = FUSE_BUFVEC_INIT( size );
+    dstBuf.buf[0].mem = dst;
+
+    return fuse_buf_copy( &dstBuf, (struct fuse_bufvec *)context, 0 );
+}
+
+/**
+ * @brief Write contents of buffer to an open file
+ *
+ * The data is supplied in a generic buffer, which may be a pipe the kernel has spliced it into.
+ * Use fuse_buf_copy() to transfer data to the destination.
+ *
+ * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is expected to reset
+ * the setuid and setgid bits.
+**/
+static void doWriteBuf( fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec * buf, off_t offset,
+                        struct fuse_file_info * fi )
+{
+    timeOp( kStatWrite );
+
+    size_t size = fuse_buf_size( buf );
+
+    logDebug( "### op: write_buf %lu @%lu (%lu) [%p]", ino, offset, size, fi );
+
+    ssize_t result;
+
+    tFileHandle * fh       = openedFileFH( ino, fi );
+    tTreeFile *   treeFile = openedTreeFile( ino, fi );
+    if ( treeFile != NULL )
+        result = fillTreeFile( treeFile, size, offset, fillFromBufvec, buf );
+    else if ( fh == NULL )
+        result = -EBADF;
+    else {
+        // ToDo: check permissions
+        /* the data lands directly in the file's buffer, with no intermediate copy */
+        result = fillFH( fh, size, offset, fillFromBufvec, buf );
+        markWritten( ino, fi );
+    }
+
+    if ( result < 0 )
+    {
+        fuse_reply_err( req, (int)-result );
+    }
+    else
+    {
+        countStat( kStatBytesWritten, result );
+        fuse_reply_write( req, result );
+    }
+}
+
+/**
+ * @brief Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified file. If
+ * this function returns success then any subsequent write request to specified
+ * range is guaranteed not to fail because of lack of space on the file system media.
+ */
+static void doFAllocate( fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                         struct fuse_file_info * fi )
+{
+    timeOp( kStatFAllocate );
+
+    int result;
+
+    logDebug( "### op: fallocate %lu 0x%x @%lu (%lu) [%p]", ino, mode, offset, length, fi );
+
+    tFileHandle * fh = openedFileFH( ino, fi );
+    if ( openedTreeFile( ino, fi ) != NULL )
+        result = -EOPNOTSUPP;
+    else if ( fh == NULL )
+        result = -EBADF;
+    else {
+        result = allocateFH( fh, mode, offset, length );
+        markWritten( ino, fi );
+    }
+
+    fuse_reply_err( req, -result );
+}
+
+/**
+ * @brief Possibly flush cached data
+ *
+ * BIG NOTE: This is not equivalent to fsync().  It's not a request to sync dirty data.
+ *
+ * Flush is called on each close() of a file descriptor, as opposed to release which is
+ * called on the close of the last file descriptor for a file.  Under Linux, errors
+ * returned by flush() will be passed to userspace as errors from close(), so flush()
+ * is a good place to write back any cached dirty data. However, many applications
+ * ignore errors on close(), and on non-Linux systems, close() may succeed even if
+ * flush() returns an error. For these reasons, filesystems should not assume that
+ * errors returned by flush will ever be noticed or even delivered.
+ *
+ * NOTE: The flush() method may be called more than once for each open().  This happens
+ * more than one file descriptor refers to an open file handle, e.g. due to dup(),
+ * dup2() or fork() calls.  It is not possible to determine if a flush is final, so
+ * each flush should be treated equally.  Multiple write-flush sequences are relatively
+ * rare, so this shouldn't be a problem.
+ *
+ * Filesystems shouldn't assume that flush will be called at any particular point.
+ * It may be called more times than expected, or not at all.
+ *
+ * [close]: http://pubs.opengroup.org/onlinepubs/9699919799/functions/close.html
+ *
+ * Anything written is handed to the committer, so it starts on its way to the backend as
+ * soon as the file is closed. Only with the uci_sync_flush option does close() wait for it,
+ * as that holds up every close() for a commit, and defeats the commit window.
+ */
+static void doFlush( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi )
+{
+    timeOp( kStatFlush );
+
+    int result = 0;
+
+    logDebug( "### op: flush %lu [%p]", ino, fi );
+
+    tFileHandle * fh       = openedFileFH( ino, fi );
+    tTreeFile *   treeFile = openedTreeFile( ino, fi );
+    if ( fh != NULL )
+    {
+        result = gOptions.syncFlush ? syncFH( fh ) : parseFH( fh );
+    }
+    else if ( treeFile != NULL )
+    {
+        /* a single key is cheap enough to commit straight away */
+        result = syncTreeFile( treeFile );
+    }
+
+    fuse_reply_err( req, -result );
 }
 
 /**
- * @brief Create and open a file
- *
- * If the file does not exist, first create it with the specified mode, and then open it.
+ * @brief Synchronize file contents
  *
- * If this method is not implemented or under Linux kernel versions earlier than 2.6.15,
- * the mknod() and open() methods will be called instead.
-**/
-static int doCreate(const char * path, mode_t mode, struct fuse_file_info * fi)
+ * If the datasync parameter is non-zero, then only the user data should be flushed, not the meta data.
+ * Either way, anything written is committed to the backend straight away, rather than waiting for
+ * the commit window to close.
+ */
+static void doFSync( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info * fi )
 {
+    timeOp( kStatFSync );
+
     int result = 0;
-    logDebug( "### op: create \'%s\' (0x%x) %s [%p]", path, mode, createModeAsStr(mode), fi );
 
-    tFileHandle * fh = findFH( path );
-    /* we are not expecting to find a match, i.e. fh will be NULL */
-    if ( fh == NULL )
+    logDebug( "### op: fsync %lu %d [%p]", ino, datasync, fi );
+    (void)datasync; /* there's no metadata to leave out */
+
+    tFileHandle * fh       = openedFileFH( ino, fi );
+    tTreeFile *   treeFile = openedTreeFile( ino, fi );
+    if ( fh != NULL )
     {
-        fh = newFH( path, mode );
-        if ( fh != NULL &&  fi != NULL )
-        {
-            fi->fh = (uint64_t)fh;
-        }
+        result = syncFH( fh );
     }
-    if ( fh != NULL )
+    else if ( treeFile != NULL )
     {
-        result = doOpen( path, fi );
+        result = syncTreeFile( treeFile );
     }
 
-    return result;
+    fuse_reply_err( req, -result );
 }
 
+/* * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * Extended Attributes * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * */
+
+/* an ETag of the contents (see appendETag()), so a reader can tell whether they've changed without reading them */
+#define kXAttrETag          "user.ucifs.etag"
+/* the backend generation of the package, see getFHgeneration() */
+#define kXAttrGeneration    "user.ucifs.generation"
+/* the libelektra type of an option in the hierarchical view */
+#define kXAttrType          "user.ucifs.type"
+/* the libelektra types of all the options in a package file, one 'uci show'-style line each */
+#define kXAttrTypes         "user.ucifs.types"
+
 /**
- * @brief Change the size of a file
- *
- * `fi` will always be NULL if the file is not currently open, but may also be NULL if the file is open.
- *
- * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is expected to reset the setuid and setgid bits.
+ * @brief the value of one of ino's extended attributes
+ * @param ino
+ * @param name
+ * @param value appended to
+ * @return 0 on success, -ENODATA if ino doesn't have that attribute, or another negative errno
  */
-int doTruncate(const char * path, off_t offset, struct fuse_file_info * fi)
+static int getXAttr( fuse_ino_t ino, const char * name, tBuffer * value )
 {
-    int result = 0;
-
-    logDebug( "### op: truncate \'%s\' @%lu [%p]", path, offset, fi );
+    tFileHandle * fh   = inodeFH( ino );
+    tTreeNode *   node = inodeTreeNode( ino );
+    if ( fh == NULL && ( node == NULL || isTreeDirectory( node ) ) )
+    {
+        /* the root, the statistics and the directories of the hierarchical view have none */
+        return -ENODATA;
+    }
 
-    tFileHandle * fh = fetchFH( fi, path );
-    if (fh == NULL)
-        result = -ENOENT;
-    else {
-        result = truncateFH( fh, offset );
+    if ( strcmp( name, kXAttrETag ) == 0 )
+    {
+        return ( fh != NULL ) ? getFHetag( fh, value ) : getTreeNodeETag( node, value );
     }
-    return result;
+    if ( strcmp( name, kXAttrGeneration ) == 0 )
+    {
+        unsigned long generation = 0;
+        int result = 0;
+        if ( fh != NULL )
+        {
+            generation = getFHgeneration( fh );
+        }
+        else
+        {
+            result = getTreeNodeGeneration( node, &generation );
+        }
+        if ( result == 0 )
+        {
+            char number[24];
+            result = appendToBuffer( value, number, snprintf( number, sizeof( number ), "%lu", generation ) );
+        }
+        return result;
+    }
+    if ( fh != NULL && strcmp( name, kXAttrTypes ) == 0 )
+    {
+        return getFHtypes( fh, value );
+    }
+    if ( node != NULL && strcmp( name, kXAttrType ) == 0 )
+    {
+        return getTreeNodeType( node, value );
+    }
+    return -ENODATA;
 }
 
 /**
- * @brief Release an open file
- *
- * Release is called when there are no more references to an open file: all file descriptors
- * are closed and all memory mappings are unmapped.
- *
- * For every open() call there will be exactly one release() call with the same flags and
- * file handle.  It is possible to have a file opened more than once, in which case only
- * the last release will mean, that no more reads/writes will happen on the file.
- *
- * The return value of release is ignored.
+ * @brief reply to a getxattr or listxattr. A size of zero asks how big the value is.
+ * @param req
+ * @param value
+ * @param size  the most the caller can take
  */
-
-static int doRelease( const char * path, struct fuse_file_info * fi )
+static void replyXAttr( fuse_req_t req, const tBuffer * value, size_t size )
 {
-    int result = 0;
-
-    logDebug( "### op: release \'%s\' [%p]", path, fi );
-
-    tFileHandle * fh = fetchFH( fi, path );
-    if ( fh == NULL )
-        result = -ENOENT;
-    else {
-        result = parseFH( fh );
+    if ( size == 0 )
+    {
+        fuse_reply_xattr( req, value->length );
+    }
+    else if ( size < value->length )
+    {
+        fuse_reply_err( req, ERANGE );
+    }
+    else
+    {
+        fuse_reply_buf( req, value->data, value->length );
     }
-
-    return result;
 }
 
 /**
- * @brief Read data from an open file
+ * @brief Get an extended attribute
  *
- * Read should return exactly the number of bytes requested except on EOF or error,
- * otherwise the rest of the data will be substituted with zeroes. An exception to
- * this is when the 'direct_io' mount option is specified, in which case the return
- * value of the read system call will reflect the return value of this operation.
-**/
-
-static int doRead( const char *path,
-                   char *buffer,
-                   size_t size,
-                   off_t offset,
-                   struct fuse_file_info * fi )
+ * Every attribute is computed on demand, none can be set.
+ */
+static void doGetXAttr( fuse_req_t req, fuse_ino_t ino, const char * name, size_t size )
 {
-    (void)fi;
-
-    logDebug( "### op: read \'%s\' @%lu (%lu) [%p]\n", path, offset, size, fi );
+    timeOp( kStatGetXAttr );
 
-    ssize_t length = size;
+    logDebug( "### op: getxattr %lu \'%s\' (%lu)", ino, name, size );
 
-    tFileHandle * fh = fetchFH( fi, path );
-    if ( fh == NULL )
-        length = -ENOENT;
+    tBuffer value = { NULL, 0, 0 };
+    int result = getXAttr( ino, name, &value );
+    if ( result != 0 )
+    {
+        fuse_reply_err( req, -result );
+    }
     else
-        length = readFH( fh, buffer, size, offset );
-
-    return (int)length;
+    {
+        replyXAttr( req, &value, size );
+    }
+    free( value.data );
 }
 
 /**
- * @brief Write data to an open file
+ * @brief List extended attribute names
  *
- * Write should return exactly the number of bytes requested except on error.
- * An exception to this is when the 'direct_io' mount option is specified
- * (see read operation).
- *
- * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is expected to
- * reset the setuid and setgid bits.
-**/
-
-static int doWrite( const char * path,
-                    const char * buffer,
-                    size_t size,
-                    off_t offset,
-                    struct fuse_file_info * fi )
+ * The names are each followed by a null.
+ */
+static void doListXAttr( fuse_req_t req, fuse_ino_t ino, size_t size )
 {
-    (void)buffer;
+    timeOp( kStatListXAttr );
 
-    logDebug( "### op: write %s @%lu (%lu) [%p]", path, offset, size, fi );
+    logDebug( "### op: listxattr %lu (%lu)", ino, size );
 
-    tFileHandle * fh = fetchFH( fi, path );
-    if ( fh == NULL )
-        size = -ENOENT;
-    else {
-        // ToDo: check permissions
-        size = writeFH( fh, buffer, size, offset );
-    }
+    static const char kFileXAttrs[] = kXAttrETag "\0" kXAttrGeneration "\0" kXAttrTypes;
+    static const char kTreeXAttrs[] = kXAttrETag "\0" kXAttrGeneration "\0" kXAttrType;
 
-    return size;
+    tBuffer names = { NULL, 0, 0 };
+    tTreeNode * node = inodeTreeNode( ino );
+    if ( inodeFH( ino ) != NULL )
+    {
+        names.data   = (char *)kFileXAttrs;
+        names.length = sizeof( kFileXAttrs );
+    }
+    else if ( node != NULL && !isTreeDirectory( node ) )
+    {
+        names.data   = (char *)kTreeXAttrs;
+        names.length = sizeof( kTreeXAttrs );
+    }
+    replyXAttr( req, &names, size );
 }
 
 #ifdef DEBUG
@@ -465,7 +1589,7 @@ static int doWrite( const char * path,
  * the purpose of making what fuse is invoking that we don't have full implementations for.
  * This is only done in debug builds.
  *
- * The libfuse source code returns -ENOSYS if the operation handler is NULL, so behave the same way
+ * The libfuse source code replies with ENOSYS if the operation handler is NULL, so behave the same way
 **/
 
 /* temporarily turn off the 'unused parameter' warning, since these are only stubs and that is expected */
@@ -474,15 +1598,11 @@ static int doWrite( const char * path,
 
 /**
  * @brief Read the target of a symbolic link
- *
- * The buffer should be filled with a null terminated string. The buffer size argument
- * includes the space for the terminating null character. If the linkname is too long
- * to fit in the buffer, it should be truncated. The return value should be 0 for success.
  */
-int doReadLink( const char * path, char *, size_t )
+static void doReadLink( fuse_req_t req, fuse_ino_t ino )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
@@ -491,174 +1611,111 @@ int doReadLink( const char * path, char *, size_t )
  * This is called for creation of all non-directory, non-symlink nodes.  If the filesystem
  * defines a create() method, then for regular files that will be called instead.
  */
-int doMkNod( const char * path, mode_t mode, dev_t dev )
+static void doMkNod( fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode, dev_t rdev )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path);
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief  Create a directory
- *
- * Note that the mode argument may not have the type specification bits set, i.e.
- * S_ISDIR(mode) can be false.  To obtain the correct directory type bits use mode|S_IFDIR
  */
-int doMkDir( const char * path, mode_t mode )
+static void doMkDir( fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief  Remove a file
  */
-int doUnlink( const char * path )
+static void doUnlink( fuse_req_t req, fuse_ino_t parent, const char * name )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Remove a directory */
-int doRmDir( const char * path )
+/**
+ * @brief  Remove a directory
+ */
+static void doRmDir( fuse_req_t req, fuse_ino_t parent, const char * name )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Create a symbolic link */
-int doSymlink( const char * path, const char * )
+/**
+ * @brief  Create a symbolic link
+ */
+static void doSymlink( fuse_req_t req, const char * link, fuse_ino_t parent, const char * name )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Rename a file
+/**
+ * @brief  Rename a file
  *
  * *flags* may be `RENAME_EXCHANGE` or `RENAME_NOREPLACE`. If RENAME_NOREPLACE is specified,
  * the filesystem must not overwrite *newname* if it exists and return an error instead. If
  * `RENAME_EXCHANGE` is specified, the filesystem must atomically exchange the two files,
  * i.e. both must exist and neither may be deleted.
  */
-int doRename( const char * path, const char *, unsigned int flags )
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  Create a hard link to a file */
-int doLink( const char * path, const char * )
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  Change the permission bits of a file
- *
- * `fi` will always be NULL if the file is not currently open, but may also be NULL if the file is open.
- */
-int doChMod( const char * path, mode_t mode, struct fuse_file_info * fi )
+static void doRename( fuse_req_t req, fuse_ino_t parent, const char * name,
+                      fuse_ino_t newparent, const char * newname, unsigned int flags )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, name );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Change the owner and group of a file
- *
- * `fi` will always be NULL if the file is not currently open, but may also be NULL if the file is open.
- *
- * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is expected to reset the setuid and setgid bits.
+/**
+ * @brief  Create a hard link to a file
  */
-int doChOwn( const char * path, uid_t uid, gid_t gid, struct fuse_file_info *fi )
+static void doLink( fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char * newname )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s \'%s\'", __func__, newname );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Get file system statistics
+/**
+ * @brief  Get file system statistics
  *
  * The 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
  */
-int doStatFS( const char * path, struct statvfs * )
+static void doStatFS( fuse_req_t req, fuse_ino_t ino )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Possibly flush cached data
- *
- * BIG NOTE: This is not equivalent to fsync().  It's not a request to sync dirty data.
- *
- * Flush is called on each close() of a file descriptor, as opposed to release which is
- * called on the close of the last file descriptor for a file.  Under Linux, errors
- * returned by flush() will be passed to userspace as errors from close(), so flush()
- * is a good place to write back any cached dirty data. However, many applications
- * ignore errors on close(), and on non-Linux systems, close() may succeed even if
- * flush() returns an error. For these reasons, filesystems should not assume that
- * errors returned by flush will ever be noticed or even delivered.
- *
- * NOTE: The flush() method may be called more than once for each open().  This happens
- * more than one file descriptor refers to an open file handle, e.g. due to dup(),
- * dup2() or fork() calls.  It is not possible to determine if a flush is final, so
- * each flush should be treated equally.  Multiple write-flush sequences are relatively
- * rare, so this shouldn't be a problem.
- *
- * Filesystems shouldn't assume that flush will be called at any particular point.
- * It may be called more times than expected, or not at all.
- *
- * [close]: http://pubs.opengroup.org/onlinepubs/9699919799/functions/close.html
+/**
+ * @brief  Set extended attributes
  */
-int doFlush( const char * path, struct fuse_file_info * fi )
+static void doSetXAttr( fuse_req_t req, fuse_ino_t ino, const char * name, const char * value,
+                        size_t size, int flags )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Synchronize file contents
- *
- * If the datasync parameter is non-zero, then only the user data should be flushed, not the meta data.
+/**
+ * @brief  Remove extended attributes
  */
-int doFSync( const char * path, int, struct fuse_file_info * fi)
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  Set extended attributes */
-int doSetXAttr( const char * path, const char *, const char *, size_t, int )
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  Get extended attributes */
-int doGetXAttr( const char * path, const char *, char *, size_t )
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  List extended attributes */
-int doListXAttr( const char * path, char *, size_t )
+static void doRemoveXAttr( fuse_req_t req, fuse_ino_t ino, const char * name )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Remove extended attributes */
-int doRemoveXAttr( const char * path, const char * )
-{
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**\n * @brief  Synchronize directory contents
+/**
+ * @brief  Synchronize directory contents
  *
  * If the datasync parameter is non-zero, then only the user data should be flushed, not the meta data
  */
-int doFSyncDir( const char * path, int, struct fuse_file_info * fi )
+static void doFSyncDir( fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info * fi )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
@@ -666,64 +1723,34 @@ int doFSyncDir( const char * path, int, struct fuse_file_info * fi )
  *
  * This will be called for the access() system call.  If the 'default_permissions' mount option is given,
  * this method is not called.
- *
- * This method is not called under Linux kernel versions 2.4.x
 **/
-int doAccess( const char * path, int )
+static void doAccess( fuse_req_t req, fuse_ino_t ino, int mask )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
- * @brief Perform POSIX file locking operation
- *
- * The cmd argument will be either F_GETLK, F_SETLK or F_SETLKW.
- *
- * For the meaning of fields in 'struct flock' see the man page for fcntl(2).
- * The l_whence field will always be set to SEEK_SET.
- *
- * For checking lock ownership, the 'fuse_file_info->owner' argument must be used.
+ * @brief Test for a POSIX file lock
  *
- * For F_GETLK operation, the library will first check currently held locks, and
- * if a conflicting lock is found it will return information without calling this
- * method. This ensures, that for local locks the l_pid field is correctly filled
- * in. The results may not be accurate in case of race conditions and in the
- * presence of hard links, but it's unlikely that an application would rely on
- * accurate GETLK results in these cases.  If a conflicting lock is not found,
- * this method will be called, and the filesystem may fill out l_pid by a
- * meaningful value, or it may leave this field zero.
- *
- * For F_SETLK and F_SETLKW the l_pid field will be set to the pid of the process
- * performing the locking operation.
- *
- * Note: if this method is not implemented, the kernel will still allow file
- * locking to work locally.  Hence it is only interesting for network filesystems
+ * Note: if the locking methods are not implemented, the kernel will still allow file
+ * locking to work locally.  Hence they are only interesting for network filesystems
  * and similar.
 **/
-int doLock( const char * path,
-            struct fuse_file_info * fi,
-            int cmd,
-            struct flock * )
+static void doGetLk( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi, struct flock * lock )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
- * @brief Change the access and modification times of a file with nanosecond resolution
- *
- * This supersedes the old utime() interface. New applications should use this.
- *
- * `fi` will always be NULL if the file is not currently open, but may also be
- * NULL if the file is open.
- *
- * See the utimensat(2) man page for details.
+ * @brief Acquire, modify or release a POSIX file lock
  */
-int doUtimeNS( const char * path, const struct timespec tv[2], struct fuse_file_info * fi )
+static void doSetLk( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi, struct flock * lock,
+                     int sleep )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
@@ -732,83 +1759,44 @@ int doUtimeNS( const char * path, const struct timespec tv[2], struct fuse_file_
  * Note: This makes sense only for block device backed filesystems mounted
  * with the 'blkdev' option
  */
-int doBMap( const char * path, size_t blocksize, uint64_t * idx )
+static void doBMap( fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief Ioctl
  *
  * flags will have FUSE_IOCTL_COMPAT set for 32bit ioctls in 64bit environment.
- * The size and direction of data is determined by _IOC_*() decoding of cmd.
- * For _IOC_NONE, data will be NULL, for _IOC_WRITE data is out area, for
- * _IOC_READ in area and if both are set in/out area.  In all non-NULL cases,
- * the area is of _IOC_SIZE(cmd) bytes.
  *
  * If flags has FUSE_IOCTL_DIR then the fuse_file_info refers to a directory file handle.
- *
- * Note : the unsigned long request submitted by the application is truncated to 32 bits.
  */
-int doIoctl( const char * path,
-             unsigned int cmd,
-             void * arg,
-             struct fuse_file_info * fi,
-             unsigned int flags,
-             void *data )
+static void doIoctl( fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void * arg,
+                     struct fuse_file_info * fi, unsigned flags,
+                     const void * in_buf, size_t in_bufsz, size_t out_bufsz )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief Poll for IO readiness events
  *
- * Note: If ph is non-NULL, the client should notify when IO readiness events
- * occur by calling fuse_notify_poll() with the specified ph.
- *
- * Regardless of the number of times poll with a non-NULL ph is received, single
- * notification is enough to clear all. Notifying more times incurs overhead
- * but doesn't harm correctness.
- *
  * The callee is responsible for destroying ph with fuse_pollhandle_destroy()
  * when no longer in use.
  */
-int doPoll( const char * path,
-            struct fuse_file_info *,
-            struct fuse_pollhandle * ph,
-            unsigned * reventsp )
+static void doPoll( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi,
+                    struct fuse_pollhandle * ph )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    if ( ph != NULL )
+    {
+        fuse_pollhandle_destroy( ph );
+    }
+    fuse_reply_err( req, ENOSYS );
 }
 
-/**\n * @brief  Write contents of buffer to an open file
- *
- * Similar to the write() method, but data is supplied in a generic buffer. Use
- * fuse_buf_copy() to transfer data to the destination.
- *
- * Unless FUSE_CAP_HANDLE_KILLPRIV is disabled, this method is expected to reset
- * the setuid and setgid bits.
- *
- * NOTE: not implemented, since fuse will fall back to doWrite()
- */
-
-/**\n * @brief  Store data from an open file in a buffer
- *
- * Similar to the read() method, but data is stored and returned in a generic buffer.
- *
- * No actual copying of data has to take place, the source file descriptor may simply
- * be stored in the buffer for later data transfer.
- *
- * The buffer must be allocated dynamically and stored at the location pointed to by
- * bufp.  If the buffer contains memory regions, they too must be allocated using
- * malloc().  The allocated memory will be freed by the caller.
- *
- * NOTE: not implemented, since fuse will fall back to doRead()
- */
-
 /**
  * @brief Perform BSD file locking operation
  *
@@ -817,69 +1805,35 @@ int doPoll( const char * path,
  * Nonblocking requests will be indicated by ORing LOCK_NB to the above operations
  *
  * For more information see the flock(2) manual page.
- *
- * Additionally fi->owner will be set to a value unique to this open file. This same
- * value will be supplied to ->release() when the file is released.
- *
- * Note: if this method is not implemented, the kernel will still allow file locking
- * to work locally.  Hence it is only interesting for network filesystems and similar.
- */
-int doFLock( const char * path,
-             struct fuse_file_info * fi,
-             int op )
-{
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
-}
-
-/**
- * @brief Allocates space for an open file
- *
- * This function ensures that required space is allocated for specified file. If
- * this function returns success then any subsequent write request to specified
- * range is guaranteed not to fail because of lack of space on the file system media.
  */
-int doFAllocate( const char * path,
-                 int ,
-                 off_t offset,
-                 off_t ,
-                 struct fuse_file_info * fi )
+static void doFLock( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi, int op )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return -ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief Copy a range of data from one file to another
  *
- * Performs an optimized copy between two file descriptors without the additional
- * cost of transferring data through the FUSE kernel module to user space (glibc)
- * and then back into the FUSE filesystem again.
- *
  * In case this method is not implemented, applications are expected to fall back
- * to a regular file copy.   (Some glibc versions did this emulation automatically,
- * but the emulation has been removed from all glibc release branches.)
+ * to a regular file copy.
 **/
-ssize_t doCopyFileRange( const char * path_in,
-                         struct fuse_file_info * fi_in,
-                         off_t offset_in,
-                         const char * path_out,
-                         struct fuse_file_info * fi_out,
-                         off_t offset_out,
-                         size_t size,
-                         int flags )
+static void doCopyFileRange( fuse_req_t req,
+                             fuse_ino_t ino_in, off_t off_in, struct fuse_file_info * fi_in,
+                             fuse_ino_t ino_out, off_t off_out, struct fuse_file_info * fi_out,
+                             size_t len, int flags )
 {
-    logDebug( "--- nop: %s \'%s\'", __func__, path_in );
-	return (ssize_t)-ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino_in );
+    fuse_reply_err( req, ENOSYS );
 }
 
 /**
  * @brief Find next data or hole after the specified offset
  */
-off_t doLSeek( const char * path, off_t offset, int whence, struct fuse_file_info * fi )
+static void doLSeek( fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info * fi )
 {
-	logDebug( "--- nop: %s \'%s\'", __func__, path );
-	return (off_t)-ENOSYS;
+    logDebug( "--- nop: %s %lu", __func__, ino );
+    fuse_reply_err( req, ENOSYS );
 }
 
 #pragma GCC diagnostic pop
@@ -889,9 +1843,13 @@ off_t doLSeek( const char * path, off_t offset, int whence, struct fuse_file_inf
  * * * * * * * * * Startup * * * * * * * * *
  * * * * * * * * * * * * * * * * * * * * * */
 
-static struct fuse_operations operations = {
+static const struct fuse_lowlevel_ops operations = {
      /* hierarchy navigation */
+    .lookup          = doLookup,
+    .forget          = doForget,
+    .forget_multi    = doForgetMulti,
     .getattr         = doGetAttr,
+    .setattr         = doSetAttr,
 
      /* fuse operations */
     .init            = doInit,
@@ -905,10 +1863,16 @@ static struct fuse_operations operations = {
      /* file operations */
     .create          = doCreate,
     .open            = doOpen,
-    .truncate        = doTruncate,
     .release         = doRelease,
     .read            = doRead,
-    .write           = doWrite,
+    .write_buf       = doWriteBuf,
+    .fallocate       = doFAllocate,
+    .flush           = doFlush,
+    .fsync           = doFSync,
+
+     /* extended attributes */
+    .getxattr        = doGetXAttr,
+    .listxattr       = doListXAttr,
 
 #ifdef DEBUG
     .readlink        = doReadLink,
@@ -919,34 +1883,101 @@ static struct fuse_operations operations = {
     .symlink         = doSymlink,
     .rename          = doRename,
     .link            = doLink,
-    .chmod           = doChMod,
-    .chown           = doChOwn,
     .statfs          = doStatFS,
-    .flush           = doFlush,
-    .fsync           = doFSync,
     .setxattr        = doSetXAttr,
-    .getxattr        = doGetXAttr,
-    .listxattr       = doListXAttr,
     .removexattr     = doRemoveXAttr,
     .fsyncdir        = doFSyncDir,
     .access          = doAccess,
-    .lock            = doLock,
-    .utimens         = doUtimeNS,
+    .getlk           = doGetLk,
+    .setlk           = doSetLk,
     .bmap            = doBMap,
-	.ioctl           = doIoctl,
+    .ioctl           = doIoctl,
     .poll            = doPoll,
-     // .write_buf   * NOTE: omitted intentionally. In its absence, fuse will fall back to doWrite()
-     // .read_buf    * NOTE: omitted intentionally. In its absence, fuse will fall back to doRead()
     .flock           = doFLock,
-    .fallocate       = doFAllocate,
     .copy_file_range = doCopyFileRange,
     .lseek           = doLSeek,
 #endif
 };
 
+/**
+ * @brief make a path given on the command line absolute, as fuse_daemonize() changes the
+ * working directory to / before it's used
+ * @param path  replaced with the absolute path, if it isn't already
+ * @return 0 on success, or -ENOMEM
+ */
+static int makePathAbsolute( char ** path )
+{
+    if ( *path == NULL || **path == '/' )
+    {
+        return 0;
+    }
+
+    char * cwd = get_current_dir_name();
+    char * absolute = NULL;
+    if ( cwd == NULL || asprintf( &absolute, "%s/%s", cwd, *path ) < 0 )
+    {
+        logError( "unable to make \'%s\' absolute", *path );
+        free( cwd );
+        return -ENOMEM;
+    }
+    free( cwd );
+
+    free( *path );
+    *path = absolute;
+    return 0;
+}
+
+/**
+ * @brief mount the filesystem, and serve requests until it's unmounted.
+ * This is what fuse_main() does for the high-level API.
+ * @param args
+ * @param opts
+ * @return the exit status
+ */
+static int runSession( struct fuse_args * args, struct fuse_cmdline_opts * opts )
+{
+    int result = 1;
+
+    gSession = fuse_session_new( args, &operations, sizeof( operations ), NULL );
+    if ( gSession == NULL )
+    {
+        logError( "unable to create the fuse session" );
+        return result;
+    }
+
+    if ( fuse_set_signal_handlers( gSession ) == 0 )
+    {
+        if ( fuse_session_mount( gSession, opts->mountpoint ) == 0 )
+        {
+            fuse_daemonize( opts->foreground );
+
+            if ( opts->singlethread )
+            {
+                result = fuse_session_loop( gSession );
+            }
+            else
+            {
+                struct fuse_loop_config config = {
+                    .clone_fd         = opts->clone_fd,
+                    .max_idle_threads = opts->max_idle_threads
+                };
+                result = fuse_session_loop_mt( gSession, &config );
+            }
+
+            fuse_session_unmount( gSession );
+        }
+        fuse_remove_signal_handlers( gSession );
+    }
+
+    fuse_session_destroy( gSession );
+    gSession = NULL;
+
+    return ( result == 0 ) ? 0 : 1;
+}
+
 int main( int argc, char *argv[] )
 {
-    int result;
+    int result = 0;
 
     char * executableName = strrchr( argv[0], '/' );
     if ( executableName++ == NULL )
@@ -957,38 +1988,52 @@ int main( int argc, char *argv[] )
     initLogStuff( executableName );
     setLogStuffDestination( kLogDebug, kLogToSyslog, kLogNormal );
 
-    char * mountPointPath;
-    for ( int i = 1; i < argc; ++i )
+    struct fuse_args args = FUSE_ARGS_INIT( argc, argv );
+    /* pick out our own options, the rest are passed through to fuse */
+    if ( fuse_opt_parse( &args, &gOptions, kOptionSpec, NULL ) == -1 )
     {
-        if ( argv[i][0] == '-' )
-        {
-            switch ( argv[i][1] )
-            {
-            case '-': /* long option */
-                logDebug( "long option: %d: %s", i, argv[i] );
-                break;
-
-            case 'd':
-            case 'o': /* option ia followed by a parameter */
-                logDebug( "option: %d: %s %s", i, argv[i], argv[i+1]);
-                ++i; /* swallow the parameter */
-                break;
-
-            default:
-                break;
-            }
-        }
-        else
-        {
-            mountPointPath = argv[i];
-            logDebug( "path: %2d: \'%s\'\n", i, mountPointPath );
-        }
+        logError( "unable to parse the options" );
+        return 1;
+    }
+
+    struct fuse_cmdline_opts opts;
+    if ( fuse_parse_cmdline( &args, &opts ) != 0 )
+    {
+        logError( "unable to parse the command line" );
+        fuse_opt_free_args( &args );
+        return 1;
+    }
+
+    if ( opts.show_help )
+    {
+        printf( "usage: %s [options] <mountpoint>\n\n", executableName );
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+    }
+    else if ( opts.show_version )
+    {
+        printf( "FUSE library version %s\n", fuse_pkgversion() );
+        fuse_lowlevel_version();
+    }
+    else if ( opts.mountpoint == NULL )
+    {
+        fprintf( stderr, "usage: %s [options] <mountpoint>\n", executableName );
+        result = 2;
+    }
+    else if ( makePathAbsolute( &gOptions.traceFile ) != 0 || makePathAbsolute( &gOptions.profileFile ) != 0 )
+    {
+        result = 1;
     }
+    else
+    {
+        fprintf( stderr, "starting %s mounted on %s\n", executableName, opts.mountpoint );
+        logInfo( "starting %s mounted on %s ", executableName, opts.mountpoint );
 
-    fprintf(stderr, "starting %s mounted on %s\n", executableName, mountPointPath );
-    logInfo( "starting %s mounted on %s ", executableName, mountPointPath );
+        result = runSession( &args, &opts );
+    }
 
-    result = fuse_main( argc, argv, &operations, NULL );
+    free( opts.mountpoint );
+    fuse_opt_free_args( &args );
 
     return result;
 }
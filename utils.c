@@ -4,15 +4,19 @@
 
 #define _GNU_SOURCE
 
+#include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <fcntl.h>
 
 #include "utils.h"
 #include "logStuff.h"
 
 /**
- * @brief
+ * @brief a quick hash, good enough to spread keys over a hash table. Short strings that
+ * differ collide easily, so don't rely on it to tell contents apart, see hashBytes()
  * @param string
  * @return
  */
@@ -29,72 +33,336 @@ tHash hashString( const char * string )
     return hash;
 }
 
+/* the primes from XXH64 */
+#define kPrime64_1  0x9E3779B185EBCA87UL
+#define kPrime64_2  0xC2B2AE3D27D4EB4FUL
+#define kPrime64_3  0x165667B19E3779F9UL
+#define kPrime64_4  0x85EBCA77C2B2AE63UL
+#define kPrime64_5  0x27D4EB2F165667C5UL
+
+static uint64_t rotl64( uint64_t x, int r )
+{
+    return ( x << r ) | ( x >> (64 - r) );
+}
+
+/* little-endian, whatever the host is, so a hash doesn't depend on where it was computed */
+static uint64_t readLE( const byte * p, int bytes )
+{
+    uint64_t v = 0;
+    for ( int i = bytes - 1; i >= 0; --i )
+    {
+        v = ( v << 8 ) | p[i];
+    }
+    return v;
+}
+
+static uint64_t xxh64Round( uint64_t acc, uint64_t input )
+{
+    acc += input * kPrime64_2;
+    acc  = rotl64( acc, 31 );
+    return acc * kPrime64_1;
+}
+
+static uint64_t xxh64Merge( uint64_t acc, uint64_t v )
+{
+    acc ^= xxh64Round( 0, v );
+    return acc * kPrime64_1 + kPrime64_4;
+}
+
 /**
- * @brief
- * @param keyName
- * @param append
+ * @brief a 64-bit hash (XXH64) of a block of bytes, seeded with hash so a hash can be
+ * continued over several blocks. Unlike hashString(), every input bit affects every output
+ * bit, so different contents only collide by chance (about 1 in 2^64). It's not a
+ * cryptographic digest though: it won't stand up to someone crafting a collision on purpose.
+ * It's 64 bits wide on every target, unlike tHash.
+ * @param hash    the seed, e.g. 0, or the hash of the preceding block
+ * @param bytes
+ * @param length
  * @return
  */
-char * appendKeyName( char * keyName, const char * append )
+uint64_t hashBytes( uint64_t hash, const void * bytes, size_t length )
 {
-    size_t len = strlen( append ) + 1;
-    if ( keyName == NULL )
+    const byte * p   = bytes;
+    const byte * end = p + length;
+    uint64_t     seed = hash;
+    uint64_t     h;
+
+    if ( length >= 32 )
     {
-        keyName = malloc( len );
-        keyName[0] = '/';
-        memcpy( &keyName[1], append, len );
-        keyName[len + 1] = '\0';
+        uint64_t v1 = seed + kPrime64_1 + kPrime64_2;
+        uint64_t v2 = seed + kPrime64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime64_1;
+
+        do {
+            v1 = xxh64Round( v1, readLE( p,      8 ) );
+            v2 = xxh64Round( v2, readLE( p + 8,  8 ) );
+            v3 = xxh64Round( v3, readLE( p + 16, 8 ) );
+            v4 = xxh64Round( v4, readLE( p + 24, 8 ) );
+            p += 32;
+        } while ( end - p >= 32 );
+
+        h = rotl64( v1, 1 ) + rotl64( v2, 7 ) + rotl64( v3, 12 ) + rotl64( v4, 18 );
+        h = xxh64Merge( h, v1 );
+        h = xxh64Merge( h, v2 );
+        h = xxh64Merge( h, v3 );
+        h = xxh64Merge( h, v4 );
     }
     else
     {
-        size_t stemLen = strlen( keyName );
-        keyName = realloc( keyName, stemLen + len + 1 + 1 );
-        keyName[stemLen++] = '/';
-        memcpy( &keyName[stemLen], append, len );
-        keyName[stemLen + len ] = '\0';
+        h = seed + kPrime64_5;
     }
-    return keyName;
+
+    h += length;
+
+    while ( end - p >= 8 )
+    {
+        h ^= xxh64Round( 0, readLE( p, 8 ) );
+        h  = rotl64( h, 27 ) * kPrime64_1 + kPrime64_4;
+        p += 8;
+    }
+    if ( end - p >= 4 )
+    {
+        h ^= readLE( p, 4 ) * kPrime64_1;
+        h  = rotl64( h, 23 ) * kPrime64_2 + kPrime64_3;
+        p += 4;
+    }
+    while ( p < end )
+    {
+        h ^= *p++ * kPrime64_5;
+        h  = rotl64( h, 11 ) * kPrime64_1;
+    }
+
+    /* avalanche */
+    h ^= h >> 33;
+    h *= kPrime64_2;
+    h ^= h >> 29;
+    h *= kPrime64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * @brief make sure there's room for at least 'extra' more bytes in the buffer. The
+ * capacity grows geometrically, so appending n bytes piecemeal costs O(n) overall.
+ * @param buffer
+ * @param extra
+ * @return 0 on success, or -ENOMEM
+ */
+int reserveBuffer( tBuffer * buffer, size_t extra )
+{
+    size_t needed = buffer->length + extra;
+    if ( needed > buffer->capacity || buffer->data == NULL )
+    {
+        size_t capacity = ( buffer->capacity < 256 ) ? 256 : buffer->capacity;
+        while ( capacity < needed )
+        {
+            capacity *= 2;
+        }
+
+        char * data = realloc( buffer->data, capacity );
+        if ( data == NULL )
+        {
+            logError( "unable to grow buffer to %lu bytes", capacity );
+            return -ENOMEM;
+        }
+        buffer->data     = data;
+        buffer->capacity = capacity;
+    }
+    return 0;
 }
 
 /**
  * @brief
- * @param keyName
- * @return
+ * @param buffer
+ * @param data
+ * @param length
+ * @return 0 on success, or -ENOMEM
+ */
+int appendToBuffer( tBuffer * buffer, const void * data, size_t length )
+{
+    int result = reserveBuffer( buffer, length );
+    if ( result == 0 )
+    {
+        memcpy( &buffer->data[ buffer->length ], data, length );
+        buffer->length += length;
+    }
+    return result;
+}
+
+/**
+ * @brief set the length of the buffer, growing the allocation geometrically if needed.
+ * Any bytes added at the end are zeroed, shrinking keeps the allocation for reuse.
+ * @param buffer
+ * @param length
+ * @return 0 on success, or -ENOMEM
+ */
+int resizeBuffer( tBuffer * buffer, size_t length )
+{
+    int result = 0;
+    if ( length > buffer->length )
+    {
+        result = reserveBuffer( buffer, length - buffer->length );
+        if ( result == 0 )
+        {
+            memset( &buffer->data[ buffer->length ], 0, length - buffer->length );
+        }
+    }
+    if ( result == 0 )
+    {
+        buffer->length = length;
+    }
+    return result;
+}
+
+/**
+ * @brief append an ETag for a block of contents: its length and a 64-bit hash of it, quoted
+ * as in HTTP, e.g. "52-6f1c03a2b9d4e817" for 82 bytes. Changed contents get a different tag
+ * unless they collide by chance (see hashBytes()), which is not proof against deliberate tampering.
+ * @param buffer
+ * @param data
+ * @param length
+ * @return 0 on success, or -ENOMEM
+ */
+int appendETag( tBuffer * buffer, const void * data, size_t length )
+{
+    char etag[48];
+    int  etagLen = snprintf( etag, sizeof( etag ), "\"%lx-%016" PRIx64 "\"",
+                             (unsigned long)length, hashBytes( 0, data, length ) );
+    return appendToBuffer( buffer, etag, etagLen );
+}
+
+/**
+ * @brief start a key path at root, reusing whatever buffer the path already has
+ * @param path
+ * @param root  e.g. "system:/config"
+ * @return 0 on success, or -ENOMEM
+ */
+int initKeyPath( tKeyPath * path, const char * root )
+{
+    path->name.length = 0;
+    path->depth = 0;
+
+    size_t rootLen = strlen( root );
+    int result = reserveBuffer( &path->name, rootLen + 1 );
+    if ( result == 0 )
+    {
+        memcpy( path->name.data, root, rootLen + 1 );
+        path->name.length = rootLen;
+    }
+    return result;
+}
+
+/**
+ * @brief append '/' and segment to the path. Only allocates if the buffer has to grow.
+ * @param path
+ * @param segment
+ * @return 0 on success, -E2BIG if the path is too deep, or -ENOMEM
  */
-char * trimKey( char * keyName )
+int pushKeyPath( tKeyPath * path, const char * segment )
 {
-    char * lastSlash = strrchr( keyName, '/' );
-    if ( lastSlash != NULL )
+    if ( path->depth >= kMaxKeyPathDepth )
+    {
+        logError( "key '%s' is too deep to append '%s'", path->name.data, segment );
+        return -E2BIG;
+    }
+
+    size_t segmentLen = strlen( segment );
+    int result = reserveBuffer( &path->name, 1 + segmentLen + 1 );
+    if ( result == 0 )
     {
-        *lastSlash = '\0';
+        path->segment[ path->depth++ ] = path->name.length;
+
+        char * end = &path->name.data[ path->name.length ];
+        *end++ = '/';
+        memcpy( end, segment, segmentLen + 1 );
+        path->name.length += 1 + segmentLen;
     }
-    return keyName;
+    return result;
+}
+
+/**
+ * @brief remove the most recently pushed segment
+ * @param path
+ */
+void popKeyPath( tKeyPath * path )
+{
+    if ( path->depth > 0 )
+    {
+        path->name.length = path->segment[ --path->depth ];
+        path->name.data[ path->name.length ] = '\0';
+    }
+}
+
+/**
+ * @brief swap the namespace of the path (the part before the first ':', e.g.
+ * "system") for newSpace. The pushed segments are unaffected, so can still be popped.
+ * @param path
+ * @param newSpace e.g. "user"
+ * @return 0 on success, or -ENOMEM
+ */
+int replaceKeyPathSpace( tKeyPath * path, const char * newSpace )
+{
+    char * name = path->name.data;
+
+    /* without a namespace, the name starts at the first '/' */
+    size_t oldLen = strcspn( name, ":/" );
+    size_t skip   = ( name[oldLen] == ':' ) ? oldLen + 1 : 0;
+    size_t newLen = strlen( newSpace ) + 1;
+
+    if ( newLen > skip )
+    {
+        /* the memmove below carries the nul along, so leave room for it too */
+        int result = reserveBuffer( &path->name, newLen - skip + 1 );
+        if ( result != 0 )
+        {
+            return result;
+        }
+        name = path->name.data;
+    }
+
+    memmove( &name[newLen], &name[skip], path->name.length - skip + 1 );
+    memcpy( name, newSpace, newLen - 1 );
+    name[newLen - 1] = ':';
+
+    path->name.length = path->name.length - skip + newLen;
+    for ( size_t i = 0; i < path->depth; ++i )
+    {
+        path->segment[i] = path->segment[i] - skip + newLen;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief
+ * @param path
+ */
+void freeKeyPath( tKeyPath * path )
+{
+    free( path->name.data );
+    path->name = (tBuffer){ NULL, 0, 0 };
+    path->depth = 0;
 }
 
 /**
  * @brief
  * @param keyName
  * @param newSpace
- * @return
+ * @return a copy of keyName in newSpace, which the caller must free
  */
 char * replaceKeySpace( const char * keyName, const char * newSpace )
 {
-    char * result;
+    tKeyPath path = { { NULL, 0, 0 }, 0, { 0 } };
 
-    const char * p = strchr( keyName, '/');
-    if ( p == NULL )
+    if ( initKeyPath( &path, keyName ) != 0 || replaceKeyPathSpace( &path, newSpace ) != 0 )
     {
-        p = keyName;
+        freeKeyPath( &path );
+        return NULL;
     }
-    size_t keyLen   = strlen( p );
-    size_t spaceLen = strlen( newSpace );
-    size_t newLen   = spaceLen + keyLen + sizeof(':') + sizeof('\0');
-    result = calloc( 1, newLen );
-    strncpy( result, newSpace, newLen );
-    result[ spaceLen++ ] = ':';
-    strncpy( &result[ spaceLen ], p, newLen - spaceLen );
-
-    return result;
+    /* hand the buffer over to the caller */
+    return path.name.data;
 }
 
 /**
@@ -123,11 +391,12 @@ char * appendStr( char * p, long remaining, const char * flagName )
 /**
  * @brief
  * @param flags
- * @return
+ * @return a per-thread buffer, so fuse worker threads can log concurrently.
+ *         It is overwritten by the next call from the same thread.
  */
 const char * openFlagsAsStr( int flags )
 {
-    static char temp[1024];
+    static __thread char temp[1024];
     temp[0] = '\0';
     temp[1] = '\0';
     char * p = temp;
@@ -162,11 +431,12 @@ const char * openFlagsAsStr( int flags )
 /**
  * @brief
  * @param mode
- * @return
+ * @return a per-thread buffer, so fuse worker threads can log concurrently.
+ *         It is overwritten by the next call from the same thread.
  */
 const char * createModeAsStr( unsigned int mode )
 {
-    static char temp[10];
+    static __thread char temp[10];
 
     memset( temp, '-', 9 );
     temp[9] = '\0';
@@ -5,12 +5,43 @@
 #ifndef UCIFS_UTILS_H
 #define UCIFS_UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef unsigned char byte;
-typedef unsigned long tHash;
+typedef unsigned long tHash;    // for hash tables only, see hashString(). Just 32 bits on ILP32 targets
+
+typedef struct {
+    char *  data;
+    size_t  length;     // bytes in use
+    size_t  capacity;   // bytes allocated
+} tBuffer;
+
+/* deep enough for {namespace}:/config/{package}/{type}/#{n}/{list}/#{n}, with plenty to spare */
+#define kMaxKeyPathDepth    16
+
+/* builds up a key name one segment at a time. Tracks its length and where each segment
+ * starts, so pushing and popping segments don't need to scan the name, or allocate */
+typedef struct {
+    tBuffer name;                               // always NUL-terminated, length excludes the NUL
+    size_t  depth;                              // number of segments pushed
+    size_t  segment[ kMaxKeyPathDepth ];        // name.length before each push
+} tKeyPath;
+
+#define keyPathName( path )    ( (const char *)(path)->name.data )
 
 tHash hashString( const char * string );
-char * appendKeyName( char * keyName, const char * append );
-char * trimKey( char * keyName );
+uint64_t hashBytes( uint64_t hash, const void * bytes, size_t length );
+int reserveBuffer( tBuffer * buffer, size_t extra );
+int appendToBuffer( tBuffer * buffer, const void * data, size_t length );
+int resizeBuffer( tBuffer * buffer, size_t length );
+int appendETag( tBuffer * buffer, const void * data, size_t length );
+
+int  initKeyPath( tKeyPath * path, const char * root );
+int  pushKeyPath( tKeyPath * path, const char * segment );
+void popKeyPath( tKeyPath * path );
+int  replaceKeyPathSpace( tKeyPath * path, const char * newSpace );
+void freeKeyPath( tKeyPath * path );
 char * replaceKeySpace( const char * keyName, const char * newSpace );
 
 const char * openFlagsAsStr( int flags );
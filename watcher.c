@@ -0,0 +1,526 @@
+//
+// Watches the files libelektra stores system:/config in, so the root directory
+// only needs to be rebuilt when (and where) the backend actually changes.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#define FUSE_USE_VERSION 35
+#include <fuse3/fuse_lowlevel.h>
+
+#include <elektra.h>
+
+#include "logStuff.h"
+#include "utils.h"
+#include "watcher.h"
+#include "stats.h"
+
+/* where the system namespace is stored by default, used if libelektra doesn't tell us */
+#define kDefaultStorageDir  "/etc/kdb"
+/* once an event arrives, wait until the storage has been quiet for this long before rescanning */
+#define kSettleMillis       50
+
+static const char kConfigRoot[] = "system:/config";
+
+typedef struct sPackageSig {
+    char *              path;           // as it appears in the root dir, e.g. "/network"
+    uint64_t            signature;      // hash of every key, value and metadata in the package
+} tPackageSig;
+
+typedef struct sChange {
+    struct sChange *    next;
+    char *              path;
+    tBool               removed;
+} tChange;
+
+typedef struct sWatcher {
+    struct fuse_session * session;
+    pthread_t           thread;
+    int                 inotifyFd;
+    int                 stopFd;         // an eventfd, written to ask the thread to exit
+    char *              storageName;    // basename of the file backing system:/config, or NULL to match any
+    KDB *               kdb;
+    Key *               parent;
+    KeySet *            keySet;
+    tPackageSig *       packages;       // sorted by path
+    size_t              packageCount;
+    pthread_mutex_t     lock;           // protects the queue of changes
+    tChange *           changes;
+    tChange **          lastChange;
+} tWatcher;
+
+
+/**
+ * @brief
+ * @param a
+ * @param b
+ * @return
+ */
+static int comparePackageSigs( const void * a, const void * b )
+{
+    return strcmp( ((const tPackageSig *)a)->path, ((const tPackageSig *)b)->path );
+}
+
+/**
+ * @brief
+ * @param packages
+ * @param count
+ */
+static void freePackageSigs( tPackageSig * packages, size_t count )
+{
+    for ( size_t i = 0; i < count; ++i )
+    {
+        free( packages[i].path );
+    }
+    free( packages );
+}
+
+/**
+ * @brief fold one key (its name, value and metadata) into a package signature
+ * @param signature
+ * @param key
+ * @return
+ */
+static uint64_t signKey( uint64_t signature, Key * key )
+{
+    signature = hashBytes( signature, keyName( key ), keyGetNameSize( key ) );
+    signature = hashBytes( signature, keyValue( key ), keyGetValueSize( key ) );
+
+    KeySet * metaKeys = keyMeta( key );
+    for ( elektraCursor it = 0; it < ksGetSize( metaKeys ); ++it )
+    {
+        Key * meta = ksAtCursor( metaKeys, it );
+        signature = hashBytes( signature, keyName( meta ), keyGetNameSize( meta ) );
+        signature = hashBytes( signature, keyValue( meta ), keyGetValueSize( meta ) );
+    }
+    return signature;
+}
+
+/**
+ * @brief fetch system:/config and reduce each package in it to a signature
+ * @param watcher
+ * @param packages  receives a sorted array of signatures
+ * @param count     receives the number of entries in packages
+ * @return 0 on success, or a negative errno
+ */
+static int signPackages( tWatcher * watcher, tPackageSig ** packages, size_t * count )
+{
+    countStat( kStatElektraGets, 1 );
+    if ( kdbGet( watcher->kdb, watcher->keySet, watcher->parent ) < 0 )
+    {
+        logError( "unable to fetch %s from libelektra", kConfigRoot );
+        return -EIO;
+    }
+
+    size_t        used     = 0;
+    size_t        capacity = 16;
+    tPackageSig * result   = malloc( capacity * sizeof( tPackageSig ) );
+    if ( result == NULL )
+    {
+        return -ENOMEM;
+    }
+
+    const size_t prefixLen = sizeof( kConfigRoot ) - 1;
+    for ( elektraCursor it = 0; it < ksGetSize( watcher->keySet ); ++it )
+    {
+        Key *        key  = ksAtCursor( watcher->keySet, it );
+        const char * name = keyName( key );
+
+        /* only keys below system:/config/ belong to a package */
+        if ( strncmp( name, kConfigRoot, prefixLen ) != 0 || name[prefixLen] != '/' )
+        {
+            continue;
+        }
+        const char * package = &name[prefixLen];  // includes the leading '/'
+        size_t packageLen = strcspn( package + 1, "/" ) + 1;
+
+        /* the KeySet is sorted, so all the keys of a package are adjacent */
+        if ( used == 0
+          || strncmp( result[used - 1].path, package, packageLen ) != 0
+          || result[used - 1].path[packageLen] != '\0' )
+        {
+            if ( used == capacity )
+            {
+                tPackageSig * grown = realloc( result, 2 * capacity * sizeof( tPackageSig ) );
+                if ( grown == NULL )
+                {
+                    freePackageSigs( result, used );
+                    return -ENOMEM;
+                }
+                result = grown;
+                capacity *= 2;
+            }
+            result[used].path      = strndup( package, packageLen );
+            result[used].signature = hashBytes( 0, result[used].path, packageLen );
+            ++used;
+        }
+        result[used - 1].signature = signKey( result[used - 1].signature, key );
+    }
+
+    qsort( result, used, sizeof( tPackageSig ), comparePackageSigs );
+
+    *packages = result;
+    *count    = used;
+    return 0;
+}
+
+/**
+ * @brief add a package to the queue of changes waiting for populateRoot(), and
+ * tell the kernel to drop whatever it has cached for it
+ * @param watcher
+ * @param path
+ * @param removed
+ */
+static void queueChange( tWatcher * watcher, const char * path, tBool removed )
+{
+    logDebug( "%s \'%s\'", removed ? "removed" : "changed", path );
+
+    tChange * change = calloc( 1, sizeof( tChange ) );
+    if ( change != NULL )
+    {
+        change->path    = strdup( path );
+        change->removed = removed;
+
+        pthread_mutex_lock( &watcher->lock );
+        *watcher->lastChange = change;
+        watcher->lastChange  = &change->next;
+        pthread_mutex_unlock( &watcher->lock );
+    }
+
+    if ( watcher->session != NULL && path[0] == '/' )
+    {
+        /* drop the kernel's dentry, so the next lookup picks up the new attributes. A cached
+         * page of contents is dealt with at open, which only keeps it if it's still current */
+        fuse_lowlevel_notify_inval_entry( watcher->session, FUSE_ROOT_ID, &path[1], strlen( &path[1] ) );
+    }
+}
+
+/**
+ * @brief compare the backend against the signatures taken last time, and queue
+ * up the packages that have been added, removed or modified since then.
+ * @param watcher
+ * @param report  if no, just take the signatures (i.e. the initial scan)
+ */
+static void rescanPackages( tWatcher * watcher, tBool report )
+{
+    tPackageSig * packages;
+    size_t        count;
+
+    if ( signPackages( watcher, &packages, &count ) != 0 )
+    {
+        return;
+    }
+
+    if ( report )
+    {
+        tBool  membershipChanged = no;
+        size_t o = 0;
+        size_t n = 0;
+
+        /* both arrays are sorted, so a single merge pass finds every difference */
+        while ( o < watcher->packageCount || n < count )
+        {
+            int cmp;
+            if ( o == watcher->packageCount )
+                cmp = 1;
+            else if ( n == count )
+                cmp = -1;
+            else
+                cmp = strcmp( watcher->packages[o].path, packages[n].path );
+
+            if ( cmp < 0 )
+            {
+                queueChange( watcher, watcher->packages[o++].path, yes );
+                membershipChanged = yes;
+            }
+            else if ( cmp > 0 )
+            {
+                queueChange( watcher, packages[n++].path, no );
+                membershipChanged = yes;
+            }
+            else
+            {
+                if ( watcher->packages[o].signature != packages[n].signature )
+                {
+                    queueChange( watcher, packages[n].path, no );
+                }
+                ++o;
+                ++n;
+            }
+        }
+
+        if ( membershipChanged && watcher->session != NULL )
+        {
+            fuse_lowlevel_notify_inval_inode( watcher->session, FUSE_ROOT_ID, 0, 0 );
+        }
+    }
+
+    freePackageSigs( watcher->packages, watcher->packageCount );
+    watcher->packages     = packages;
+    watcher->packageCount = count;
+}
+
+/**
+ * @brief drain the pending inotify events
+ * @param watcher
+ * @return yes if any of them concern the backend's storage file
+ */
+static tBool readEvents( tWatcher * watcher )
+{
+    tBool relevant = no;
+    char  buffer[4096] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+
+    ssize_t len;
+    while ( (len = read( watcher->inotifyFd, buffer, sizeof( buffer ) )) > 0 )
+    {
+        const struct inotify_event * event;
+        for ( char * p = buffer; p < &buffer[len]; p += sizeof( struct inotify_event ) + event->len )
+        {
+            event = (const struct inotify_event *)p;
+            if ( event->mask & IN_Q_OVERFLOW
+              || watcher->storageName == NULL
+              || ( event->len > 0 && strcmp( event->name, watcher->storageName ) == 0 ) )
+            {
+                relevant = yes;
+            }
+        }
+    }
+    return relevant;
+}
+
+/**
+ * @brief
+ * @param arg
+ * @return
+ */
+static void * watcherThread( void * arg )
+{
+    tWatcher * watcher = (tWatcher *)arg;
+
+    struct pollfd fds[2] = {
+        { .fd = watcher->inotifyFd, .events = POLLIN },
+        { .fd = watcher->stopFd,    .events = POLLIN }
+    };
+
+    tBool running = yes;
+    while ( running )
+    {
+        /* wait for a relevant event, then for the storage to settle, as libelektra
+         * writes a temporary file and renames it, and editors often save in bursts */
+        tBool pending = no;
+        for (;;)
+        {
+            int count = poll( fds, 2, pending ? kSettleMillis : -1 );
+            if ( count < 0 )
+            {
+                if ( errno == EINTR )
+                    continue;
+                logError( "watcher poll failed" );
+                running = no;
+                break;
+            }
+            if ( count == 0 || fds[1].revents != 0 )
+            {
+                /* either it's gone quiet, or we've been asked to stop */
+                running = ( fds[1].revents == 0 );
+                break;
+            }
+            if ( fds[0].revents & POLLIN )
+            {
+                pending |= readEvents( watcher );
+            }
+        }
+
+        if ( running && pending )
+        {
+            rescanPackages( watcher, yes );
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief start watching the storage behind system:/config for changes
+ * @param session  used to invalidate the kernel's caches of changed files, may be NULL
+ * @return the watcher, or NULL if watching isn't possible (callers should fall back to polling)
+ */
+tWatcher * startWatcher( struct fuse_session * session )
+{
+    tWatcher * watcher = calloc( 1, sizeof( tWatcher ) );
+    if ( watcher == NULL )
+    {
+        logError( "failed to allocate watcher" );
+        return NULL;
+    }
+
+    watcher->session    = session;
+    watcher->inotifyFd  = -1;
+    watcher->stopFd     = -1;
+    watcher->lastChange = &watcher->changes;
+    pthread_mutex_init( &watcher->lock, NULL );
+
+    watcher->parent = keyNew( kConfigRoot, KEY_END );
+    watcher->kdb    = kdbOpen( NULL, watcher->parent );
+    watcher->keySet = ksNew( 0, KS_END );
+    if ( watcher->kdb == NULL || watcher->keySet == NULL )
+    {
+        logError( "unable to open libelektra for the watcher" );
+        stopWatcher( watcher );
+        return NULL;
+    }
+
+    /* take the initial signatures. As a side-effect, kdbGet() sets the value of
+     * the parent key to the path of the file that backs it */
+    rescanPackages( watcher, no );
+
+    char *       storageDir  = NULL;
+    const char * storageFile = keyString( watcher->parent );
+    if ( storageFile != NULL && storageFile[0] == '/' )
+    {
+        const char * slash = strrchr( storageFile, '/' );
+        storageDir = ( slash == storageFile ) ? strdup( "/" ) : strndup( storageFile, slash - storageFile );
+        watcher->storageName = strdup( slash + 1 );
+    }
+    else
+    {
+        storageDir = strdup( kDefaultStorageDir );
+    }
+    logDebug( "watching \'%s\' for \'%s\'", storageDir, watcher->storageName ? watcher->storageName : "*" );
+
+    /* watch the directory, not the file, since the file is replaced rather than rewritten */
+    watcher->inotifyFd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( watcher->inotifyFd < 0
+      || inotify_add_watch( watcher->inotifyFd, storageDir,
+                            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE ) < 0 )
+    {
+        logError( "unable to watch \'%s\'", storageDir );
+        free( storageDir );
+        stopWatcher( watcher );
+        return NULL;
+    }
+    free( storageDir );
+
+    watcher->stopFd = eventfd( 0, EFD_CLOEXEC );
+    if ( watcher->stopFd < 0 )
+    {
+        logError( "unable to create the watcher's eventfd" );
+        stopWatcher( watcher );
+        return NULL;
+    }
+
+    errno = pthread_create( &watcher->thread, NULL, watcherThread, watcher );
+    if ( errno != 0 )
+    {
+        logError( "unable to start the watcher thread" );
+        close( watcher->stopFd );
+        watcher->stopFd = -1;   // so stopWatcher() won't try to join it
+        stopWatcher( watcher );
+        return NULL;
+    }
+
+    return watcher;
+}
+
+/**
+ * @brief stop the watcher thread and release everything it holds
+ * @param watcher
+ */
+void stopWatcher( tWatcher * watcher )
+{
+    if ( watcher == NULL )
+    {
+        return;
+    }
+
+    if ( watcher->stopFd >= 0 )
+    {
+        uint64_t one = 1;
+        if ( write( watcher->stopFd, &one, sizeof( one ) ) == sizeof( one ) )
+        {
+            pthread_join( watcher->thread, NULL );
+        }
+        close( watcher->stopFd );
+    }
+    if ( watcher->inotifyFd >= 0 )
+    {
+        close( watcher->inotifyFd );
+    }
+
+    if ( watcher->kdb != NULL )
+    {
+        kdbClose( watcher->kdb, watcher->parent );
+    }
+    if ( watcher->keySet != NULL )
+    {
+        ksDel( watcher->keySet );
+    }
+    keyDel( watcher->parent );
+
+    freePackageSigs( watcher->packages, watcher->packageCount );
+    free( watcher->storageName );
+
+    tBool removed;
+    char * path;
+    while ( (path = takeChangedPackage( watcher, &removed )) != NULL )
+    {
+        free( path );
+    }
+    pthread_mutex_destroy( &watcher->lock );
+
+    free( watcher );
+}
+
+/**
+ * @brief a cheap check for whether takeChangedPackage() has anything to return,
+ * so callers can avoid taking heavier locks when the backend is quiet
+ * @param watcher
+ * @return
+ */
+tBool hasChangedPackages( tWatcher * watcher )
+{
+    pthread_mutex_lock( &watcher->lock );
+    tBool result = ( watcher->changes != NULL );
+    pthread_mutex_unlock( &watcher->lock );
+
+    return result;
+}
+
+/**
+ * @brief pop the oldest change off the queue
+ * @param watcher
+ * @param removed set to yes if the package has been removed from the backend
+ * @return the path of the package, which the caller must free, or NULL if nothing has changed
+ */
+char * takeChangedPackage( tWatcher * watcher, tBool * removed )
+{
+    char * result = NULL;
+
+    pthread_mutex_lock( &watcher->lock );
+    tChange * change = watcher->changes;
+    if ( change != NULL )
+    {
+        watcher->changes = change->next;
+        if ( watcher->changes == NULL )
+        {
+            watcher->lastChange = &watcher->changes;
+        }
+    }
+    pthread_mutex_unlock( &watcher->lock );
+
+    if ( change != NULL )
+    {
+        result   = change->path;
+        *removed = change->removed;
+        free( change );
+    }
+    return result;
+}
@@ -0,0 +1,15 @@
+#ifndef UCIFS_WATCHER_H
+#define UCIFS_WATCHER_H
+
+#include "logStuff.h"
+
+struct fuse_session;
+
+typedef struct sWatcher tWatcher;
+
+tWatcher *  startWatcher( struct fuse_session * session );
+void        stopWatcher(  tWatcher * watcher );
+tBool       hasChangedPackages( tWatcher * watcher );
+char *      takeChangedPackage( tWatcher * watcher, tBool * removed );
+
+#endif //UCIFS_WATCHER_H